@@ -1,5 +1,6 @@
 # SPDX-License-Identifier: GPL-3.0-or-later
 COMPRESS_IMAGE	 = $(FEATURESDIR)/compress/bin/compress-image
 COMPRESS	?= gzip
+COMPRESS_FRAME_SIZE ?=
 
 .PHONY: compress
@@ -51,17 +51,16 @@ list_shift(struct list_tail **head)
 		l = l->next;
 	}
 
+	if (p == l)
+		*head = NULL;
+	else
+		p->next = NULL;
+
 	if (l) {
 		if (l->data)
 			free(l->data);
 		free(l);
 	}
-
-	if (p)
-		p->next = NULL;
-
-	if (p == l)
-		*head = NULL;
 }
 
 void
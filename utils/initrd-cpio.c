@@ -13,7 +13,6 @@
 //#include "initrd.h"
 #include "initrd-cpio.h"
 
-#define CPIO_HEADER_SIZE 110
 #define CPIO_TRAILER "TRAILER!!!"
 
 #define CPIO_FORMAT_NEWASCII "070701"
@@ -112,6 +111,243 @@ read_cpio(struct cpio *a)
 	return offset;
 }
 
+void
+cpio_stream_init(struct cpio_stream *s, cpio_header_fn header_fn, cpio_body_fn body_fn, void *data)
+{
+	memset(s, 0, sizeof(*s));
+
+	s->state     = CPIO_STREAM_HEADER;
+	s->header_fn = header_fn;
+	s->body_fn   = body_fn;
+	s->data      = data;
+}
+
+static void
+stream_enter(struct cpio_stream *s, enum cpio_stream_state state, unsigned long left)
+{
+	s->state = state;
+	s->left  = left;
+	s->fill  = 0;
+}
+
+static void
+stream_emit(struct cpio_stream *s)
+{
+	if (s->header_fn)
+		s->header_fn(&s->header, s->data);
+}
+
+static void
+stream_start_entry(struct cpio_stream *s)
+{
+	if (memcmp(s->raw, CPIO_FORMAT_OLDASCII, CPIO_FORMAT_LENGTH) == 0)
+		errx(EXIT_FAILURE, "incorrect cpio method used: use -H newc option");
+
+	if (memcmp(s->raw, CPIO_FORMAT_NEWASCII, CPIO_FORMAT_LENGTH))
+		errx(EXIT_FAILURE, "no cpio magic");
+
+	parse_header(s->raw, &s->header);
+
+	if (s->header.name_len > PATH_MAX)
+		errx(EXIT_FAILURE, "name is too long: %lu bytes", s->header.name_len);
+
+	s->header.name = s->name;
+	s->header.body = NULL;
+
+	stream_enter(s, CPIO_STREAM_NAME, N_ALIGN(s->header.name_len));
+}
+
+static void
+stream_end_name(struct cpio_stream *s)
+{
+	struct cpio_header *h = &s->header;
+	unsigned long end;
+
+	s->name[h->name_len] = '\0';
+
+	if (!strncmp(s->name, CPIO_TRAILER, strlen(CPIO_TRAILER))) {
+		end = (s->offset + h->body_len + 3) & ~3UL;
+		end = (end + 511) & ~511UL;
+		stream_enter(s, CPIO_STREAM_TRAILER, end - s->offset);
+		return;
+	}
+
+	if (S_ISLNK(h->mode) && h->body_len <= PATH_MAX) {
+		stream_enter(s, CPIO_STREAM_LINK, h->body_len);
+		return;
+	}
+
+	stream_emit(s);
+	stream_enter(s, CPIO_STREAM_BODY, h->body_len);
+}
+
+static void
+stream_end_link(struct cpio_stream *s)
+{
+	struct cpio_header *h = &s->header;
+
+	s->link[h->body_len] = '\0';
+	h->body = s->link;
+
+	stream_emit(s);
+
+	if (h->body_len && s->body_fn)
+		s->body_fn(h, (unsigned char *) s->link, h->body_len, s->data);
+
+	stream_enter(s, CPIO_STREAM_PAD, (4 - (s->offset & 3)) & 3);
+}
+
+/*
+ * Moves on from the states that have nothing left to read, so that an entry
+ * is reported as soon as its last byte is fed.
+ */
+static void
+stream_advance(struct cpio_stream *s)
+{
+	while (!s->left) {
+		switch (s->state) {
+			case CPIO_STREAM_NAME:
+				stream_end_name(s);
+				break;
+			case CPIO_STREAM_LINK:
+				stream_end_link(s);
+				break;
+			case CPIO_STREAM_BODY:
+				stream_enter(s, CPIO_STREAM_PAD, (4 - (s->offset & 3)) & 3);
+				break;
+			case CPIO_STREAM_PAD:
+				stream_enter(s, CPIO_STREAM_HEADER, 0);
+				return;
+			case CPIO_STREAM_TRAILER:
+				stream_enter(s, CPIO_STREAM_DONE, 0);
+				return;
+			default:
+				return;
+		}
+	}
+}
+
+static void
+stream_keep(struct cpio_stream *s, char *dst, unsigned long size, const unsigned char *buf, unsigned long len)
+{
+	if (s->fill >= size)
+		return;
+	if (len > size - s->fill)
+		len = size - s->fill;
+	memcpy(dst + s->fill, buf, len);
+	s->fill += len;
+}
+
+/*
+ * Returns the number of bytes used. It is less than len only if the end of
+ * the archive has been reached.
+ */
+unsigned long
+cpio_stream_feed(struct cpio_stream *s, const unsigned char *buf, unsigned long len)
+{
+	unsigned long n, used = 0;
+
+	while (used < len && s->state != CPIO_STREAM_DONE) {
+		n = len - used;
+
+		if (s->state == CPIO_STREAM_HEADER) {
+			if (n > CPIO_HEADER_SIZE - s->fill)
+				n = CPIO_HEADER_SIZE - s->fill;
+
+			memcpy(s->raw + s->fill, buf + used, n);
+			s->fill += n;
+			s->offset += n;
+			used += n;
+
+			if (s->fill == CPIO_HEADER_SIZE)
+				stream_start_entry(s);
+			continue;
+		}
+
+		if (n > s->left)
+			n = s->left;
+
+		switch (s->state) {
+			case CPIO_STREAM_NAME:
+				stream_keep(s, s->name, s->header.name_len, buf + used, n);
+				break;
+			case CPIO_STREAM_LINK:
+				stream_keep(s, s->link, s->header.body_len, buf + used, n);
+				break;
+			case CPIO_STREAM_BODY:
+				if (s->body_fn)
+					s->body_fn(&s->header, buf + used, n, s->data);
+				break;
+			default:
+				break;
+		}
+
+		s->left -= n;
+		s->offset += n;
+		used += n;
+
+		stream_advance(s);
+	}
+
+	return used;
+}
+
+/*
+ * The archive may end without a trailer, but not in the middle of an entry.
+ */
+int
+cpio_stream_complete(const struct cpio_stream *s)
+{
+	switch (s->state) {
+		case CPIO_STREAM_HEADER:
+			return !s->fill;
+		case CPIO_STREAM_TRAILER:
+		case CPIO_STREAM_DONE:
+			return 1;
+		default:
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Finds the end of the archive without keeping the headers. Returns zero
+ * if the data is not a complete archive.
+ */
+unsigned long
+cpio_size(const unsigned char *raw, unsigned long size)
+{
+	struct cpio_header h;
+	unsigned long offset = 0;
+	int trailer;
+
+	while (offset < size) {
+		if (size - offset < CPIO_HEADER_SIZE ||
+		    memcmp(raw + offset, CPIO_FORMAT_NEWASCII, CPIO_FORMAT_LENGTH))
+			return 0;
+
+		parse_header(raw + offset, &h);
+		offset += CPIO_HEADER_SIZE;
+
+		if (N_ALIGN(h.name_len) > size - offset ||
+		    h.body_len > size - offset - N_ALIGN(h.name_len))
+			return 0;
+
+		trailer = (h.name_len >= strlen(CPIO_TRAILER) &&
+		           !memcmp(raw + offset, CPIO_TRAILER, strlen(CPIO_TRAILER)));
+
+		offset += N_ALIGN(h.name_len) + h.body_len;
+		offset = (offset + 3) & ~3UL;
+
+		if (trailer) {
+			offset = (offset + 511) & ~511UL;
+			break;
+		}
+	}
+
+	return (offset < size) ? offset : size;
+}
+
 static unsigned long
 push_hdr(const char *s, unsigned long offset, FILE *output)
 {
@@ -160,8 +396,26 @@ push_pad(unsigned long offset, FILE *output)
 	return offset;
 }
 
+static int
+has_body(mode_t mode)
+{
+	switch (mode & S_IFMT) {
+		case S_IFBLK:
+		case S_IFCHR:
+		case S_IFDIR:
+		case S_IFIFO:
+		case S_IFSOCK:
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Writes the header and the name. The body, if any, is expected to follow
+ * and has to be padded with write_cpio_pad().
+ */
 unsigned long
-write_cpio(struct cpio_header *data, unsigned long offset, FILE *output)
+write_cpio_header(struct cpio_header *data, unsigned long offset, FILE *output)
 {
 	char s[256];
 
@@ -185,22 +439,33 @@ write_cpio(struct cpio_header *data, unsigned long offset, FILE *output)
 
 	offset = push_hdr(s, offset, output);
 
-	switch (data->mode & S_IFMT) {
-		case S_IFBLK:
-		case S_IFCHR:
-		case S_IFDIR:
-		case S_IFIFO:
-		case S_IFSOCK:
-			offset = push_rest(data->name, offset, output);
-			return offset;
-	}
+	if (!has_body(data->mode))
+		return push_rest(data->name, offset, output);
 
 	offset = push_string(data->name, offset, output);
-	offset = push_pad(offset, output);
+	return push_pad(offset, output);
+}
+
+unsigned long
+write_cpio_body(const unsigned char *buf, unsigned long len, unsigned long offset, FILE *output)
+{
+	fwrite(buf, len, 1, output);
+	return offset + len;
+}
+
+unsigned long
+write_cpio_pad(unsigned long offset, FILE *output)
+{
+	return push_pad(offset, output);
+}
 
-	if (data->body_len) {
-		fwrite(data->body, data->body_len, 1, output);
-		offset += data->body_len;
+unsigned long
+write_cpio(struct cpio_header *data, unsigned long offset, FILE *output)
+{
+	offset = write_cpio_header(data, offset, output);
+
+	if (has_body(data->mode) && data->body_len) {
+		offset = write_cpio_body((unsigned char *) data->body, data->body_len, offset, output);
 		offset = push_pad(offset, output);
 	}
 
@@ -242,10 +507,18 @@ write_trailer(unsigned long offset, FILE *output)
 void
 cpio_free(struct cpio *c)
 {
+	struct list_tail *l;
+
+	for (l = c->allocated ? c->headers : NULL; l; l = l->next) {
+		free(((struct cpio_header *) l->data)->name);
+		free(((struct cpio_header *) l->data)->body);
+	}
+
 	list_free(c->headers);
 
 	c->compress = NULL;
 	c->raw      = NULL;
-	c->size     = 0;
-	c->headers  = NULL;
+	c->size      = 0;
+	c->allocated = 0;
+	c->headers   = NULL;
 }
@@ -2,8 +2,12 @@
 #ifndef INITRD_CPIO_H
 #define INITRD_CPIO_H
 
+#include <limits.h>
+
 #include "initrd-common.h"
 
+#define CPIO_HEADER_SIZE 110
+
 enum cpio_type {
 	CPIO_UNKNOWN = 0,
 	CPIO_ARCHIVE,
@@ -17,6 +21,9 @@ struct cpio {
 	unsigned char *raw;
 	unsigned long size;
 
+	/* The names and bodies of the headers are allocated. */
+	short allocated;
+
 	struct list_tail *headers;
 };
 
@@ -33,11 +40,55 @@ struct cpio_header {
 };
 
 unsigned long read_cpio(struct cpio *archive);
+unsigned long cpio_size(const unsigned char *raw, unsigned long size);
 void cpio_free(struct cpio *archive);
 
+typedef void (*cpio_header_fn)(struct cpio_header *header, void *data);
+typedef void (*cpio_body_fn)(struct cpio_header *header, const unsigned char *buf, unsigned long len, void *data);
+
+enum cpio_stream_state {
+	CPIO_STREAM_HEADER = 0,
+	CPIO_STREAM_NAME,
+	CPIO_STREAM_LINK,
+	CPIO_STREAM_BODY,
+	CPIO_STREAM_PAD,
+	CPIO_STREAM_TRAILER,
+	CPIO_STREAM_DONE,
+};
+
+/*
+ * Parses an archive that is fed in chunks of any size. Only the current
+ * header, its name and the target of a symlink are kept, the other bodies
+ * are passed to body_fn as they come. The name and the body of the header
+ * are valid only during the callback.
+ */
+struct cpio_stream {
+	enum cpio_stream_state state;
+	unsigned long offset;
+	unsigned long left;
+	unsigned long fill;
+
+	unsigned char raw[CPIO_HEADER_SIZE];
+	char name[PATH_MAX + 1];
+	char link[PATH_MAX + 1];
+
+	struct cpio_header header;
+
+	cpio_header_fn header_fn;
+	cpio_body_fn body_fn;
+	void *data;
+};
+
+void cpio_stream_init(struct cpio_stream *stream, cpio_header_fn header_fn, cpio_body_fn body_fn, void *data);
+unsigned long cpio_stream_feed(struct cpio_stream *stream, const unsigned char *buf, unsigned long len);
+int cpio_stream_complete(const struct cpio_stream *stream);
+
 #include <stdio.h>
 
 unsigned long write_cpio(struct cpio_header *data, unsigned long offset, FILE *output);
+unsigned long write_cpio_header(struct cpio_header *data, unsigned long offset, FILE *output);
+unsigned long write_cpio_body(const unsigned char *buf, unsigned long len, unsigned long offset, FILE *output);
+unsigned long write_cpio_pad(unsigned long offset, FILE *output);
 void write_trailer(unsigned long offset, FILE *output);
 
 #endif /* INITRD_CPIO_H */
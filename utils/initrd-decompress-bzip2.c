@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <err.h>
 #include <bzlib.h>
 
@@ -11,15 +12,14 @@
 #define CHUNK 0x4000
 
 int
-bunzip2(unsigned char *in, unsigned long in_size,
-        unsigned char **out, unsigned long *out_size,
-        unsigned long long *inread)
+bunzip2_stream(unsigned char *in, unsigned long in_size,
+               decompress_sink_fn sink, void *data,
+               unsigned long long *inread)
 {
 	int ret;
-	unsigned long have, out_offset, total_in_hi32;
+	unsigned long have, total_in_hi32;
 	bz_stream strm;
 	char obuf[CHUNK];
-	out_offset = 0;
 
 	/* allocate inflate state */
 	strm.bzalloc  = NULL;
@@ -45,15 +45,64 @@ bunzip2(unsigned char *in, unsigned long in_size,
 
 		have = CHUNK - strm.avail_out;
 
-		*out_size += have;
-		*out = realloc(*out, sizeof(unsigned char *) * (*out_size));
+		if (have && sink((unsigned char *) obuf, have, data) != DECOMP_OK) {
+			ret = BZ_DATA_ERROR;
+			break;
+		}
+	} while (!strm.avail_out);
 
-		if (*out == NULL)
-			err(EXIT_FAILURE, "ERROR: %s: %d: realloc", __FILE__, __LINE__);
+	total_in_hi32 = strm.total_in_hi32;
+	*inread += (total_in_hi32 << 32) + strm.total_in_lo32;
 
-		memcpy(*out + out_offset, obuf, have);
-		out_offset += have;
-	} while (!strm.avail_out);
+	/* clean up and return */
+	BZ2_bzDecompressEnd(&strm);
+
+	return ret == BZ_STREAM_END ? DECOMP_OK : DECOMP_FAIL;
+}
+
+/*
+ * bzip2 does not record the size of the data, so the buffer just grows.
+ */
+int
+bunzip2(unsigned char *in, unsigned long in_size,
+        unsigned char **out, unsigned long *out_size,
+        unsigned long long *inread)
+{
+	int ret;
+	unsigned long avail, total_in_hi32;
+	bz_stream strm;
+	struct decompress_output o;
+
+	/* allocate inflate state */
+	strm.bzalloc  = NULL;
+	strm.bzfree   = NULL;
+	strm.opaque   = NULL;
+	strm.avail_in = 0;
+	strm.next_in  = NULL;
+
+	if ((ret = BZ2_bzDecompressInit(&strm, 0, 0)) != BZ_OK)
+		return DECOMP_FAIL;
+
+	strm.avail_in = (unsigned int) in_size;
+	strm.next_in  = (char *) in;
+
+	decompress_output_init(&o, *out, *out_size, 0);
+
+	do {
+		if (o.size == o.capacity)
+			decompress_output_grow(&o);
+
+		avail = o.capacity - o.size;
+		if (avail > UINT_MAX)
+			avail = UINT_MAX;
+
+		strm.avail_out = (unsigned int) avail;
+		strm.next_out  = (char *) o.addr + o.size;
+
+		ret = BZ2_bzDecompress(&strm);
+
+		o.size += avail - strm.avail_out;
+	} while (ret == BZ_OK && (strm.avail_in || !strm.avail_out));
 
 	total_in_hi32 = strm.total_in_hi32;
 	*inread += (total_in_hi32 << 32) + strm.total_in_lo32;
@@ -61,5 +110,7 @@ bunzip2(unsigned char *in, unsigned long in_size,
 	/* clean up and return */
 	BZ2_bzDecompressEnd(&strm);
 
+	decompress_output_finish(&o, out, out_size);
+
 	return ret == BZ_STREAM_END ? DECOMP_OK : DECOMP_FAIL;
 }
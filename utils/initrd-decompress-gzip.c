@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <err.h>
 #include "zlib.h"
 
@@ -12,16 +13,37 @@
 #define windowBits 15
 #define CHUNK 0x4000
 
+/* The best compression ratio that deflate can achieve. */
+#define MAX_RATIO 1032
+
+/*
+ * The gzip trailer ends with the size of the uncompressed data modulo 2^32.
+ * It is only a guess since the input may not end with this member.
+ */
+static unsigned long
+gzip_size_hint(const unsigned char *in, unsigned long in_size)
+{
+	unsigned long size;
+
+	if (in_size < 18)
+		return 0;
+
+	in += in_size - 4;
+	size = (unsigned long) in[0] | (unsigned long) in[1] << 8 |
+	       (unsigned long) in[2] << 16 | (unsigned long) in[3] << 24;
+
+	return (size / MAX_RATIO <= in_size) ? size : 0;
+}
+
 int
-gunzip(unsigned char *in, unsigned long in_size,
-       unsigned char **out, unsigned long *out_size,
-       unsigned long long *inread)
+gunzip_stream(unsigned char *in, unsigned long in_size,
+              decompress_sink_fn sink, void *data,
+              unsigned long long *inread)
 {
 	int ret;
-	unsigned long have, out_offset;
+	unsigned long have;
 	z_stream strm;
 	unsigned char obuf[CHUNK];
-	out_offset = 0;
 
 	/* allocate inflate state */
 	strm.zalloc   = Z_NULL;
@@ -47,20 +69,67 @@ gunzip(unsigned char *in, unsigned long in_size,
 
 		have = CHUNK - strm.avail_out;
 
-		*out_size += have;
-		*out = realloc(*out, sizeof(unsigned char *) * (*out_size));
+		if (have && sink(obuf, have, data) != DECOMP_OK) {
+			ret = Z_DATA_ERROR;
+			break;
+		}
+	} while (!strm.avail_out);
 
-		if (*out == NULL)
-			err(EXIT_FAILURE, "ERROR: %s: %d: realloc", __FILE__, __LINE__);
+	*inread += strm.total_in;
 
-		memcpy(*out + out_offset, obuf, have);
-		out_offset += have;
-	} while (!strm.avail_out);
+	/* clean up and return */
+	inflateEnd(&strm);
+
+	return ret == Z_STREAM_END ? DECOMP_OK : DECOMP_FAIL;
+}
+
+int
+gunzip(unsigned char *in, unsigned long in_size,
+       unsigned char **out, unsigned long *out_size,
+       unsigned long long *inread)
+{
+	int ret;
+	unsigned long avail;
+	z_stream strm;
+	struct decompress_output o;
+
+	/* allocate inflate state */
+	strm.zalloc   = Z_NULL;
+	strm.zfree    = Z_NULL;
+	strm.opaque   = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in  = Z_NULL;
+
+	if ((ret = inflateInit2(&strm, windowBits | ENABLE_ZLIB_GZIP)) != Z_OK)
+		return DECOMP_FAIL;
+
+	strm.avail_in = (unsigned int) in_size;
+	strm.next_in  = in;
+
+	decompress_output_init(&o, *out, *out_size, gzip_size_hint(in, in_size));
+
+	do {
+		if (o.size == o.capacity)
+			decompress_output_grow(&o);
+
+		avail = o.capacity - o.size;
+		if (avail > UINT_MAX)
+			avail = UINT_MAX;
+
+		strm.avail_out = (unsigned int) avail;
+		strm.next_out  = o.addr + o.size;
+
+		ret = inflate(&strm, Z_NO_FLUSH);
+
+		o.size += avail - strm.avail_out;
+	} while (ret == Z_OK);
 
 	*inread += strm.total_in;
 
 	/* clean up and return */
 	inflateEnd(&strm);
 
+	decompress_output_finish(&o, out, out_size);
+
 	return ret == Z_STREAM_END ? DECOMP_OK : DECOMP_FAIL;
 }
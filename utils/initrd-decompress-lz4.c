@@ -0,0 +1,355 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <err.h>
+
+#include <lz4.h>
+#include <lz4frame.h>
+
+#include "initrd-decompress.h"
+
+#define CHUNK 0x10000
+
+#define LZ4_FRAME_MAGIC  0x184D2204U
+#define LZ4_LEGACY_MAGIC 0x184C2102U
+
+/*
+ * The legacy format (lz4 -l) is the one the kernel understands. It is a
+ * sequence of blocks, each of them has 8M of data except the last one.
+ * There is no end marker, so the stream ends after a short block unless
+ * another stream follows, at the end of the input or where the block size
+ * makes no sense. The end can't be found without decompression.
+ */
+#define LZ4_LEGACY_BLOCK_SIZE (8 << 20)
+#define LZ4_LEGACY_BOUND      LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCK_SIZE)
+
+/* The flags in the frame descriptor. */
+#define LZ4_FLG_DICT_ID       0x01
+#define LZ4_FLG_CONTENT_SUM   0x04
+#define LZ4_FLG_CONTENT_SIZE  0x08
+#define LZ4_FLG_BLOCK_SUM     0x10
+
+static void *
+xmalloc(size_t size)
+{
+	void *r = malloc(size);
+	if (!r)
+		err(EXIT_FAILURE, "malloc: allocating %lu bytes", (unsigned long) size);
+	return r;
+}
+
+static unsigned int
+get_le32(const unsigned char *p)
+{
+	return (unsigned int) p[0] | (unsigned int) p[1] << 8 |
+	       (unsigned int) p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+/*
+ * Returns the size of the next legacy block or zero at the end of the
+ * stream. Concatenated streams are read as one.
+ */
+static unsigned int
+lz4_legacy_block(const unsigned char *in, unsigned long in_size, unsigned long *pos, int more)
+{
+	unsigned int size;
+
+	while (in_size - *pos >= 4) {
+		size = get_le32(in + *pos);
+
+		if (size == LZ4_LEGACY_MAGIC) {
+			*pos += 4;
+			more = 1;
+			continue;
+		}
+
+		if (!more || !size || size > LZ4_LEGACY_BOUND)
+			break;
+
+		*pos += 4;
+		return size;
+	}
+
+	return 0;
+}
+
+static unsigned long
+lz4_frame_size(const unsigned char *in, unsigned long in_size)
+{
+	unsigned long pos;
+	unsigned int flg, size;
+
+	if (in_size < 7)
+		return 0;
+
+	flg = in[4];
+	pos = 7;
+
+	if (flg & LZ4_FLG_CONTENT_SIZE)
+		pos += 8;
+	if (flg & LZ4_FLG_DICT_ID)
+		pos += 4;
+
+	while (1) {
+		if (in_size < pos || in_size - pos < 4)
+			return 0;
+
+		size = get_le32(in + pos);
+		pos += 4;
+
+		if (!size)
+			break;
+
+		pos += size & 0x7fffffffU;
+
+		if (flg & LZ4_FLG_BLOCK_SUM)
+			pos += 4;
+	}
+
+	if (flg & LZ4_FLG_CONTENT_SUM)
+		pos += 4;
+
+	return (pos <= in_size) ? pos : 0;
+}
+
+/*
+ * The block headers are enough to find the end of a frame, nothing is
+ * decompressed. If the data is damaged or in the legacy format, the size
+ * is unknown (zero).
+ */
+unsigned long
+lz4_size(const unsigned char *in, unsigned long in_size)
+{
+	if (in_size < 4 || get_le32(in) != LZ4_FRAME_MAGIC)
+		return 0;
+
+	return lz4_frame_size(in, in_size);
+}
+
+/*
+ * The frame header may have the size of the content.
+ */
+static unsigned long
+lz4_size_hint(const unsigned char *in, unsigned long in_size)
+{
+	unsigned long long size = 0;
+	int i;
+
+	if (in_size < 14 || get_le32(in) != LZ4_FRAME_MAGIC || !(in[4] & LZ4_FLG_CONTENT_SIZE))
+		return 0;
+
+	for (i = 13; i >= 6; i--)
+		size = size << 8 | in[i];
+
+	return (size <= ULONG_MAX) ? (unsigned long) size : 0;
+}
+
+static int
+lz4_decode_block(const unsigned char *in, unsigned int in_size, unsigned char *out, int *out_size)
+{
+	*out_size = LZ4_decompress_safe((const char *) in, (char *) out, (int) in_size, LZ4_LEGACY_BLOCK_SIZE);
+
+	if (*out_size < 0) {
+		warnx("ERROR: %s: %d: LZ4_decompress_safe: corrupted block", __FILE__, __LINE__);
+		return DECOMP_FAIL;
+	}
+
+	return DECOMP_OK;
+}
+
+static int
+unlz4_legacy_stream(unsigned char *in, unsigned long in_size,
+                    decompress_sink_fn sink, void *data,
+                    unsigned long long *inread)
+{
+	unsigned char *obuf;
+	unsigned long pos = 4;
+	unsigned int size;
+	int have = LZ4_LEGACY_BLOCK_SIZE, rc = DECOMP_OK;
+
+	obuf = xmalloc(LZ4_LEGACY_BLOCK_SIZE);
+
+	while ((size = lz4_legacy_block(in, in_size, &pos, have == LZ4_LEGACY_BLOCK_SIZE)) != 0) {
+		if (size > in_size - pos) {
+			warnx("ERROR: %s: %d: unexpected end of lz4 data", __FILE__, __LINE__);
+			rc = DECOMP_FAIL;
+			break;
+		}
+
+		if ((rc = lz4_decode_block(in + pos, size, obuf, &have)) != DECOMP_OK)
+			break;
+
+		pos += size;
+
+		if (have && sink(obuf, (unsigned long) have, data) != DECOMP_OK) {
+			rc = DECOMP_FAIL;
+			break;
+		}
+	}
+
+	*inread += pos;
+
+	free(obuf);
+
+	return rc;
+}
+
+static int
+unlz4_legacy(unsigned char *in, unsigned long in_size,
+             unsigned char **out, unsigned long *out_size,
+             unsigned long long *inread)
+{
+	struct decompress_output o;
+	unsigned long pos = 4;
+	unsigned int size;
+	int have = LZ4_LEGACY_BLOCK_SIZE, rc = DECOMP_OK;
+
+	decompress_output_init(&o, *out, *out_size, 0);
+
+	while ((size = lz4_legacy_block(in, in_size, &pos, have == LZ4_LEGACY_BLOCK_SIZE)) != 0) {
+		if (size > in_size - pos) {
+			warnx("ERROR: %s: %d: unexpected end of lz4 data", __FILE__, __LINE__);
+			rc = DECOMP_FAIL;
+			break;
+		}
+
+		while (o.capacity - o.size < LZ4_LEGACY_BLOCK_SIZE)
+			decompress_output_grow(&o);
+
+		if ((rc = lz4_decode_block(in + pos, size, o.addr + o.size, &have)) != DECOMP_OK)
+			break;
+
+		pos += size;
+		o.size += (unsigned long) have;
+	}
+
+	*inread += pos;
+
+	decompress_output_finish(&o, out, out_size);
+
+	return rc;
+}
+
+static int
+unlz4_frame_stream(unsigned char *in, unsigned long in_size,
+                   decompress_sink_fn sink, void *data,
+                   unsigned long long *inread)
+{
+	LZ4F_dctx *dctx;
+	size_t ret, src_size, dst_size;
+	unsigned long pos = 0;
+	int rc = DECOMP_OK;
+
+	unsigned char obuf[CHUNK];
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+		warnx("ERROR: %s: %d: LZ4F_createDecompressionContext", __FILE__, __LINE__);
+		return DECOMP_FAIL;
+	}
+
+	do {
+		src_size = in_size - pos;
+		dst_size = CHUNK;
+
+		ret = LZ4F_decompress(dctx, obuf, &dst_size, in + pos, &src_size, NULL);
+
+		if (LZ4F_isError(ret)) {
+			warnx("ERROR: %s: %d: LZ4F_decompress: %s",
+			      __FILE__, __LINE__, LZ4F_getErrorName(ret));
+			rc = DECOMP_FAIL;
+			break;
+		}
+
+		pos += src_size;
+
+		if (dst_size && sink(obuf, dst_size, data) != DECOMP_OK) {
+			rc = DECOMP_FAIL;
+			break;
+		}
+		/* The input ended before the frame did. */
+		if (ret && !src_size && !dst_size)
+			rc = DECOMP_FAIL;
+	} while (ret && rc == DECOMP_OK);
+
+	*inread += pos;
+
+	LZ4F_freeDecompressionContext(dctx);
+
+	return rc;
+}
+
+static int
+unlz4_frame(unsigned char *in, unsigned long in_size,
+            unsigned char **out, unsigned long *out_size,
+            unsigned long long *inread)
+{
+	LZ4F_dctx *dctx;
+	size_t ret, src_size, dst_size;
+	unsigned long pos = 0;
+	int rc = DECOMP_OK;
+	struct decompress_output o;
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+		warnx("ERROR: %s: %d: LZ4F_createDecompressionContext", __FILE__, __LINE__);
+		return DECOMP_FAIL;
+	}
+
+	decompress_output_init(&o, *out, *out_size, lz4_size_hint(in, in_size));
+
+	do {
+		if (o.size == o.capacity)
+			decompress_output_grow(&o);
+
+		src_size = in_size - pos;
+		dst_size = o.capacity - o.size;
+
+		ret = LZ4F_decompress(dctx, o.addr + o.size, &dst_size, in + pos, &src_size, NULL);
+
+		if (LZ4F_isError(ret)) {
+			warnx("ERROR: %s: %d: LZ4F_decompress: %s",
+			      __FILE__, __LINE__, LZ4F_getErrorName(ret));
+			rc = DECOMP_FAIL;
+			break;
+		}
+
+		pos += src_size;
+		o.size += dst_size;
+
+		/* The input ended before the frame did. */
+		if (ret && !src_size && !dst_size)
+			rc = DECOMP_FAIL;
+	} while (ret && rc == DECOMP_OK);
+
+	*inread += pos;
+
+	LZ4F_freeDecompressionContext(dctx);
+
+	decompress_output_finish(&o, out, out_size);
+
+	return rc;
+}
+
+int
+unlz4_stream(unsigned char *in, unsigned long in_size,
+             decompress_sink_fn sink, void *data,
+             unsigned long long *inread)
+{
+	if (in_size >= 4 && get_le32(in) == LZ4_LEGACY_MAGIC)
+		return unlz4_legacy_stream(in, in_size, sink, data, inread);
+
+	return unlz4_frame_stream(in, in_size, sink, data, inread);
+}
+
+int
+unlz4(unsigned char *in, unsigned long in_size,
+      unsigned char **out, unsigned long *out_size,
+      unsigned long long *inread)
+{
+	if (in_size >= 4 && get_le32(in) == LZ4_LEGACY_MAGIC)
+		return unlz4_legacy(in, in_size, out, out_size, inread);
+
+	return unlz4_frame(in, in_size, out, out_size, inread);
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <err.h>
 
 #include <lzma.h>
@@ -11,20 +12,110 @@
 
 #define CHUNK 0x4000
 
-int
-unlzma(unsigned char *in, unsigned long in_size,
-       unsigned char **out, unsigned long *out_size,
-       unsigned long long *inread)
+/* Much more than LZMA achieves on real data. */
+#define ALONE_MAX_RATIO 4096
+
+/*
+ * The index at the end of an xz stream has the size of the uncompressed
+ * data. It is only a guess since the input may not end with this stream.
+ */
+static unsigned long
+xz_size_hint(const unsigned char *in, unsigned long in_size)
+{
+	lzma_stream_flags flags;
+	lzma_index *index = NULL;
+	uint64_t memlimit = UINT64_MAX;
+	const unsigned char *footer;
+	lzma_vli size;
+	size_t pos = 0;
+
+	/* Skip the stream padding. */
+	while (in_size >= 2 * LZMA_STREAM_HEADER_SIZE + 4 && !memcmp(in + in_size - 4, "\0\0\0\0", 4))
+		in_size -= 4;
+
+	if (in_size < 2 * LZMA_STREAM_HEADER_SIZE)
+		return 0;
+
+	footer = in + in_size - LZMA_STREAM_HEADER_SIZE;
+
+	if (lzma_stream_footer_decode(&flags, footer) != LZMA_OK ||
+	    flags.backward_size > in_size - 2 * LZMA_STREAM_HEADER_SIZE)
+		return 0;
+
+	if (lzma_index_buffer_decode(&index, &memlimit, NULL, footer - flags.backward_size,
+	                             &pos, (size_t) flags.backward_size) != LZMA_OK)
+		return 0;
+
+	size = lzma_index_uncompressed_size(index);
+	lzma_index_end(index, NULL);
+
+	return (size <= ULONG_MAX) ? (unsigned long) size : 0;
+}
+
+/*
+ * The multithreaded decoder splits the work at the blocks that have their
+ * sizes in the block headers, like the ones written by xz -T. Other data
+ * is decoded on one thread.
+ */
+static lzma_ret
+xz_decoder_init(lzma_stream *strm)
+{
+#if LZMA_VERSION >= 50040002
+	if (decompress_threads > 1) {
+		lzma_mt mt = {
+			.threads            = decompress_threads,
+			.memlimit_threading = lzma_physmem() / 4,
+			.memlimit_stop      = UINT64_MAX,
+		};
+		return lzma_stream_decoder_mt(strm, &mt);
+	}
+#endif
+	return lzma_stream_decoder(strm, UINT64_MAX, 0);
+}
+
+static lzma_ret
+alone_decoder_init(lzma_stream *strm)
 {
-	unsigned long have, out_offset;
+	return lzma_alone_decoder(strm, UINT64_MAX);
+}
+
+/*
+ * The header of the legacy format has the size of the uncompressed data
+ * unless the stream ends with a marker. There is no checksum, so a size
+ * that is too big for the input is not trusted and the buffer just grows.
+ */
+static unsigned long
+alone_size_hint(const unsigned char *in, unsigned long in_size)
+{
+	uint64_t size = 0;
+	int i;
+
+	if (in_size < 13)
+		return 0;
+
+	for (i = 12; i >= 5; i--)
+		size = size << 8 | in[i];
+
+	if (size == UINT64_MAX || size / ALONE_MAX_RATIO > in_size)
+		return 0;
+
+	return (size <= ULONG_MAX) ? (unsigned long) size : 0;
+}
+
+static int
+lzma_decode_stream(lzma_ret (*init)(lzma_stream *),
+                   unsigned char *in, unsigned long in_size,
+                   decompress_sink_fn sink, void *data,
+                   unsigned long long *inread)
+{
+	unsigned long have;
 	lzma_ret ret;
 	lzma_stream strm   = LZMA_STREAM_INIT;
-	lzma_action action = LZMA_RUN;
+	lzma_action action = LZMA_FINISH;
 
 	unsigned char obuf[CHUNK];
-	out_offset = 0;
 
-	if (lzma_stream_decoder(&strm, UINT64_MAX, 0) != LZMA_OK)
+	if (init(&strm) != LZMA_OK)
 		return DECOMP_FAIL;
 
 	strm.avail_in = in_size;
@@ -41,20 +132,91 @@ unlzma(unsigned char *in, unsigned long in_size,
 
 		have = CHUNK - strm.avail_out;
 
-		*out_size += have;
-		*out = realloc(*out, sizeof(unsigned char *) * (*out_size));
+		if (have && sink(obuf, have, data) != DECOMP_OK) {
+			ret = LZMA_DATA_ERROR;
+			break;
+		}
+	} while (ret == LZMA_OK);
 
-		if (*out == NULL)
-			err(EXIT_FAILURE, "ERROR: %s: %d: realloc", __FILE__, __LINE__);
+	*inread += strm.total_in;
 
-		memcpy(*out + out_offset, obuf, have);
-		out_offset += have;
-	} while (!strm.avail_out);
+	/* clean up and return */
+	lzma_end(&strm);
+
+	return ret == LZMA_STREAM_END ? DECOMP_OK : DECOMP_FAIL;
+}
+
+static int
+lzma_decode(lzma_ret (*init)(lzma_stream *), unsigned long hint,
+            unsigned char *in, unsigned long in_size,
+            unsigned char **out, unsigned long *out_size,
+            unsigned long long *inread)
+{
+	lzma_ret ret;
+	lzma_stream strm   = LZMA_STREAM_INIT;
+	lzma_action action = LZMA_FINISH;
+	struct decompress_output o;
+
+	if (init(&strm) != LZMA_OK)
+		return DECOMP_FAIL;
+
+	strm.avail_in = in_size;
+	strm.next_in  = in;
+
+	decompress_output_init(&o, *out, *out_size, hint);
+
+	do {
+		if (o.size == o.capacity)
+			decompress_output_grow(&o);
+
+		strm.avail_out = o.capacity - o.size;
+		strm.next_out  = o.addr + o.size;
+
+		ret = lzma_code(&strm, action);
+
+		o.size = o.capacity - strm.avail_out;
+	} while (ret == LZMA_OK);
 
 	*inread += strm.total_in;
 
 	/* clean up and return */
 	lzma_end(&strm);
 
+	decompress_output_finish(&o, out, out_size);
+
 	return ret == LZMA_STREAM_END ? DECOMP_OK : DECOMP_FAIL;
 }
+
+int
+unlzma_stream(unsigned char *in, unsigned long in_size,
+              decompress_sink_fn sink, void *data,
+              unsigned long long *inread)
+{
+	return lzma_decode_stream(xz_decoder_init, in, in_size, sink, data, inread);
+}
+
+int
+unlzma(unsigned char *in, unsigned long in_size,
+       unsigned char **out, unsigned long *out_size,
+       unsigned long long *inread)
+{
+	return lzma_decode(xz_decoder_init, xz_size_hint(in, in_size),
+	                   in, in_size, out, out_size, inread);
+}
+
+int
+unlzma_alone_stream(unsigned char *in, unsigned long in_size,
+                    decompress_sink_fn sink, void *data,
+                    unsigned long long *inread)
+{
+	return lzma_decode_stream(alone_decoder_init, in, in_size, sink, data, inread);
+}
+
+int
+unlzma_alone(unsigned char *in, unsigned long in_size,
+             unsigned char **out, unsigned long *out_size,
+             unsigned long long *inread)
+{
+	return lzma_decode(alone_decoder_init, alone_size_hint(in, in_size),
+	                   in, in_size, out, out_size, inread);
+}
@@ -0,0 +1,290 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <err.h>
+
+#include <lzo/lzo1x.h>
+
+#include "initrd-decompress.h"
+
+/*
+ * The lzop file format. The header is followed by blocks, each of them has
+ * the sizes of the data before and after compression, optional checksums
+ * and the data itself. A block that does not get smaller is stored as is.
+ * The checksums are not verified, as in the kernel.
+ */
+static const unsigned char lzop_magic[9] = { 0x89, 0x4c, 0x5a, 0x4f, 0x00, 0x0d, 0x0a, 0x1a, 0x0a };
+
+#define F_ADLER32_D     0x00000001U
+#define F_ADLER32_C     0x00000002U
+#define F_H_EXTRA_FIELD 0x00000040U
+#define F_CRC32_D       0x00000100U
+#define F_CRC32_C       0x00000200U
+#define F_H_FILTER      0x00000800U
+
+/* lzop never writes bigger blocks. */
+#define LZOP_MAX_BLOCK_SIZE (64 << 20)
+
+struct lzop_block {
+	const unsigned char *data;
+	unsigned long src_len;
+	unsigned long dst_len;
+};
+
+static void *
+xmalloc(size_t size)
+{
+	void *r = malloc(size);
+	if (!r)
+		err(EXIT_FAILURE, "malloc: allocating %lu bytes", (unsigned long) size);
+	return r;
+}
+
+static unsigned long
+get_be16(const unsigned char *p)
+{
+	return (unsigned long) p[0] << 8 | (unsigned long) p[1];
+}
+
+static unsigned long
+get_be32(const unsigned char *p)
+{
+	return (unsigned long) p[0] << 24 | (unsigned long) p[1] << 16 |
+	       (unsigned long) p[2] << 8 | (unsigned long) p[3];
+}
+
+/*
+ * Returns the size of the header or zero if it can't be parsed or the data
+ * is compressed with a method or filter that the kernel does not support.
+ */
+static unsigned long
+lzop_header(const unsigned char *in, unsigned long in_size, unsigned long *flags)
+{
+	unsigned long version, method, pos = sizeof(lzop_magic);
+
+	if (in_size < pos + 30 || memcmp(in, lzop_magic, sizeof(lzop_magic)))
+		return 0;
+
+	version = get_be16(in + pos);
+	pos += 4; /* version, library version */
+
+	if (version < 0x0900)
+		return 0;
+	if (version >= 0x0940)
+		pos += 2; /* version needed to extract */
+
+	method = in[pos++];
+
+	if (method < 1 || method > 3)
+		return 0; /* not LZO1X */
+
+	if (version >= 0x0940)
+		pos += 1; /* level */
+
+	*flags = get_be32(in + pos);
+	pos += 4;
+
+	if (*flags & F_H_FILTER)
+		return 0;
+
+	pos += 8; /* mode, mtime */
+
+	if (version >= 0x0940)
+		pos += 4; /* mtime high */
+
+	pos += 1 + (unsigned long) in[pos] + 4; /* name, header checksum */
+
+	if (*flags & F_H_EXTRA_FIELD) {
+		if (pos + 4 > in_size)
+			return 0;
+		pos += 4 + get_be32(in + pos) + 4;
+	}
+
+	return (pos <= in_size) ? pos : 0;
+}
+
+/*
+ * Returns 1 if there is one more block, 0 at the end of the stream and -1
+ * if the data is damaged.
+ */
+static int
+lzop_next_block(const unsigned char *in, unsigned long in_size, unsigned long *pos,
+                unsigned long flags, struct lzop_block *b)
+{
+	unsigned long p = *pos;
+
+	if (in_size - p < 4)
+		return -1;
+
+	b->dst_len = get_be32(in + p);
+	p += 4;
+
+	if (!b->dst_len) {
+		*pos = p;
+		return 0;
+	}
+
+	if (in_size - p < 4)
+		return -1;
+
+	b->src_len = get_be32(in + p);
+	p += 4;
+
+	if (b->dst_len > LZOP_MAX_BLOCK_SIZE || !b->src_len || b->src_len > b->dst_len)
+		return -1;
+
+	if (flags & F_ADLER32_D)
+		p += 4;
+	if (flags & F_CRC32_D)
+		p += 4;
+
+	if (b->src_len < b->dst_len) {
+		if (flags & F_ADLER32_C)
+			p += 4;
+		if (flags & F_CRC32_C)
+			p += 4;
+	}
+
+	if (p > in_size || in_size - p < b->src_len)
+		return -1;
+
+	b->data = in + p;
+	*pos    = p + b->src_len;
+
+	return 1;
+}
+
+/*
+ * The block headers are enough to find the end of the stream, nothing is
+ * decompressed. If the data is damaged, the size is unknown (zero).
+ */
+unsigned long
+lzo_size(const unsigned char *in, unsigned long in_size)
+{
+	struct lzop_block b;
+	unsigned long flags, pos;
+	int ret;
+
+	if (!(pos = lzop_header(in, in_size, &flags)))
+		return 0;
+
+	while ((ret = lzop_next_block(in, in_size, &pos, flags, &b)) > 0);
+
+	return (ret == 0) ? pos : 0;
+}
+
+static int
+lzo_decode_block(const struct lzop_block *b, unsigned char *out)
+{
+	lzo_uint len = b->dst_len;
+	int ret;
+
+	if (b->src_len == b->dst_len) {
+		memcpy(out, b->data, b->dst_len);
+		return DECOMP_OK;
+	}
+
+	ret = lzo1x_decompress_safe(b->data, b->src_len, out, &len, NULL);
+
+	if (ret != LZO_E_OK || len != b->dst_len) {
+		warnx("ERROR: %s: %d: lzo1x_decompress_safe: %d", __FILE__, __LINE__, ret);
+		return DECOMP_FAIL;
+	}
+
+	return DECOMP_OK;
+}
+
+int
+unlzo_stream(unsigned char *in, unsigned long in_size,
+             decompress_sink_fn sink, void *data,
+             unsigned long long *inread)
+{
+	struct lzop_block b;
+	unsigned char *obuf = NULL;
+	unsigned long flags, pos, obuf_size = 0;
+	int ret, rc = DECOMP_OK;
+
+	if (lzo_init() != LZO_E_OK) {
+		warnx("ERROR: %s: %d: lzo_init", __FILE__, __LINE__);
+		return DECOMP_FAIL;
+	}
+
+	if (!(pos = lzop_header(in, in_size, &flags))) {
+		warnx("ERROR: %s: %d: unsupported lzop header", __FILE__, __LINE__);
+		return DECOMP_FAIL;
+	}
+
+	while ((ret = lzop_next_block(in, in_size, &pos, flags, &b)) > 0) {
+		if (b.dst_len > obuf_size) {
+			free(obuf);
+			obuf      = xmalloc(b.dst_len);
+			obuf_size = b.dst_len;
+		}
+
+		if (lzo_decode_block(&b, obuf) != DECOMP_OK ||
+		    sink(obuf, b.dst_len, data) != DECOMP_OK) {
+			rc = DECOMP_FAIL;
+			break;
+		}
+	}
+
+	if (ret < 0) {
+		warnx("ERROR: %s: %d: damaged lzop block", __FILE__, __LINE__);
+		rc = DECOMP_FAIL;
+	}
+
+	*inread += pos;
+
+	free(obuf);
+
+	return rc;
+}
+
+int
+unlzo(unsigned char *in, unsigned long in_size,
+      unsigned char **out, unsigned long *out_size,
+      unsigned long long *inread)
+{
+	struct lzop_block b;
+	struct decompress_output o;
+	unsigned long flags, pos;
+	int ret, rc = DECOMP_OK;
+
+	if (lzo_init() != LZO_E_OK) {
+		warnx("ERROR: %s: %d: lzo_init", __FILE__, __LINE__);
+		return DECOMP_FAIL;
+	}
+
+	if (!(pos = lzop_header(in, in_size, &flags))) {
+		warnx("ERROR: %s: %d: unsupported lzop header", __FILE__, __LINE__);
+		return DECOMP_FAIL;
+	}
+
+	decompress_output_init(&o, *out, *out_size, 0);
+
+	while ((ret = lzop_next_block(in, in_size, &pos, flags, &b)) > 0) {
+		while (o.capacity - o.size < b.dst_len)
+			decompress_output_grow(&o);
+
+		if (lzo_decode_block(&b, o.addr + o.size) != DECOMP_OK) {
+			rc = DECOMP_FAIL;
+			break;
+		}
+
+		o.size += b.dst_len;
+	}
+
+	if (ret < 0) {
+		warnx("ERROR: %s: %d: damaged lzop block", __FILE__, __LINE__);
+		rc = DECOMP_FAIL;
+	}
+
+	*inread += pos;
+
+	decompress_output_finish(&o, out, out_size);
+
+	return rc;
+}
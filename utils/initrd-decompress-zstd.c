@@ -3,6 +3,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <err.h>
 
 #include <zstd.h>
@@ -18,13 +21,214 @@ xmalloc(size_t size)
 	return r;
 }
 
+static int
+is_zstd_frame(const unsigned char *in)
+{
+	unsigned int magic = (unsigned int) in[0] | (unsigned int) in[1] << 8 |
+	                     (unsigned int) in[2] << 16 | (unsigned int) in[3] << 24;
+
+	return magic == ZSTD_MAGICNUMBER ||
+	       (magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START;
+}
+
+/*
+ * Returns the size of the zstd frames at the beginning of the input. The
+ * frame headers and block headers are enough to find it, nothing is
+ * decompressed. If a frame is damaged, the size is unknown (zero) and the
+ * decompressor gets all the input.
+ */
+unsigned long
+zstd_size(const unsigned char *in, unsigned long in_size)
+{
+	unsigned long pos = 0;
+	size_t n;
+
+	while (in_size - pos >= 4 && is_zstd_frame(in + pos)) {
+		n = ZSTD_findFrameCompressedSize(in + pos, in_size - pos);
+		if (ZSTD_isError(n))
+			return 0;
+		pos += n;
+	}
+
+	return pos;
+}
+
+/*
+ * The frames are independent, so they can be decoded on several threads,
+ * each into its own part of the output.
+ */
+struct zstd_frame {
+	const unsigned char *in;
+	size_t in_size;
+	unsigned char *out;
+	size_t out_size;
+	size_t ret;
+};
+
+struct zstd_queue {
+	struct zstd_frame *frames;
+	size_t nr;
+	size_t next;
+};
+
+/*
+ * Returns the number of frames if there is more than one and the content
+ * size is known for all of them. Otherwise returns zero and the data is
+ * decoded on one thread.
+ */
+static size_t
+zstd_split(const unsigned char *in, unsigned long in_size, struct zstd_frame **frames)
+{
+	struct zstd_frame *f = NULL;
+	unsigned long long size;
+	unsigned long pos = 0;
+	size_t n, nr = 0;
+
+	while (pos < in_size) {
+		n    = ZSTD_findFrameCompressedSize(in + pos, in_size - pos);
+		size = ZSTD_getFrameContentSize(in + pos, in_size - pos);
+
+		if (ZSTD_isError(n) || size == ZSTD_CONTENTSIZE_UNKNOWN ||
+		    size == ZSTD_CONTENTSIZE_ERROR || size > SIZE_MAX) {
+			free(f);
+			return 0;
+		}
+
+		f = realloc(f, (nr + 1) * sizeof(struct zstd_frame));
+		if (!f)
+			err(EXIT_FAILURE, "ERROR: %s: %d: realloc", __FILE__, __LINE__);
+
+		f[nr].in       = in + pos;
+		f[nr].in_size  = n;
+		f[nr].out      = NULL;
+		f[nr].out_size = (size_t) size;
+		f[nr].ret      = 0;
+
+		nr++;
+		pos += n;
+	}
+
+	if (nr < 2) {
+		free(f);
+		return 0;
+	}
+
+	*frames = f;
+	return nr;
+}
+
+static void *
+zstd_worker(void *arg)
+{
+	struct zstd_queue *q = arg;
+	struct zstd_frame *f;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->nr) {
+		f = &q->frames[i];
+		f->ret = ZSTD_decompress(f->out, f->out_size, f->in, f->in_size);
+	}
+
+	return NULL;
+}
+
+static int
+zstd_decode_frames(struct zstd_frame *frames, size_t nr)
+{
+	struct zstd_queue q = { frames, nr, 0 };
+	pthread_t *threads;
+	size_t i, nr_threads;
+	int rc;
+
+	nr_threads = (decompress_threads < nr) ? decompress_threads : nr;
+	threads    = xmalloc(nr_threads * sizeof(pthread_t));
+
+	for (i = 0; i < nr_threads; i++) {
+		if ((rc = pthread_create(&threads[i], NULL, zstd_worker, &q)) != 0)
+			errx(EXIT_FAILURE, "ERROR: %s: %d: pthread_create: %s", __FILE__, __LINE__, strerror(rc));
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	for (i = 0; i < nr; i++) {
+		if (ZSTD_isError(frames[i].ret)) {
+			warnx("ERROR: %s: %d: ZSTD_decompress: %s",
+			      __FILE__, __LINE__, ZSTD_getErrorName(frames[i].ret));
+			return DECOMP_FAIL;
+		}
+		if (frames[i].ret != frames[i].out_size) {
+			warnx("ERROR: %s: %d: ZSTD_decompress: frame content size mismatch",
+			      __FILE__, __LINE__);
+			return DECOMP_FAIL;
+		}
+	}
+
+	return DECOMP_OK;
+}
+
+/*
+ * Only as many frames as there are threads are kept in memory at once.
+ */
+static int
+zstd_stream_frames(struct zstd_frame *frames, size_t nr, decompress_sink_fn sink, void *data)
+{
+	unsigned char *buf = NULL;
+	size_t i, k, n, size, buf_size = 0;
+	int rc = DECOMP_OK;
+
+	for (i = 0; i < nr && rc == DECOMP_OK; i += n) {
+		n = (decompress_threads < nr - i) ? decompress_threads : nr - i;
+
+		for (size = 0, k = i; k < i + n; k++)
+			size += frames[k].out_size;
+
+		if (size > buf_size) {
+			free(buf);
+			buf      = xmalloc(size);
+			buf_size = size;
+		}
+
+		for (size = 0, k = i; k < i + n; k++) {
+			frames[k].out = buf + size;
+			size += frames[k].out_size;
+		}
+
+		if ((rc = zstd_decode_frames(frames + i, n)) != DECOMP_OK)
+			break;
+
+		for (k = i; k < i + n && rc == DECOMP_OK; k++) {
+			if (frames[k].out_size && sink(frames[k].out, frames[k].out_size, data) != DECOMP_OK)
+				rc = DECOMP_FAIL;
+		}
+	}
+
+	free(buf);
+	return rc;
+}
+
 int
-unzstd(unsigned char *in, unsigned long in_size,
-       unsigned char **out, unsigned long *out_size,
-       unsigned long long *inread)
+unzstd_stream(unsigned char *in, unsigned long in_size,
+              decompress_sink_fn sink, void *data,
+              unsigned long long *inread)
 {
-	void *buff_in, *buff_out;
-	size_t to_read, pos = 0;
+	struct zstd_frame *frames;
+	void *buff_out;
+	size_t ret, nr;
+	int rc = DECOMP_OK;
+
+	if ((ret = zstd_size(in, in_size)) != 0)
+		in_size = ret;
+
+	if (decompress_threads > 1 && (nr = zstd_split(in, in_size, &frames)) > 0) {
+		rc = zstd_stream_frames(frames, nr, sink, data);
+		free(frames);
+
+		*inread = in_size;
+		return rc;
+	}
 
 	ZSTD_DStream *dstream = ZSTD_createDStream();
 
@@ -33,48 +237,136 @@ unzstd(unsigned char *in, unsigned long in_size,
 		return DECOMP_FAIL;
 	}
 
-	to_read  = ZSTD_DStreamInSize();
-	buff_in  = xmalloc(to_read);
 	buff_out = xmalloc(ZSTD_DStreamOutSize());
 
-	while (pos < in_size) {
-		size_t bytes_read = to_read;
+	/* The input is already in memory, so it is not copied in chunks. */
+	ZSTD_inBuffer input = { in, in_size, 0 };
+	ZSTD_outBuffer output;
+
+	do {
+		output.dst  = buff_out;
+		output.size = ZSTD_DStreamOutSize();
+		output.pos  = 0;
 
-		if ((in_size - pos) < to_read)
-			bytes_read = in_size - pos;
+		ret = ZSTD_decompressStream(dstream, &output, &input);
 
-		memcpy(buff_in, in + pos, bytes_read);
-		pos += bytes_read;
+		if (ZSTD_isError(ret)) {
+			warnx("ERROR: %s: %d: ZSTD_decompressStream: %s",
+			      __FILE__, __LINE__, ZSTD_getErrorName(ret));
+			rc = DECOMP_FAIL;
+			break;
+		}
+
+		if (output.pos && sink(buff_out, output.pos, data) != DECOMP_OK) {
+			rc = DECOMP_FAIL;
+			break;
+		}
+		/* A full output buffer may leave decoded data in the decoder. */
+	} while (input.pos < input.size || output.pos == output.size);
+
+	*inread = in_size;
+
+	ZSTD_freeDStream(dstream);
+	free(buff_out);
+
+	return rc;
+}
 
-		ZSTD_inBuffer input = { buff_in, bytes_read, 0 };
+/*
+ * The frame header usually has the size of the content. Only the first
+ * frame is looked at, the buffer grows if there are more.
+ */
+static unsigned long
+zstd_size_hint(const unsigned char *in, unsigned long in_size)
+{
+	unsigned long long size = ZSTD_getFrameContentSize(in, in_size);
+
+	if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size > ULONG_MAX)
+		return 0;
+
+	return (unsigned long) size;
+}
 
-		while (input.pos < input.size) {
-			ZSTD_outBuffer output = { buff_out, ZSTD_DStreamOutSize(), 0 };
+int
+unzstd(unsigned char *in, unsigned long in_size,
+       unsigned char **out, unsigned long *out_size,
+       unsigned long long *inread)
+{
+	struct zstd_frame *frames;
+	size_t i, ret, nr;
+	unsigned long total;
+	int rc = DECOMP_OK;
+	struct decompress_output o;
 
-			to_read = ZSTD_decompressStream(dstream, &output, &input);
+	if ((ret = zstd_size(in, in_size)) != 0)
+		in_size = ret;
 
-			if (ZSTD_isError(to_read)) {
-				warnx("ERROR: %s: %d: ZSTD_decompressStream: %s",
-				      __FILE__, __LINE__, ZSTD_getErrorName(to_read));
+	if (decompress_threads > 1 && (nr = zstd_split(in, in_size, &frames)) > 0) {
+		for (total = 0, i = 0; i < nr; i++) {
+			if (frames[i].out_size > ULONG_MAX - total)
+				errx(EXIT_FAILURE, "ERROR: %s: %d: decompressed data is too big", __FILE__, __LINE__);
+			total += frames[i].out_size;
+		}
 
-				ZSTD_freeDStream(dstream);
-				free(buff_in);
-				free(buff_out);
+		/* Each frame is decoded into its own part of the output. */
+		decompress_output_init(&o, *out, *out_size, total);
 
-				return DECOMP_FAIL;
-			}
+		while (o.capacity - o.size < total)
+			decompress_output_grow(&o);
 
-			*out = realloc(*out, *out_size + output.pos);
-			memcpy(*out + *out_size, buff_out, output.pos);
-			*out_size += output.pos;
+		for (total = 0, i = 0; i < nr; i++) {
+			frames[i].out = o.addr + o.size + total;
+			total += frames[i].out_size;
 		}
+
+		if ((rc = zstd_decode_frames(frames, nr)) == DECOMP_OK)
+			o.size += total;
+
+		free(frames);
+
+		*inread = in_size;
+
+		decompress_output_finish(&o, out, out_size);
+		return rc;
+	}
+
+	ZSTD_DStream *dstream = ZSTD_createDStream();
+
+	if (!dstream) {
+		warnx("ERROR: %s: %d: ZSTD_createDStream", __FILE__, __LINE__);
+		return DECOMP_FAIL;
 	}
 
+	decompress_output_init(&o, *out, *out_size, zstd_size_hint(in, in_size));
+
+	ZSTD_inBuffer input = { in, in_size, 0 };
+	ZSTD_outBuffer output;
+
+	do {
+		if (o.size == o.capacity)
+			decompress_output_grow(&o);
+
+		output.dst  = o.addr;
+		output.size = o.capacity;
+		output.pos  = o.size;
+
+		ret = ZSTD_decompressStream(dstream, &output, &input);
+
+		o.size = output.pos;
+
+		if (ZSTD_isError(ret)) {
+			warnx("ERROR: %s: %d: ZSTD_decompressStream: %s",
+			      __FILE__, __LINE__, ZSTD_getErrorName(ret));
+			rc = DECOMP_FAIL;
+			break;
+		}
+	} while (input.pos < input.size || output.pos == output.size);
+
 	*inread = in_size;
 
 	ZSTD_freeDStream(dstream);
-	free(buff_in);
-	free(buff_out);
 
-	return DECOMP_OK;
+	decompress_output_finish(&o, out, out_size);
+
+	return rc;
 }
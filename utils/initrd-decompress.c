@@ -1,45 +1,59 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <err.h>
 
 #include "initrd-decompress.h"
 
+unsigned int decompress_threads = 1;
+
 struct compress_format {
 	unsigned char magic[2];
 	const char *name;
 	decompress_fn decompressor;
+	decompress_stream_fn stream;
+	unsigned long (*size)(const unsigned char *inbuf, unsigned long len);
 };
 
 static const struct compress_format compressed_formats[] = {
 #ifdef HAVE_GZIP
-	{ { 0x1f, 0x8b }, "gzip", gunzip },
-	{ { 0x1f, 0x9e }, "gzip", gunzip },
+	{ { 0x1f, 0x8b }, "gzip", gunzip, gunzip_stream, NULL },
+	{ { 0x1f, 0x9e }, "gzip", gunzip, gunzip_stream, NULL },
 #endif
 #ifdef HAVE_BZIP2
-	{ { 0x42, 0x5a }, "bzip2", bunzip2 },
+	{ { 0x42, 0x5a }, "bzip2", bunzip2, bunzip2_stream, NULL },
 #endif
 #ifdef HAVE_LZMA
-	{ { 0x5d, 0x00 }, "lzma", NULL },
-	{ { 0xfd, 0x37 }, "xz", unlzma },
+	{ { 0x5d, 0x00 }, "lzma", unlzma_alone, unlzma_alone_stream, NULL },
+	{ { 0xfd, 0x37 }, "xz", unlzma, unlzma_stream, NULL },
 #endif
 #ifdef HAVE_ZSTD
-	{ { 0x28, 0xb5 }, "zstd", unzstd },
+	{ { 0x28, 0xb5 }, "zstd", unzstd, unzstd_stream, zstd_size },
+#endif
+#ifdef HAVE_LZO
+	{ { 0x89, 0x4c }, "lzo", unlzo, unlzo_stream, lzo_size },
+#else
+	{ { 0x89, 0x4c }, "lzo", NULL, NULL, NULL },
+#endif
+#ifdef HAVE_LZ4
+	{ { 0x02, 0x21 }, "lz4", unlz4, unlz4_stream, lz4_size },
+	{ { 0x04, 0x22 }, "lz4", unlz4, unlz4_stream, lz4_size },
+#else
+	{ { 0x02, 0x21 }, "lz4", NULL, NULL, NULL },
+	{ { 0x04, 0x22 }, "lz4", NULL, NULL, NULL },
 #endif
-	{ { 0x89, 0x4c }, "lzo", NULL },
-	{ { 0x02, 0x21 }, "lz4", NULL },
-	{ { 0, 0 }, NULL, NULL }
+	{ { 0, 0 }, NULL, NULL, NULL, NULL }
 };
 
-decompress_fn
-decompress_method(const unsigned char *inbuf, unsigned long len, const char **name)
+static const struct compress_format *
+lookup_format(const unsigned char *inbuf, unsigned long len)
 {
 	const struct compress_format *cf;
 
-	if (len < 2) {
-		if (name)
-			*name = NULL;
+	if (len < 2)
 		return NULL; /* Need at least this much... */
-	}
 
 	//printf("Compressed data magic: %#.2x %#.2x\n", inbuf[0], inbuf[1]);
 
@@ -47,11 +61,108 @@ decompress_method(const unsigned char *inbuf, unsigned long len, const char **na
 		if (!memcmp(inbuf, cf->magic, 2))
 			break;
 	}
+	return cf;
+}
+
+static const struct compress_format *
+find_format(const unsigned char *inbuf, unsigned long len, const char **name)
+{
+	const struct compress_format *cf = lookup_format(inbuf, len);
+
 	if (name)
-		*name = cf->name;
+		*name = cf ? cf->name : NULL;
 
-	if (cf->name && !cf->decompressor)
+	if (cf && cf->name && !cf->decompressor)
 		printf("Decompression of '%s' is not supported\n", cf->name);
 
-	return cf->decompressor;
+	return cf;
+}
+
+decompress_fn
+decompress_method(const unsigned char *inbuf, unsigned long len, const char **name)
+{
+	const struct compress_format *cf = find_format(inbuf, len, name);
+	return cf ? cf->decompressor : NULL;
+}
+
+decompress_stream_fn
+decompress_stream_method(const unsigned char *inbuf, unsigned long len, const char **name)
+{
+	const struct compress_format *cf = find_format(inbuf, len, name);
+	return cf ? cf->stream : NULL;
+}
+
+/*
+ * Returns the size of the compressed data at the beginning of the input if
+ * the format allows to find it without decompression, zero otherwise.
+ */
+unsigned long
+decompress_size(const unsigned char *inbuf, unsigned long len)
+{
+	const struct compress_format *cf = lookup_format(inbuf, len);
+
+	return (cf && cf->size) ? cf->size(inbuf, len) : 0;
+}
+
+#define OUTPUT_MIN_SIZE 0x10000
+
+/*
+ * The data is appended to the buffer that the caller already has. The hint
+ * is the expected size of the decompressed data. It is taken from the
+ * input and may be wrong, so if there is not enough memory for it, the
+ * buffer just grows as usual.
+ */
+void
+decompress_output_init(struct decompress_output *o, unsigned char *addr, unsigned long size, unsigned long hint)
+{
+	unsigned char *p;
+
+	o->addr     = addr;
+	o->size     = size;
+	o->capacity = size;
+
+	if (!hint || hint > ULONG_MAX - size)
+		return;
+
+	if ((p = realloc(o->addr, size + hint)) != NULL) {
+		o->addr     = p;
+		o->capacity = size + hint;
+	}
+}
+
+void
+decompress_output_grow(struct decompress_output *o)
+{
+	unsigned long capacity = o->capacity;
+
+	if (capacity < OUTPUT_MIN_SIZE)
+		capacity = OUTPUT_MIN_SIZE;
+	else if (capacity <= ULONG_MAX / 2)
+		capacity *= 2;
+	else if (capacity < ULONG_MAX)
+		capacity = ULONG_MAX;
+	else
+		errx(EXIT_FAILURE, "ERROR: %s: %d: decompressed data is too big", __FILE__, __LINE__);
+
+	o->addr = realloc(o->addr, capacity);
+
+	if (o->addr == NULL)
+		err(EXIT_FAILURE, "ERROR: %s: %d: realloc", __FILE__, __LINE__);
+
+	o->capacity = capacity;
+}
+
+/*
+ * Returns the unused part of the buffer, in case the hint was too big.
+ */
+void
+decompress_output_finish(struct decompress_output *o, unsigned char **addr, unsigned long *size)
+{
+	unsigned char *p;
+
+	if (o->size && o->size < o->capacity && (p = realloc(o->addr, o->size)) != NULL)
+		o->addr = p;
+
+	*addr = o->addr;
+	*size = o->size;
 }
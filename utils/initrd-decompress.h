@@ -5,22 +5,73 @@
 #define DECOMP_OK 0
 #define DECOMP_FAIL 1
 
+/*
+ * The number of threads that a decompressor may use if the data consists
+ * of parts that can be decoded independently.
+ */
+extern unsigned int decompress_threads;
+
 typedef int (*decompress_fn)(unsigned char *inbuf, unsigned long ilen,
                              unsigned char **outbuf, unsigned long *olen,
                              unsigned long long *inread);
 
+/*
+ * The streaming decompressors pass each decoded chunk to the sink instead of
+ * collecting the whole output. The chunk is only valid during the call. If
+ * the sink returns anything but DECOMP_OK, decompression stops.
+ */
+typedef int (*decompress_sink_fn)(const unsigned char *buf, unsigned long len, void *data);
+
+typedef int (*decompress_stream_fn)(unsigned char *inbuf, unsigned long ilen,
+                                    decompress_sink_fn sink, void *data,
+                                    unsigned long long *inread);
+
 decompress_fn decompress_method(const unsigned char *inbuf, unsigned long len, const char **name);
+decompress_stream_fn decompress_stream_method(const unsigned char *inbuf, unsigned long len, const char **name);
+unsigned long decompress_size(const unsigned char *inbuf, unsigned long len);
+
+/*
+ * The buffer decompressors write straight into the output buffer. It is
+ * allocated at once if the format records the size of the data and grows
+ * geometrically otherwise.
+ */
+struct decompress_output {
+	unsigned char *addr;
+	unsigned long size;
+	unsigned long capacity;
+};
+
+void decompress_output_init(struct decompress_output *o, unsigned char *addr, unsigned long size, unsigned long hint);
+void decompress_output_grow(struct decompress_output *o);
+void decompress_output_finish(struct decompress_output *o, unsigned char **addr, unsigned long *size);
 
 #ifdef HAVE_GZIP
 int gunzip(unsigned char *in, unsigned long in_size, unsigned char **o, unsigned long *olen, unsigned long long *inread);
+int gunzip_stream(unsigned char *in, unsigned long in_size, decompress_sink_fn sink, void *data, unsigned long long *inread);
 #endif
 #ifdef HAVE_BZIP2
 int bunzip2(unsigned char *in, unsigned long in_size, unsigned char **o, unsigned long *olen, unsigned long long *inread);
+int bunzip2_stream(unsigned char *in, unsigned long in_size, decompress_sink_fn sink, void *data, unsigned long long *inread);
 #endif
 #ifdef HAVE_LZMA
 int unlzma(unsigned char *in, unsigned long in_size, unsigned char **o, unsigned long *olen, unsigned long long *inread);
+int unlzma_stream(unsigned char *in, unsigned long in_size, decompress_sink_fn sink, void *data, unsigned long long *inread);
+int unlzma_alone(unsigned char *in, unsigned long in_size, unsigned char **o, unsigned long *olen, unsigned long long *inread);
+int unlzma_alone_stream(unsigned char *in, unsigned long in_size, decompress_sink_fn sink, void *data, unsigned long long *inread);
 #endif
 #ifdef HAVE_ZSTD
 int unzstd(unsigned char *in, unsigned long in_size, unsigned char **o, unsigned long *olen, unsigned long long *inread);
+int unzstd_stream(unsigned char *in, unsigned long in_size, decompress_sink_fn sink, void *data, unsigned long long *inread);
+unsigned long zstd_size(const unsigned char *in, unsigned long in_size);
+#endif
+#ifdef HAVE_LZ4
+int unlz4(unsigned char *in, unsigned long in_size, unsigned char **o, unsigned long *olen, unsigned long long *inread);
+int unlz4_stream(unsigned char *in, unsigned long in_size, decompress_sink_fn sink, void *data, unsigned long long *inread);
+unsigned long lz4_size(const unsigned char *in, unsigned long in_size);
+#endif
+#ifdef HAVE_LZO
+int unlzo(unsigned char *in, unsigned long in_size, unsigned char **o, unsigned long *olen, unsigned long long *inread);
+int unlzo_stream(unsigned char *in, unsigned long in_size, decompress_sink_fn sink, void *data, unsigned long long *inread);
+unsigned long lzo_size(const unsigned char *in, unsigned long in_size);
 #endif
 #endif /* INITRD_DECOMPRESS_H */
@@ -9,8 +9,8 @@ initrd_extract_SRCS = \
 	$(utils_srcdir)/initrd-decompress.c \
 	$(NULL)
 
-initrd_extract_LIBS =
-initrd_extract_CFLAGS += -I$(utils_srcdir)
+initrd_extract_LIBS = -pthread
+initrd_extract_CFLAGS += -I$(utils_srcdir) -pthread
 
 ifeq ($(HAVE_GZIP),yes)
 initrd_extract_SRCS   += $(utils_srcdir)/initrd-decompress-gzip.c
@@ -48,4 +48,22 @@ else
 $(warning Your system does not have libzstd, disabling xz support)
 endif
 
+ifeq ($(HAVE_LZ4),yes)
+initrd_extract_SRCS   += $(utils_srcdir)/initrd-decompress-lz4.c
+initrd_extract_LIBS   += $(HAVE_LZ4_LIBS)
+initrd_extract_CFLAGS += $(HAVE_LZ4_CFLAGS)
+initrd_extract_CFLAGS += -DHAVE_LZ4
+else
+$(warning Your system does not have liblz4, disabling lz4 support)
+endif
+
+ifeq ($(HAVE_LZO),yes)
+initrd_extract_SRCS   += $(utils_srcdir)/initrd-decompress-lzo.c
+initrd_extract_LIBS   += $(HAVE_LZO_LIBS)
+initrd_extract_CFLAGS += $(HAVE_LZO_CFLAGS)
+initrd_extract_CFLAGS += -DHAVE_LZO
+else
+$(warning Your system does not have liblzo2, disabling lzo support)
+endif
+
 PROGS += initrd_extract
@@ -9,6 +9,7 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -20,9 +21,17 @@
 
 int opts = 0;
 
-static const char cmdopts_s[]        = "a:o:Vh";
+struct extract {
+	struct result *res;
+	int n_archive;
+	unsigned long offset;
+	FILE *output;
+};
+
+static const char cmdopts_s[]        = "a:j:o:Vh";
 static const struct option cmdopts[] = {
 	{ "archive", required_argument, 0, 'a' },
+	{ "jobs", required_argument, 0, 'j' },
 	{ "output", required_argument, 0, 'o' },
 	{ "version", no_argument, 0, 'V' },
 	{ "help", no_argument, 0, 'h' },
@@ -38,6 +47,9 @@ print_help(const char *progname)
 	       "\n"
 	       "Options:\n"
 	       "   -a, --archive=<NUM>  Extract only specified initramfs;\n"
+	       "   -j, --jobs=<N>       Decompress up to N parts of initramfs or zstd\n"
+	       "                        frames and xz blocks of a part at once\n"
+	       "                        (the parts are kept in memory);\n"
 	       "   -o, --output=<FILE>  Write output to <FILE> instead of stdout;\n"
 	       "   -V, --version        Show version of program and exit;\n"
 	       "   -h, --help           Show this text and exit.\n"
@@ -82,13 +94,51 @@ str2int(const char *name, const char *value)
 	return (int) n;
 }
 
+static int
+selected(struct extract *x, struct cpio *archive)
+{
+	struct list_tail *l;
+	int n = 1;
+
+	if (!x->n_archive)
+		return 1;
+
+	for (l = x->res->cpios; l && l->data != archive; l = l->next)
+		n++;
+
+	return n == x->n_archive;
+}
+
+static void
+extract_header(struct cpio *archive, struct cpio_header *h, void *data)
+{
+	struct extract *x = data;
+
+	if (!selected(x, archive))
+		return;
+
+	x->offset = write_cpio_pad(x->offset, x->output);
+	x->offset = write_cpio_header(h, x->offset, x->output);
+}
+
+static void
+extract_body(struct cpio *archive, struct cpio_header *h __attribute__((unused)),
+             const unsigned char *buf, unsigned long len, void *data)
+{
+	struct extract *x = data;
+
+	if (!selected(x, archive))
+		return;
+
+	x->offset = write_cpio_body(buf, len, x->offset, x->output);
+}
+
 int
 main(int argc, char **argv)
 {
-	int c, fd, n_archive = 0;
+	int c, fd, n_archive = 0, jobs = 1;
 	int option_index = 0;
 	struct stat st;
-	unsigned long offset;
 	FILE *output = NULL;
 
 	while ((c = getopt_long(argc, argv, cmdopts_s, cmdopts, &option_index)) != -1) {
@@ -98,6 +148,13 @@ main(int argc, char **argv)
 				if (n_archive <= 0)
 					bad_option_value(cmdopts[option_index].name, optarg);
 				break;
+			case 'j':
+				jobs = str2int(cmdopts[option_index].name, optarg);
+				if (jobs < 0)
+					bad_option_value(cmdopts[option_index].name, optarg);
+				if (!jobs)
+					jobs = get_nprocs();
+				break;
 			case 'o':
 				if (output)
 					fclose(output);
@@ -134,8 +191,16 @@ main(int argc, char **argv)
 	struct list_tail *l, *h;
 	struct result res;
 
+	/* The files are written as they are decompressed. */
+	struct extract x = { &res, n_archive, 0, output };
+	const struct cpio_handler handler = { extract_header, extract_body, &x };
+
 	res.streams = NULL;
 	res.cpios   = NULL;
+	res.handler = (jobs > 1) ? NULL : &handler;
+	res.jobs    = (unsigned int) jobs;
+
+	decompress_threads = (unsigned int) jobs;
 
 	l = list_append(&res.streams, sizeof(struct stream));
 	if (l == NULL)
@@ -148,27 +213,20 @@ main(int argc, char **argv)
 
 	read_stream("raw", s, &res);
 
-	offset = 0;
-	c      = 1;
-	l      = res.cpios;
-	while (l) {
-		if (((struct cpio *) l->data)->type != CPIO_ARCHIVE) {
-			l = l->next;
-			c++;
-			continue;
-		}
-		if (!n_archive || c == n_archive) {
-			h = ((struct cpio *) l->data)->headers;
-			while (h) {
-				offset = write_cpio(h->data, offset, output);
-				h      = h->next;
-			}
+	if (!res.handler) {
+		c = 1;
+		for (l = res.cpios; l; l = l->next, c++) {
+			if (((struct cpio *) l->data)->type != CPIO_ARCHIVE)
+				continue;
+			if (n_archive && c != n_archive)
+				continue;
+			for (h = ((struct cpio *) l->data)->headers; h; h = h->next)
+				x.offset = write_cpio(h->data, x.offset, output);
 		}
-		l = l->next;
-		c++;
 	}
 
-	write_trailer(offset, output);
+	x.offset = write_cpio_pad(x.offset, output);
+	write_trailer(x.offset, output);
 
 	free_cpios(res.cpios);
 	free_streams(res.streams);
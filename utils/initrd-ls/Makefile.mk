@@ -11,8 +11,8 @@ initrd_ls_SRCS = \
 	$(utils_srcdir)/initrd-decompress.c \
 	$(NULL)
 
-initrd_ls_LIBS =
-initrd_ls_CFLAGS += -I$(utils_srcdir)
+initrd_ls_LIBS = -pthread
+initrd_ls_CFLAGS += -I$(utils_srcdir) -pthread
 
 ifeq ($(HAVE_GZIP),yes)
 initrd_ls_SRCS   += $(utils_srcdir)/initrd-decompress-gzip.c
@@ -50,4 +50,22 @@ else
 $(warning Your system does not have libzstd, disabling xz support)
 endif
 
+ifeq ($(HAVE_LZ4),yes)
+initrd_ls_SRCS   += $(utils_srcdir)/initrd-decompress-lz4.c
+initrd_ls_LIBS   += $(HAVE_LZ4_LIBS)
+initrd_ls_CFLAGS += $(HAVE_LZ4_CFLAGS)
+initrd_ls_CFLAGS += -DHAVE_LZ4
+else
+$(warning Your system does not have liblz4, disabling lz4 support)
+endif
+
+ifeq ($(HAVE_LZO),yes)
+initrd_ls_SRCS   += $(utils_srcdir)/initrd-decompress-lzo.c
+initrd_ls_LIBS   += $(HAVE_LZO_LIBS)
+initrd_ls_CFLAGS += $(HAVE_LZO_CFLAGS)
+initrd_ls_CFLAGS += -DHAVE_LZO
+else
+$(warning Your system does not have liblzo2, disabling lzo support)
+endif
+
 PROGS += initrd_ls
@@ -4,12 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <limits.h>
 #include <errno.h>
 #include <err.h>
 #include <libgen.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -22,12 +24,13 @@
 
 int opts = 0;
 
-static const char cmdopts_s[]        = "bnCVh";
+static const char cmdopts_s[]        = "bnCj:Vh";
 static const struct option cmdopts[] = {
 	{ "brief", no_argument, 0, 'b' },
 	{ "name", no_argument, 0, 'n' },
 	{ "no-mtime", no_argument, 0, 3 },
 	{ "compression", no_argument, 0, 'C' },
+	{ "jobs", required_argument, 0, 'j' },
 	{ "version", no_argument, 0, 'V' },
 	{ "help", no_argument, 0, 'h' },
 	{ NULL, 0, 0, 0 }
@@ -47,6 +50,8 @@ print_help(const char *progname)
 	       "   -b, --brief         Show only brief information about archive parts;\n"
 	       "   -n, --name          Show only filenames;\n"
 	       "   -C, --compression   Show compression method for each archive;\n"
+	       "   -j, --jobs=<N>      Decompress up to N parts of initramfs or zstd\n"
+	       "                       frames and xz blocks of a part at once;\n"
 	       "   -V, --version       Show version of program and exit;\n"
 	       "   -h, --help          Show this text and exit.\n"
 	       "\n",
@@ -72,6 +77,8 @@ int
 main(int argc, char **argv)
 {
 	int c, fd;
+	long jobs = 1;
+	char *endptr;
 	struct stat st;
 
 	while ((c = getopt_long(argc, argv, cmdopts_s, cmdopts, NULL)) != -1) {
@@ -88,6 +95,14 @@ main(int argc, char **argv)
 			case 'C':
 				opts ^= SHOW_COMPRESSION;
 				break;
+			case 'j':
+				errno = 0;
+				jobs  = strtol(optarg, &endptr, 10);
+				if (errno || !*optarg || *endptr || jobs < 0 || jobs > INT_MAX)
+					errx(EXIT_FAILURE, "ERROR: bad number of jobs: %s", optarg);
+				if (!jobs)
+					jobs = get_nprocs();
+				break;
 			case 'V':
 				print_version(basename(argv[0]));
 			case 'h':
@@ -120,8 +135,15 @@ main(int argc, char **argv)
 	struct list_tail *l, *h;
 	struct result res;
 
+	/* Only the headers are needed, so the bodies are not kept in memory. */
+	const struct cpio_handler handler = { NULL, NULL, NULL };
+
 	res.streams = NULL;
 	res.cpios   = NULL;
+	res.handler = &handler;
+	res.jobs    = (unsigned int) jobs;
+
+	decompress_threads = (unsigned int) jobs;
 
 	l = list_append(&res.streams, sizeof(struct stream));
 	if (l == NULL)
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include <endian.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -13,44 +14,185 @@
 #define BOOTCONFIG_MAGIC "#BOOTCONFIG\n"
 #define BOOTCONFIG_MAGIC_LEN 12
 
-static int stream_level = 0;
+/*
+ * State of the parser that is fed by a streaming decompressor. An archive
+ * is added as soon as its first byte is decoded. Until the end of the
+ * stream its size is the position where it starts.
+ */
+struct chunk_parser {
+	struct result *res;
+	const char *compress;
+	struct cpio *cpio;
+	struct list_tail **next;
+	unsigned long offset;
+	struct cpio_stream stream;
+};
 
-void
-read_stream(const char *compress, struct stream *arv, struct result *res)
+static struct cpio *
+add_archive(struct result *res, const char *compress, unsigned char *raw, unsigned long size)
+{
+	struct list_tail *l;
+	struct cpio *cpio;
+
+	l = list_append(&res->cpios, sizeof(struct cpio));
+	if (l == NULL)
+		err(EXIT_FAILURE, "ERROR: %s: %d: unable to add element to list", __FILE__, __LINE__);
+	cpio = l->data;
+
+	cpio->type      = CPIO_ARCHIVE;
+	cpio->compress  = compress;
+	cpio->raw       = raw;
+	cpio->size      = size;
+	cpio->allocated = 0;
+	cpio->headers   = NULL;
+
+	return cpio;
+}
+
+static void
+chunk_header(struct cpio_header *h, void *data)
+{
+	struct chunk_parser *p = data;
+	const struct cpio_handler *handler = p->res->handler;
+	struct cpio_header *copy;
+	struct list_tail *l;
+
+	if (handler->header) {
+		handler->header(p->cpio, h, handler->data);
+		return;
+	}
+
+	l = list_append(p->next, sizeof(struct cpio_header));
+	if (l == NULL)
+		err(EXIT_FAILURE, "ERROR: %s: %d: unable to add element to list", __FILE__, __LINE__);
+	p->next = &l->next;
+
+	copy  = l->data;
+	*copy = *h;
+
+	copy->name = strdup(h->name);
+	copy->body = h->body ? strdup(h->body) : NULL;
+
+	if (!copy->name || (h->body && !copy->body))
+		err(EXIT_FAILURE, "ERROR: %s: %d: strdup", __FILE__, __LINE__);
+}
+
+static void
+chunk_body(struct cpio_header *h, const unsigned char *buf, unsigned long len, void *data)
+{
+	struct chunk_parser *p = data;
+
+	p->res->handler->body(p->cpio, h, buf, len, p->res->handler->data);
+}
+
+static void
+start_archive(struct chunk_parser *p, unsigned char *raw, unsigned long size)
+{
+	const struct cpio_handler *handler = p->res->handler;
+
+	p->cpio = add_archive(p->res, p->compress, raw, size);
+	p->cpio->allocated = !handler->header;
+	p->next = &p->cpio->headers;
+
+	cpio_stream_init(&p->stream, chunk_header, handler->body ? chunk_body : NULL, p);
+}
+
+static int
+parse_chunk(const unsigned char *buf, unsigned long len, void *data)
+{
+	struct chunk_parser *p = data;
+	unsigned long n;
+
+	while (len > 0) {
+		if (!p->cpio)
+			start_archive(p, NULL, p->offset);
+
+		n = cpio_stream_feed(&p->stream, buf, len);
+
+		buf += n;
+		len -= n;
+		p->offset += n;
+
+		if (p->stream.state == CPIO_STREAM_DONE)
+			p->cpio = NULL;
+	}
+
+	return DECOMP_OK;
+}
+
+/*
+ * Parses the archives while they are decompressed. Only the decompressor
+ * output buffer and the current header are in memory at any time. The
+ * archives in the decompressed data can't be compressed again.
+ */
+static unsigned long
+read_compressed_stream(decompress_stream_fn decompress, const char *compress,
+                       unsigned char *addr, unsigned long size, struct result *res)
+{
+	struct chunk_parser p = { 0 };
+	struct list_tail *l, *last;
+	unsigned long long readed = 0;
+
+	p.res      = res;
+	p.compress = compress;
+
+	for (last = res->cpios; last && last->next; last = last->next);
+
+	if (decompress(addr, size, parse_chunk, &p, &readed) != DECOMP_OK)
+		err(EXIT_FAILURE, "ERROR: %s: %d: decompressor failed", __FILE__, __LINE__);
+
+	if (p.cpio && !cpio_stream_complete(&p.stream))
+		errx(EXIT_FAILURE, "ERROR: %s: %d: %s compressed archive is truncated", __FILE__, __LINE__, compress);
+
+	/* Like the archives in memory, the size is counted to the end of the stream. */
+	for (l = last ? last->next : res->cpios; l; l = l->next)
+		((struct cpio *) l->data)->size = p.offset - ((struct cpio *) l->data)->size;
+
+	return (unsigned long) readed;
+}
+
+static unsigned long
+read_raw_stream(const char *compress, unsigned char *addr, unsigned long size, struct result *res)
+{
+	struct chunk_parser p = { 0 };
+	unsigned long n;
+
+	p.res      = res;
+	p.compress = compress;
+
+	start_archive(&p, addr, size);
+
+	n = cpio_stream_feed(&p.stream, addr, size);
+
+	if (!cpio_stream_complete(&p.stream))
+		errx(EXIT_FAILURE, "ERROR: %s: %d: archive is truncated", __FILE__, __LINE__);
+
+	return n;
+}
+
+static void
+read_data(const char *compress, struct stream *arv, struct result *res)
 {
 	struct list_tail *l;
 	struct stream *a;
 	struct cpio *cpio;
 	const char *compress_name;
 	decompress_fn decompress;
-	unsigned char *data = NULL;
-	uint32_t *hdr;
-	uint32_t size = 0; //csum;
+	decompress_stream_fn decompress_stream;
 
 	unsigned long offset = 0;
 
-	stream_level++;
-
-	if (stream_level == 1) {
-		/*
-		 * Check bootconfig first.
-		 */
-		data = arv->addr + arv->size - BOOTCONFIG_MAGIC_LEN;
+	while (offset < arv->size) {
+		if (res->handler) {
+			decompress_stream = decompress_stream_method(arv->addr + offset, arv->size - offset, &compress_name);
 
-		/*
-		 * Since Grub may align the size of initrd to 4, we must
-		 * check the preceding 3 bytes as well.
-		 */
-		for (int i = 0; i < 4; i++) {
-			if (!memcmp(data, BOOTCONFIG_MAGIC, BOOTCONFIG_MAGIC_LEN))
-				goto bootconfig;
-			data--;
+			offset += decompress_stream
+			          ? read_compressed_stream(decompress_stream, compress_name,
+			                                   arv->addr + offset, arv->size - offset, res)
+			          : read_raw_stream(compress, arv->addr + offset, arv->size - offset, res);
+			continue;
 		}
 
-		data = NULL;
-	}
-stream:
-	while (offset < arv->size) {
 		decompress = decompress_method(arv->addr + offset, arv->size - offset, &compress_name);
 		if (decompress) {
 			unsigned char *unpack     = NULL;
@@ -70,41 +212,183 @@ stream:
 			a->size      = unpack_size;
 			a->allocated = 1;
 
-			read_stream(compress_name, a, res);
+			read_data(compress_name, a, res);
 
 			offset += readed;
 			continue;
 		}
 
-		l = list_append(&res->cpios, sizeof(struct cpio));
-		if (l == NULL)
-			err(EXIT_FAILURE, "ERROR: %s: %d: unable to add element to list", __FILE__, __LINE__);
-		cpio = l->data;
-
-		cpio->type     = CPIO_ARCHIVE;
-		cpio->compress = compress;
-		cpio->raw      = arv->addr + offset;
-		cpio->size     = arv->size - offset;
-		cpio->headers  = NULL;
+		cpio = add_archive(res, compress, arv->addr + offset, arv->size - offset);
 
 		offset += read_cpio(cpio);
 	}
+}
 
-	if (data) {
-		l = list_append(&res->cpios, sizeof(struct cpio));
-		if (l == NULL)
-			err(EXIT_FAILURE, "ERROR: %s: %d: unable to add element to list", __FILE__, __LINE__);
+/*
+ * A segment is a part of the image that can be parsed on its own: an
+ * uncompressed archive or a run of compressed data whose end is known from
+ * its framing. The end of the other compressed data can't be found without
+ * decompressing it, so the last segment starts there and takes the rest.
+ */
+struct segment {
+	struct stream stream;
+	struct result res;
+};
+
+struct segment_queue {
+	const char *compress;
+	struct segment *segments;
+	size_t nr;
+	size_t next;
+};
+
+static size_t
+find_segments(struct stream *arv, const struct cpio_handler *handler, struct segment **segments)
+{
+	struct segment *s = NULL;
+	size_t nr = 0;
+	unsigned long offset = 0;
+	unsigned long size;
+
+	while (offset < arv->size) {
+		size = decompress_size(arv->addr + offset, arv->size - offset);
+		if (!size)
+			size = cpio_size(arv->addr + offset, arv->size - offset);
+		if (!size)
+			size = arv->size - offset;
+
+		s = realloc(s, (nr + 1) * sizeof(struct segment));
+		if (s == NULL)
+			err(EXIT_FAILURE, "ERROR: %s: %d: realloc", __FILE__, __LINE__);
+
+		memset(&s[nr], 0, sizeof(struct segment));
+
+		s[nr].stream.addr = arv->addr + offset;
+		s[nr].stream.size = size;
+		s[nr].res.handler = handler;
+		nr++;
+
+		offset += size;
+	}
+
+	*segments = s;
+	return nr;
+}
+
+static void *
+segment_worker(void *arg)
+{
+	struct segment_queue *q = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->nr)
+		read_data(q->compress, &q->segments[i].stream, &q->segments[i].res);
+
+	return NULL;
+}
+
+static void
+list_join(struct list_tail **head, struct list_tail *tail)
+{
+	while (*head)
+		head = &(*head)->next;
+	*head = tail;
+}
+
+/*
+ * Parses the segments on several threads, each into its own result, and
+ * joins the results in the order of the segments.
+ */
+static void
+read_segments(const char *compress, struct stream *arv, struct result *res)
+{
+	struct segment_queue q = { compress, NULL, 0, 0 };
+	struct list_tail *l;
+	struct cpio *cpio;
+	pthread_t *threads;
+	size_t i, nr;
+	int rc;
+
+	q.nr = find_segments(arv, res->handler, &q.segments);
+
+	nr = (res->jobs < q.nr) ? res->jobs : q.nr;
+
+	if (nr <= 1) {
+		free(q.segments);
+		read_data(compress, arv, res);
+		return;
+	}
+
+	threads = calloc(nr, sizeof(pthread_t));
+	if (threads == NULL)
+		err(EXIT_FAILURE, "ERROR: %s: %d: calloc", __FILE__, __LINE__);
+
+	for (i = 0; i < nr; i++) {
+		if ((rc = pthread_create(&threads[i], NULL, segment_worker, &q)) != 0)
+			errx(EXIT_FAILURE, "ERROR: %s: %d: pthread_create: %s", __FILE__, __LINE__, strerror(rc));
+	}
+
+	for (i = 0; i < nr; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	for (i = 0; i < q.nr; i++) {
+		unsigned char *end = q.segments[i].stream.addr + q.segments[i].stream.size;
+
+		/*
+		 * The size of an uncompressed archive is counted to the end of
+		 * the image, as if it had been parsed in one go.
+		 */
+		for (l = q.segments[i].res.cpios; l; l = l->next) {
+			cpio = l->data;
+			if (cpio->raw >= q.segments[i].stream.addr && cpio->raw < end)
+				cpio->size += (unsigned long) (arv->addr + arv->size - end);
+		}
+
+		list_join(&res->cpios, q.segments[i].res.cpios);
+		list_join(&res->streams, q.segments[i].res.streams);
+	}
+
+	free(q.segments);
+}
+
+void
+read_stream(const char *compress, struct stream *arv, struct result *res)
+{
+	struct cpio *cpio;
+	unsigned char *data = NULL;
+	uint32_t *hdr;
+	uint32_t size = 0; //csum;
+
+	/*
+	 * Check bootconfig first.
+	 */
+	data = arv->addr + arv->size - BOOTCONFIG_MAGIC_LEN;
 
-		cpio = l->data;
+	/*
+	 * Since Grub may align the size of initrd to 4, we must
+	 * check the preceding 3 bytes as well.
+	 */
+	for (int i = 0; i < 4; i++) {
+		if (!memcmp(data, BOOTCONFIG_MAGIC, BOOTCONFIG_MAGIC_LEN))
+			goto bootconfig;
+		data--;
+	}
+
+	data = NULL;
+stream:
+	/* The callbacks must be called in order, so they rule out threads. */
+	if (res->jobs > 1 && (!res->handler || (!res->handler->header && !res->handler->body)))
+		read_segments(compress, arv, res);
+	else
+		read_data(compress, arv, res);
 
-		cpio->type     = CPIO_BOOTCONFIG;
-		cpio->compress = NULL;
-		cpio->raw      = data;
-		cpio->size     = size;
-		cpio->headers  = NULL;
+	if (data) {
+		cpio = add_archive(res, NULL, data, size);
+		cpio->type = CPIO_BOOTCONFIG;
 	}
 
-	stream_level--;
 	return;
 
 bootconfig:
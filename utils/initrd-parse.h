@@ -3,6 +3,7 @@
 #define INITRD_PARSE_H
 
 #include "initrd-common.h"
+#include "initrd-cpio.h"
 
 struct stream {
 	short allocated;
@@ -10,9 +11,28 @@ struct stream {
 	unsigned long size;
 };
 
+/*
+ * With a handler the compressed data is parsed while it is decompressed and
+ * is not kept in memory. If there is no header callback, a copy of each
+ * header is added to the archive. If there is no body callback, the bodies
+ * are skipped.
+ */
+struct cpio_handler {
+	void (*header)(struct cpio *archive, struct cpio_header *header, void *data);
+	void (*body)(struct cpio *archive, struct cpio_header *header,
+	             const unsigned char *buf, unsigned long len, void *data);
+	void *data;
+};
+
 struct result {
 	struct list_tail *streams;
 	struct list_tail *cpios;
+	const struct cpio_handler *handler;
+	/*
+	 * If more than one, the parts of the image are decompressed on up to
+	 * this number of threads. It is ignored if the handler has callbacks.
+	 */
+	unsigned int jobs;
 };
 
 void read_stream(const char *compress, struct stream *stream, struct result *res);
@@ -4,15 +4,30 @@ ifeq ($(HAVE_LIBELF),yes)
 initrd_put_DEST = $(dest_bindir)/initrd-put
 initrd_put_SRCS = \
 	$(utils_srcdir)/initrd-put/memory.c \
+	$(utils_srcdir)/initrd-put/hash.c \
 	$(utils_srcdir)/initrd-put/queue.c \
 	$(utils_srcdir)/initrd-put/tree.c \
+	$(utils_srcdir)/initrd-put/exclude.c \
+	$(utils_srcdir)/initrd-put/dircache.c \
+	$(utils_srcdir)/initrd-put/cpio.c \
+	$(utils_srcdir)/initrd-put/dedup.c \
+	$(utils_srcdir)/initrd-put/batch.c \
+	$(utils_srcdir)/initrd-put/manifest.c \
+	$(utils_srcdir)/initrd-put/linkcache.c \
+	$(utils_srcdir)/initrd-put/walk.c \
+	$(utils_srcdir)/initrd-put/stats.c \
+	$(utils_srcdir)/initrd-put/strip.c \
+	$(utils_srcdir)/initrd-put/elf-info.c \
+	$(utils_srcdir)/initrd-put/ldso.c \
+	$(utils_srcdir)/initrd-put/uring.c \
+	$(utils_srcdir)/initrd-put/depcache.c \
 	$(utils_srcdir)/initrd-put/enqueue-library.c \
 	$(utils_srcdir)/initrd-put/enqueue-shebang.c \
 	$(utils_srcdir)/initrd-put/initrd-put.c
 
-initrd_put_LIBS = $(HAVE_LIBELF_LIBS) $(HAVE_LIBJSON_C_LIBS)
+initrd_put_LIBS = $(HAVE_LIBELF_LIBS) $(HAVE_LIBJSON_C_LIBS) -pthread
 initrd_put_CFLAGS = $(HAVE_LIBELF_CFLAGS) $(HAVE_LIBJSON_C_CFLAGS) \
-		    -I$(utils_srcdir)/initrd-put \
+		    -I$(utils_srcdir)/initrd-put -pthread \
 		    -DPACKAGE_VERSION=\"$(PACKAGE_VERSION)\"
 
 ifeq ($(HAVE_LIBJSON_C),yes)
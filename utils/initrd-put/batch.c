@@ -0,0 +1,586 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sysexits.h>
+#include <err.h>
+
+#include "memory.h"
+#include "batch.h"
+
+/*
+ * A request is the list of arguments as they would be given on the command
+ * line, each one terminated by NUL, followed by an empty argument. The reply
+ * is the exit status in decimal terminated by NUL. A request without
+ * arguments stops the server.
+ *
+ * A client that connects to the socket passes its working directory, stdout
+ * and stderr along with the request, so the request is processed as if the
+ * client has done it itself. The request over the socket is preceded by the
+ * variables of the client environment that the server has asked for, in the
+ * form NAME=VALUE and in the same format as the arguments.
+ *
+ * A request that fails exits somewhere deep inside, so each one is run in a
+ * child process that has the whole state of the server. If the request
+ * succeeds, the child takes over and serves the next requests with the
+ * state updated by it. Otherwise the parent goes on with the state it had
+ * before the request. The process that has started the server only reaps
+ * them, so it lives as long as the requests are served.
+ */
+#define BATCH_NFDS 3
+
+struct request {
+	char *data;
+	size_t len;
+	size_t size;
+	int fds[BATCH_NFDS];
+	int nfds;
+};
+
+extern int verbose;
+
+static size_t request_length(const struct request *req) __attribute__((__nonnull__ (1)));
+static ssize_t read_data(int fd, struct request *req, bool with_fds) __attribute__((__nonnull__ (2)));
+static size_t read_request(int fd, struct request *req, bool with_fds) __attribute__((__nonnull__ (2)));
+static int run_request(const struct request *req, size_t len, const char *name, batch_handler_t handler) __attribute__((__nonnull__ (1, 3, 4)));
+static int run_redirected(const struct request *req, size_t len, const char *name, batch_handler_t handler) __attribute__((__nonnull__ (1, 3, 4)));
+static void send_status(int fd, int status);
+static void serve_request(int fd, const struct request *req, size_t len, const char *name, batch_handler_t handler) __attribute__((__nonnull__ (2, 4, 5)));
+static int listen_socket(const char *path) __attribute__((__nonnull__ (1)));
+static void serve_stdin(const char *name, batch_handler_t handler) __attribute__((__nonnull__ (1, 2)));
+static void set_environment(const char *data, size_t len, const char *const *env) __attribute__((__nonnull__ (1, 3)));
+static void serve_socket(int sfd, const char *path, const char *name, const char *const *env, batch_handler_t handler) __attribute__((__nonnull__ (2, 3, 4, 5)));
+
+/*
+ * Returns the length of the first request in the buffer including the
+ * terminating empty argument or zero if the request is incomplete.
+ */
+size_t request_length(const struct request *req)
+{
+	size_t i = 0;
+
+	while (i < req->len) {
+		const char *nul = memchr(req->data + i, '\0', req->len - i);
+
+		if (!nul)
+			break;
+
+		if (nul == req->data + i)
+			return i + 1;
+
+		i = (size_t)(nul - req->data) + 1;
+	}
+	return 0;
+}
+
+ssize_t read_data(int fd, struct request *req, bool with_fds)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * BATCH_NFDS)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = { 0 };
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	if (req->size - req->len < BUFSIZ) {
+		req->size = req->size ? req->size * 2 : BUFSIZ * 4;
+		req->data = xrealloc(req->data, req->size, sizeof(char));
+	}
+
+	if (!with_fds)
+		return TEMP_FAILURE_RETRY(read(fd, req->data + req->len, req->size - req->len));
+
+	iov.iov_base = req->data + req->len;
+	iov.iov_len  = req->size - req->len;
+
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if ((n = TEMP_FAILURE_RETRY(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC))) < 0)
+		return n;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		size_t nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *fds = (int *) CMSG_DATA(cmsg);
+
+		for (size_t i = 0; i < nfds; i++) {
+			if (req->nfds < BATCH_NFDS)
+				req->fds[req->nfds++] = fds[i];
+			else
+				close(fds[i]);
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Reads until there is a complete request in the buffer. Returns its length
+ * or zero at the end of input.
+ */
+size_t read_request(int fd, struct request *req, bool with_fds)
+{
+	size_t len;
+	ssize_t n;
+
+	while (!(len = request_length(req))) {
+		if ((n = read_data(fd, req, with_fds)) < 0)
+			err(EX_IOERR, "read request");
+
+		if (!n) {
+			if (req->len)
+				warnx("incomplete request has been ignored");
+			return 0;
+		}
+
+		req->len += (size_t) n;
+	}
+
+	return len;
+}
+
+int run_request(const struct request *req, size_t len, const char *name, batch_handler_t handler)
+{
+	char **argv;
+	int argc = 1;
+	int status;
+
+	for (size_t i = 0; i < len - 1; i++)
+		argc += (req->data[i] == '\0');
+
+	argv = xcalloc((size_t) argc + 1, sizeof(char *));
+	argv[0] = (char *) name;
+
+	for (size_t i = 0, n = 1; n < (size_t) argc; n++) {
+		argv[n] = req->data + i;
+		i += strlen(argv[n]) + 1;
+	}
+
+	if (verbose > 1)
+		warnx("batch request: %d arguments", argc - 1);
+
+	status = handler(argc, argv);
+
+	free(argv);
+	return status;
+}
+
+/*
+ * Runs the request in the working directory and with the output of the
+ * client and then switches everything back.
+ */
+int run_redirected(const struct request *req, size_t len, const char *name, batch_handler_t handler)
+{
+	int saved_cwd, saved_out, saved_err;
+	int status;
+
+	if (req->nfds != BATCH_NFDS)
+		return run_request(req, len, name, handler);
+
+	if ((saved_cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+		err(EX_OSERR, "open: .");
+
+	if ((saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3)) < 0 ||
+	    (saved_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3)) < 0)
+		err(EX_OSERR, "dup");
+
+	if (fchdir(req->fds[0]) < 0)
+		err(EX_OSERR, "fchdir");
+
+	if (dup2(req->fds[1], STDOUT_FILENO) < 0 ||
+	    dup2(req->fds[2], STDERR_FILENO) < 0)
+		err(EX_OSERR, "dup2");
+
+	status = run_request(req, len, name, handler);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	if (fchdir(saved_cwd) < 0)
+		err(EX_OSERR, "fchdir");
+
+	if (dup2(saved_out, STDOUT_FILENO) < 0 ||
+	    dup2(saved_err, STDERR_FILENO) < 0)
+		err(EX_OSERR, "dup2");
+
+	close(saved_cwd);
+	close(saved_out);
+	close(saved_err);
+
+	return status;
+}
+
+void send_status(int fd, int status)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "%d", status) + 1;
+
+	if (fd == STDOUT_FILENO) {
+		fwrite(buf, 1, (size_t) len, stdout);
+		fflush(stdout);
+		return;
+	}
+
+	if (send(fd, buf, (size_t) len, MSG_NOSIGNAL) < 0 && verbose)
+		warn("send reply");
+}
+
+/*
+ * Returns only in the process that serves the next request.
+ */
+void serve_request(int fd, const struct request *req, size_t len, const char *name, batch_handler_t handler)
+{
+	int pipefd[2];
+	int status;
+	pid_t pid;
+	char c;
+
+	if (pipe2(pipefd, O_CLOEXEC) < 0)
+		err(EX_OSERR, "pipe");
+
+	fflush(stdout);
+	fflush(stderr);
+
+	if ((pid = fork()) < 0)
+		err(EX_OSERR, "fork");
+
+	if (!pid) {
+		close(pipefd[0]);
+
+		if (fd == STDOUT_FILENO)
+			status = run_request(req, len, name, handler);
+		else
+			status = run_redirected(req, len, name, handler);
+
+		send_status(fd, status);
+
+		/* Tell the parent that it is not needed anymore. */
+		if (TEMP_FAILURE_RETRY(write(pipefd[1], "", 1)) < 0)
+			err(EX_OSERR, "write");
+		close(pipefd[1]);
+		return;
+	}
+
+	close(pipefd[1]);
+
+	if (TEMP_FAILURE_RETRY(read(pipefd[0], &c, 1)) == 1)
+		_exit(EXIT_SUCCESS);
+
+	close(pipefd[0]);
+
+	if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) < 0)
+		err(EX_OSERR, "waitpid");
+
+	if (WIFEXITED(status))
+		status = WEXITSTATUS(status);
+	else
+		status = 128 + WTERMSIG(status);
+
+	if (verbose > 1)
+		warnx("batch request has failed with status %d", status);
+
+	send_status(fd, status);
+}
+
+/*
+ * The socket gets its name only when it accepts connections, so a client
+ * that has found it can connect right away.
+ */
+int listen_socket(const char *path)
+{
+	struct sockaddr_un sun = { 0 };
+	struct stat st;
+	int fd;
+
+	if (strlen(path) + 4 >= sizeof(sun.sun_path))
+		errx(EX_USAGE, "socket path is too long: %s", path);
+
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s.new", path);
+
+	/* A socket left by a server that has died. */
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if (!lstat(sun.sun_path, &st) && S_ISSOCK(st.st_mode))
+		unlink(sun.sun_path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		err(EX_OSERR, "socket");
+
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err(EX_CANTCREAT, "bind: %s", sun.sun_path);
+
+	if (listen(fd, SOMAXCONN) < 0)
+		err(EX_OSERR, "listen: %s", sun.sun_path);
+
+	if (rename(sun.sun_path, path) < 0)
+		err(EX_CANTCREAT, "rename: %s", path);
+
+	return fd;
+}
+
+void serve_stdin(const char *name, batch_handler_t handler)
+{
+	struct request req = { 0 };
+	size_t len;
+
+	while ((len = read_request(STDIN_FILENO, &req, false)) > 1) {
+		serve_request(STDOUT_FILENO, &req, len, name, handler);
+
+		req.len -= len;
+		memmove(req.data, req.data + len, req.len);
+	}
+
+	free(req.data);
+}
+
+/*
+ * Replaces the variables listed in env with the ones of the client. Those
+ * that the client does not have are removed.
+ */
+void set_environment(const char *data, size_t len, const char *const *env)
+{
+	for (const char *const *name = env; *name; name++)
+		unsetenv(*name);
+
+	for (size_t i = 0; i < len - 1; i += strlen(data + i) + 1) {
+		const char *eq = strchr(data + i, '=');
+
+		if (!eq)
+			continue;
+
+		for (const char *const *name = env; *name; name++) {
+			size_t n = strlen(*name);
+
+			if ((size_t)(eq - (data + i)) == n && !strncmp(data + i, *name, n)) {
+				if (setenv(*name, eq + 1, 1) < 0)
+					err(EX_OSERR, "setenv");
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Connections are served one at a time and each of them carries exactly
+ * one request.
+ */
+void serve_socket(int sfd, const char *path, const char *name, const char *const *env, batch_handler_t handler)
+{
+	struct request req = { 0 };
+	bool stop = false;
+
+	while (!stop) {
+		size_t len;
+		int fd;
+
+		if ((fd = (int) TEMP_FAILURE_RETRY(accept4(sfd, NULL, NULL, SOCK_CLOEXEC))) < 0)
+			err(EX_OSERR, "accept");
+
+		req.len  = 0;
+		req.nfds = 0;
+
+		if ((len = read_request(fd, &req, true)) > 0) {
+			set_environment(req.data, len, env);
+
+			req.len -= len;
+			memmove(req.data, req.data + len, req.len);
+
+			len = read_request(fd, &req, true);
+		}
+
+		if (len > 1)
+			serve_request(fd, &req, len, name, handler);
+		else if (len == 1)
+			stop = true;
+
+		for (int i = 0; i < req.nfds; i++)
+			close(req.fds[i]);
+		close(fd);
+	}
+
+	close(sfd);
+	unlink(path);
+	free(req.data);
+}
+
+/*
+ * Returns in the server process after the request to stop. The first process
+ * exits once all servers have exited.
+ */
+void batch_server(const char *path, const char *name, const char *const *env, batch_handler_t handler)
+{
+	int sfd = -1;
+	pid_t pid;
+
+	/* A client that has gone away must not take the server down. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The socket is ready to accept requests when the server is started. */
+	if (path)
+		sfd = listen_socket(path);
+
+	/* The servers that have taken over become children of this process. */
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
+		err(EX_OSERR, "prctl");
+
+	fflush(stdout);
+	fflush(stderr);
+
+	if ((pid = fork()) < 0)
+		err(EX_OSERR, "fork");
+
+	if (!pid) {
+		if (path)
+			serve_socket(sfd, path, name, env, handler);
+		else
+			serve_stdin(name, handler);
+		return;
+	}
+
+	if (sfd >= 0)
+		close(sfd);
+
+	while (TEMP_FAILURE_RETRY(wait(NULL)) > 0);
+
+	if (errno != ECHILD)
+		err(EX_OSERR, "wait");
+
+	exit(EXIT_SUCCESS);
+}
+
+int batch_client(const char *path, const char *const *env, int argc, char **argv)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * BATCH_NFDS)];
+		struct cmsghdr align;
+	} control;
+	struct sockaddr_un sun = { 0 };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int fds[BATCH_NFDS];
+	const char *value;
+	char *data, *endptr;
+	char reply[32];
+	size_t len = 2, off, reply_len = 0;
+	long status;
+	ssize_t n;
+	int fd;
+
+	for (const char *const *name = env; *name; name++) {
+		if ((value = getenv(*name)) != NULL)
+			len += strlen(*name) + strlen(value) + 2;
+	}
+
+	for (int i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+
+	data = xcalloc(len, sizeof(char));
+
+	off = 0;
+	for (const char *const *name = env; *name; name++) {
+		if ((value = getenv(*name)) != NULL)
+			off += (size_t) sprintf(data + off, "%s=%s", *name, value) + 1;
+	}
+	off++;
+
+	for (int i = 0; i < argc; i++) {
+		size_t arglen = strlen(argv[i]) + 1;
+
+		memcpy(data + off, argv[i], arglen);
+		off += arglen;
+	}
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+		errx(EX_USAGE, "socket path is too long: %s", path);
+
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		err(EX_OSERR, "socket");
+
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err(EX_UNAVAILABLE, "connect: %s", path);
+
+	if ((fds[0] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+		err(EX_OSERR, "open: .");
+
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+
+	iov.iov_base = data;
+	iov.iov_len  = len;
+
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if ((n = TEMP_FAILURE_RETRY(sendmsg(fd, &msg, MSG_NOSIGNAL))) < 0)
+		err(EX_IOERR, "send request: %s", path);
+
+	for (off = (size_t) n; off < len; off += (size_t) n) {
+		if ((n = TEMP_FAILURE_RETRY(send(fd, data + off, len - off, MSG_NOSIGNAL))) < 0)
+			err(EX_IOERR, "send request: %s", path);
+	}
+
+	close(fds[0]);
+	free(data);
+
+	/* The server does not answer to the request to stop. */
+	if (!argc) {
+		close(fd);
+		return EXIT_SUCCESS;
+	}
+
+	while (!memchr(reply, '\0', reply_len)) {
+		if (reply_len == sizeof(reply))
+			errx(EX_PROTOCOL, "bad reply: %s", path);
+
+		if ((n = TEMP_FAILURE_RETRY(read(fd, reply + reply_len, sizeof(reply) - reply_len))) < 0)
+			err(EX_IOERR, "read reply: %s", path);
+
+		if (!n)
+			errx(EX_UNAVAILABLE, "server has terminated: %s", path);
+
+		reply_len += (size_t) n;
+	}
+
+	close(fd);
+
+	errno = 0;
+	status = strtol(reply, &endptr, 10);
+
+	if (errno || *endptr || status < 0 || status > 255)
+		errx(EX_PROTOCOL, "bad reply: %s", path);
+
+	return (int) status;
+}
@@ -0,0 +1,10 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_BATCH_H__
+#define __INITRD_PUT_BATCH_H__
+
+typedef int (*batch_handler_t)(int argc, char **argv);
+
+void batch_server(const char *path, const char *name, const char *const *env, batch_handler_t handler) __attribute__((__nonnull__ (2, 3, 4)));
+int batch_client(const char *path, const char *const *env, int argc, char **argv) __attribute__((__nonnull__ (1, 2, 4)));
+
+#endif // __INITRD_PUT_BATCH_H__
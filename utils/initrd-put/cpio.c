@@ -0,0 +1,505 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <sys/sendfile.h>
+#include <sys/sysmacros.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sysexits.h>
+#include <err.h>
+
+#include "memory.h"
+#include "queue.h"
+#include "tree.h"
+#include "cpio.h"
+
+/*
+ * Writes the tree as a newc archive without a staging directory. The
+ * metadata is normalized the same way as tools/pack-image does it with
+ * gen_init_cpio: the owner is root, the modification time is zero and the
+ * inode numbers are assigned sequentially. The files found by dedup.c are
+ * written as hard links: the same inode number for all of them and the
+ * data only in the last one, like gen_init_cpio does.
+ */
+#define CPIO_MAGIC     "070701"
+#define CPIO_FIRST_INO 721
+#define CPIO_BUFSIZ    (64 * 1024)
+
+struct entry {
+	struct file *file;
+	char *name;
+	int rank;
+	size_t depth;
+	unsigned int nlink;
+	struct entry *link;	/* the next hard link to the same file */
+	bool written;
+};
+
+extern int verbose;
+
+static struct file **files = NULL;
+static size_t files_nr = 0;
+static size_t files_size = 0;
+
+static int out_fd = -1;
+static const char *out_name = NULL;
+static unsigned char out_buf[CPIO_BUFSIZ];
+static size_t out_len = 0;
+static uint64_t out_offset = 0;
+static unsigned int next_ino = CPIO_FIRST_INO;
+
+static void collect_file(struct file *p) __attribute__((__nonnull__ (1)));
+static int compare_dst(const void *a, const void *b) __attribute__((__nonnull__ (1, 2)));
+static struct file *lookup_dst(const char *path) __attribute__((__nonnull__ (1)));
+static bool resolve_path(const char *path, char *out, size_t size) __attribute__((__nonnull__ (1, 2)));
+static int entry_rank(const struct file *p) __attribute__((__nonnull__ (1)));
+static int compare_entries(const void *a, const void *b) __attribute__((__nonnull__ (1, 2)));
+static const struct file *link_target(const struct entry *e) __attribute__((__nonnull__ (1)));
+static int compare_links(const void *a, const void *b) __attribute__((__nonnull__ (1, 2)));
+static void group_links(struct entry *entries, size_t nr) __attribute__((__nonnull__ (1)));
+static void out_flush(void);
+static void out_write(const void *data, size_t len) __attribute__((__nonnull__ (1)));
+static void out_pad(size_t align);
+static void write_header(unsigned int ino, mode_t mode, unsigned int nlink, uint64_t size, dev_t rdev, const char *name) __attribute__((__nonnull__ (6)));
+static void write_data(const char *filename, int fd, uint64_t size) __attribute__((__nonnull__ (1)));
+static void write_file(const struct entry *e) __attribute__((__nonnull__ (1)));
+static void write_entry(struct entry *e) __attribute__((__nonnull__ (1)));
+
+void collect_file(struct file *p)
+{
+	if (files_nr == files_size) {
+		files_size += 1024;
+		files = xrealloc(files, files_size, sizeof(struct file *));
+	}
+	files[files_nr++] = p;
+}
+
+int compare_dst(const void *a, const void *b)
+{
+	return strcmp((*(struct file * const *) a)->dst, (*(struct file * const *) b)->dst);
+}
+
+struct file *lookup_dst(const char *path)
+{
+	struct file key = { .dst = (char *) path };
+	struct file *keyp = &key;
+	struct file **found;
+
+	found = bsearch(&keyp, files, files_nr, sizeof(struct file *), compare_dst);
+
+	return found ? *found : NULL;
+}
+
+/*
+ * In the staging directory a path is created through the symlinks of its
+ * parents (e.g. /lib/x86_64-linux-gnu -> /usr/lib/x86_64-linux-gnu if /lib
+ * points to usr/lib). The archive must contain the real paths, otherwise
+ * the kernel would create a directory instead of the symlink.
+ */
+bool resolve_path(const char *path, char *out, size_t size)
+{
+	char rest[PATH_MAX * 2];
+	char tmp[PATH_MAX * 2];
+	const char *s;
+	size_t n = 0;
+	int hops = 0;
+
+	if (strlen(path) >= sizeof(rest))
+		return false;
+
+	strcpy(rest, path);
+	s = rest;
+	out[0] = '\0';
+
+	while (*s) {
+		const char *comp;
+		size_t len;
+
+		while (*s == '/')
+			s++;
+		if (!*s)
+			break;
+
+		comp = s;
+		len = strcspn(s, "/");
+		s += len;
+
+		if (len == 1 && comp[0] == '.')
+			continue;
+
+		if (len == 2 && comp[0] == '.' && comp[1] == '.') {
+			char *slash = strrchr(out, '/');
+
+			n = slash ? (size_t)(slash - out) : 0;
+			out[n] = '\0';
+			continue;
+		}
+
+		if (n + len + 1 >= size)
+			return false;
+
+		out[n] = '/';
+		memcpy(out + n + 1, comp, len);
+		out[n + len + 1] = '\0';
+
+		/* The last component is not followed. */
+		if (s[strspn(s, "/")] != '\0') {
+			struct file *p = lookup_dst(out);
+
+			if (p && S_ISLNK(p->stat.st_mode) && p->symlink) {
+				if (++hops > MAXSYMLINKS)
+					return false;
+
+				if ((size_t) snprintf(tmp, sizeof(tmp), "%s%s", p->symlink, s) >= sizeof(tmp))
+					return false;
+
+				strcpy(rest, tmp);
+				s = rest;
+
+				if (p->symlink[0] == '/')
+					n = 0;
+				out[n] = '\0';
+				continue;
+			}
+		}
+
+		n += len + 1;
+	}
+
+	return true;
+}
+
+int entry_rank(const struct file *p)
+{
+	switch (p->stat.st_mode & S_IFMT) {
+		case S_IFDIR:
+			return 0;
+		case S_IFLNK:
+			return 1;
+	}
+	return 2;
+}
+
+/*
+ * The same order as the one used for installation: a directory comes
+ * before its content.
+ */
+int compare_entries(const void *a, const void *b)
+{
+	const struct entry *x = a;
+	const struct entry *y = b;
+
+	if (x->rank != y->rank)
+		return x->rank - y->rank;
+
+	if (x->rank == 0 && x->depth != y->depth)
+		return (x->depth < y->depth) ? -1 : 1;
+
+	return strcmp(x->name, y->name);
+}
+
+const struct file *link_target(const struct entry *e)
+{
+	return e->file->same ? e->file->same : e->file;
+}
+
+int compare_links(const void *a, const void *b)
+{
+	const struct entry *x = *(struct entry * const *) a;
+	const struct entry *y = *(struct entry * const *) b;
+
+	if (link_target(x) != link_target(y))
+		return (link_target(x) < link_target(y)) ? -1 : 1;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/*
+ * Chains the entries of the same file in the order of the archive. The
+ * duplicate names have to be already removed.
+ */
+void group_links(struct entry *entries, size_t nr)
+{
+	struct entry **regular;
+	size_t regular_nr = 0;
+
+	regular = xcalloc(nr + 1, sizeof(struct entry *));
+
+	for (size_t i = 0; i < nr; i++) {
+		entries[i].nlink = 1;
+		if (!entries[i].written && S_ISREG(entries[i].file->stat.st_mode))
+			regular[regular_nr++] = &entries[i];
+	}
+
+	qsort(regular, regular_nr, sizeof(struct entry *), compare_links);
+
+	for (size_t i = 0, k; i < regular_nr; i = k) {
+		for (k = i + 1; k < regular_nr; k++) {
+			if (link_target(regular[k]) != link_target(regular[i]))
+				break;
+			regular[k - 1]->link = regular[k];
+		}
+		for (size_t n = i; n < k; n++)
+			regular[n]->nlink = (unsigned int)(k - i);
+	}
+
+	free(regular);
+}
+
+void out_flush(void)
+{
+	size_t off = 0;
+
+	while (off < out_len) {
+		ssize_t n = TEMP_FAILURE_RETRY(write(out_fd, out_buf + off, out_len - off));
+
+		if (n < 0)
+			err(EX_IOERR, "write: %s", out_name);
+		off += (size_t) n;
+	}
+	out_len = 0;
+}
+
+void out_write(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len > 0) {
+		size_t n = MIN(len, sizeof(out_buf) - out_len);
+
+		memcpy(out_buf + out_len, p, n);
+		out_len += n;
+		out_offset += n;
+		p += n;
+		len -= n;
+
+		if (out_len == sizeof(out_buf))
+			out_flush();
+	}
+}
+
+void out_pad(size_t align)
+{
+	static const unsigned char zero[512];
+
+	if (out_offset % align)
+		out_write(zero, align - out_offset % align);
+}
+
+void write_header(unsigned int ino, mode_t mode, unsigned int nlink, uint64_t size, dev_t rdev, const char *name)
+{
+	char hdr[111];
+	size_t namesize = strlen(name) + 1;
+
+	snprintf(hdr, sizeof(hdr),
+	         "%s%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+	         CPIO_MAGIC,
+	         ino,                    /* ino */
+	         (unsigned int) mode,    /* mode */
+	         0,                      /* uid */
+	         0,                      /* gid */
+	         nlink,                  /* nlink */
+	         0,                      /* mtime */
+	         (unsigned int) size,    /* filesize */
+	         3,                      /* major */
+	         1,                      /* minor */
+	         major(rdev),            /* rmajor */
+	         minor(rdev),            /* rminor */
+	         (unsigned int) namesize,/* namesize */
+	         0);                     /* chksum */
+
+	out_write(hdr, 110);
+	out_write(name, namesize);
+	out_pad(4);
+}
+
+void write_data(const char *filename, int fd, uint64_t size)
+{
+	bool use_sendfile = true;
+
+	out_flush();
+
+	while (size > 0) {
+		ssize_t n;
+
+		if (use_sendfile) {
+			n = sendfile(out_fd, fd, NULL, MIN(size, (uint64_t) SSIZE_MAX));
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				use_sendfile = false;
+				continue;
+			}
+			if (n < 0)
+				err(EX_IOERR, "sendfile: %s -> %s", filename, out_name);
+		} else {
+			n = TEMP_FAILURE_RETRY(read(fd, out_buf, MIN(size, sizeof(out_buf))));
+			if (n < 0)
+				err(EX_IOERR, "read: %s", filename);
+			if (n > 0) {
+				out_len = (size_t) n;
+				out_flush();
+			}
+		}
+
+		if (!n)
+			errx(EX_IOERR, "%s: file has been truncated", filename);
+
+		size -= (uint64_t) n;
+		out_offset += (uint64_t) n;
+	}
+}
+
+/*
+ * The hard links to the same file are written one after another and only the
+ * last of them has the data.
+ */
+void write_file(const struct entry *e)
+{
+	struct file *p = e->file;
+	mode_t mode = p->stat.st_mode & (S_IFMT | 07777);
+	unsigned int ino = next_ino++;
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(p->src, O_RDONLY | O_CLOEXEC)) < 0)
+		err(EX_NOINPUT, "open: %s", p->src);
+
+	if (fstat(fd, &sb) < 0)
+		err(EX_NOINPUT, "fstat: %s", p->src);
+
+	if ((uint64_t) sb.st_size > UINT32_MAX)
+		errx(EX_DATAERR, "%s: file is too big for cpio archive", p->src);
+
+	for (; e->link; e = e->link) {
+		if (verbose)
+			warnx("archive (hard link): %s", e->name);
+
+		write_header(ino, mode, e->nlink, 0, 0, e->name);
+	}
+
+	if (verbose)
+		warnx("archive: %s", e->name);
+
+	posix_fadvise(fd, 0, sb.st_size, POSIX_FADV_SEQUENTIAL);
+
+	write_header(ino, mode, e->nlink, (uint64_t) sb.st_size, 0, e->name);
+	write_data(p->src, fd, (uint64_t) sb.st_size);
+	out_pad(4);
+
+	close(fd);
+}
+
+void write_entry(struct entry *e)
+{
+	struct file *p = e->file;
+	mode_t mode = p->stat.st_mode & (S_IFMT | 07777);
+
+	if (S_ISREG(p->stat.st_mode)) {
+		for (struct entry *l = e; l; l = l->link)
+			l->written = true;
+		write_file(e);
+		return;
+	}
+
+	if (verbose)
+		warnx("archive: %s", e->name);
+
+	switch (p->stat.st_mode & S_IFMT) {
+		case S_IFDIR:
+			write_header(next_ino++, mode, 2, 0, 0, e->name);
+			break;
+		case S_IFLNK:
+			write_header(next_ino++, mode, 1, strlen(p->symlink) + 1, 0, e->name);
+			out_write(p->symlink, strlen(p->symlink) + 1);
+			out_pad(4);
+			break;
+		case S_IFBLK:
+		case S_IFCHR:
+			write_header(next_ino++, mode, 1, 0, p->stat.st_rdev, e->name);
+			break;
+		case S_IFIFO:
+		case S_IFSOCK:
+			write_header(next_ino++, mode, 1, 0, 0, e->name);
+			break;
+		default:
+			errx(EXIT_FAILURE, "not implemented (mode=%o): %s", p->stat.st_mode, p->dst);
+	}
+}
+
+void cpio_write_tree(const char *filename)
+{
+	struct entry *entries;
+	size_t entries_nr = 0;
+	char path[PATH_MAX];
+
+	tree_walk(collect_file);
+	qsort(files, files_nr, sizeof(struct file *), compare_dst);
+
+	entries = xcalloc(files_nr + 1, sizeof(struct entry));
+
+	for (size_t i = 0; i < files_nr; i++) {
+		struct entry *e;
+
+		if (!resolve_path(files[i]->dst, path, sizeof(path)))
+			errx(EX_DATAERR, "unable to resolve path: %s", files[i]->dst);
+
+		/* The root of the archive. */
+		if (!path[0])
+			continue;
+
+		e = &entries[entries_nr++];
+
+		e->file  = files[i];
+		e->name  = xstrdup(path + 1);
+		e->rank  = entry_rank(files[i]);
+		e->depth = 0;
+
+		for (const char *s = e->name; *s; s++)
+			e->depth += (*s == '/');
+	}
+
+	qsort(entries, entries_nr, sizeof(struct entry), compare_entries);
+
+	out_name = filename;
+
+	if (!strcmp(filename, "-"))
+		out_fd = STDOUT_FILENO;
+	else if ((out_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		err(EX_CANTCREAT, "open: %s", filename);
+
+	/* The same path can be reached through a symlink. */
+	for (size_t i = 1; i < entries_nr; i++) {
+		if (!strcmp(entries[i].name, entries[i - 1].name))
+			entries[i].written = true;
+	}
+
+	group_links(entries, entries_nr);
+
+	for (size_t i = 0; i < entries_nr; i++) {
+		if (!entries[i].written)
+			write_entry(&entries[i]);
+	}
+
+	write_header(0, 0, 1, 0, 0, "TRAILER!!!");
+	out_pad(512);
+	out_flush();
+
+	if (out_fd != STDOUT_FILENO && close(out_fd) < 0)
+		err(EX_IOERR, "close: %s", filename);
+
+	for (size_t i = 0; i < entries_nr; i++)
+		free(entries[i].name);
+	free(entries);
+	free(files);
+
+	files = NULL;
+	files_nr = files_size = 0;
+}
@@ -0,0 +1,7 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_CPIO_H__
+#define __INITRD_PUT_CPIO_H__
+
+void cpio_write_tree(const char *filename) __attribute__((__nonnull__ (1)));
+
+#endif // __INITRD_PUT_CPIO_H__
@@ -0,0 +1,235 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "memory.h"
+#include "queue.h"
+#include "tree.h"
+#include "dedup.h"
+
+/*
+ * Finds regular files with the same content so that they can be installed
+ * as hard links to one another. Only the files of the same size, mode and
+ * owner can be merged, so the content is hashed only if there is more than
+ * one such file. The files with the same hash are compared byte by byte.
+ */
+struct candidate {
+	struct file *file;
+	uint64_t hash;
+	bool hashed;
+};
+
+extern int verbose;
+
+static struct candidate *candidates = NULL;
+static size_t candidates_nr = 0;
+static size_t candidates_size = 0;
+
+static void collect_file(struct file *p) __attribute__((__nonnull__ (1)));
+static int compare_bucket(const struct file *a, const struct file *b) __attribute__((__nonnull__ (1, 2)));
+static int compare_candidates(const void *a, const void *b) __attribute__((__nonnull__ (1, 2)));
+static uint64_t hash_data(const unsigned char *data, size_t len) __attribute__((__nonnull__ (1)));
+static void *map_file(const char *filename, size_t size) __attribute__((__nonnull__ (1)));
+static bool hash_file(struct candidate *c) __attribute__((__nonnull__ (1)));
+static bool same_content(const struct file *a, const struct file *b) __attribute__((__nonnull__ (1, 2)));
+
+void collect_file(struct file *p)
+{
+	if (!S_ISREG(p->stat.st_mode) || !p->stat.st_size)
+		return;
+
+	if (candidates_nr == candidates_size) {
+		candidates_size += 1024;
+		candidates = xrealloc(candidates, candidates_size, sizeof(struct candidate));
+	}
+
+	candidates[candidates_nr].file   = p;
+	candidates[candidates_nr].hash   = 0;
+	candidates[candidates_nr].hashed = false;
+	candidates_nr++;
+}
+
+int compare_bucket(const struct file *a, const struct file *b)
+{
+	if (a->stat.st_size != b->stat.st_size)
+		return (a->stat.st_size < b->stat.st_size) ? -1 : 1;
+	if (a->stat.st_mode != b->stat.st_mode)
+		return (a->stat.st_mode < b->stat.st_mode) ? -1 : 1;
+	if (a->stat.st_uid != b->stat.st_uid)
+		return (a->stat.st_uid < b->stat.st_uid) ? -1 : 1;
+	if (a->stat.st_gid != b->stat.st_gid)
+		return (a->stat.st_gid < b->stat.st_gid) ? -1 : 1;
+	return 0;
+}
+
+int compare_candidates(const void *a, const void *b)
+{
+	const struct candidate *x = a;
+	const struct candidate *y = b;
+	int ret;
+
+	if ((ret = compare_bucket(x->file, y->file)) != 0)
+		return ret;
+
+	if (x->hash != y->hash)
+		return (x->hash < y->hash) ? -1 : 1;
+
+	return strcmp(x->file->dst, y->file->dst);
+}
+
+/*
+ * A simple multiply-rotate hash over 64-bit words. It only has to separate
+ * the files of the same size, the final decision is made by memcmp().
+ */
+uint64_t hash_data(const unsigned char *data, size_t len)
+{
+	const uint64_t p1 = 0x9e3779b185ebca87ULL;
+	const uint64_t p2 = 0xc2b2ae3d27d4eb4fULL;
+	uint64_t h = len * p1;
+	uint64_t w;
+	size_t i = 0;
+
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, data + i, sizeof(w));
+		h ^= w * p2;
+		h = ((h << 31) | (h >> 33)) * p1;
+	}
+
+	for (; i < len; i++) {
+		h ^= data[i] * p2;
+		h = ((h << 11) | (h >> 53)) * p1;
+	}
+
+	h ^= h >> 33;
+	h *= p2;
+	h ^= h >> 29;
+
+	return h;
+}
+
+void *map_file(const char *filename, size_t size)
+{
+	void *map;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+		warn("open: %s", filename);
+		return NULL;
+	}
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		warn("mmap: %s", filename);
+		return NULL;
+	}
+
+	madvise(map, size, MADV_SEQUENTIAL);
+	return map;
+}
+
+bool hash_file(struct candidate *c)
+{
+	size_t size = (size_t) c->file->stat.st_size;
+	void *map;
+
+	if (!(map = map_file(c->file->src, size)))
+		return false;
+
+	c->hash = hash_data(map, size);
+	c->hashed = true;
+
+	munmap(map, size);
+	return true;
+}
+
+bool same_content(const struct file *a, const struct file *b)
+{
+	size_t size = (size_t) a->stat.st_size;
+	void *x, *y;
+	bool ret = false;
+
+	if (a->stat.st_dev == b->stat.st_dev && a->stat.st_ino == b->stat.st_ino)
+		return true;
+
+	if (!(x = map_file(a->src, size)))
+		return false;
+
+	if ((y = map_file(b->src, size)) != NULL) {
+		ret = !memcmp(x, y, size);
+		munmap(y, size);
+	}
+
+	munmap(x, size);
+	return ret;
+}
+
+void dedup_files(void)
+{
+	uintmax_t saved = 0;
+	size_t linked = 0;
+	size_t i, k;
+
+	tree_walk(collect_file);
+
+	/* Group the files into buckets first, nothing is hashed yet. */
+	qsort(candidates, candidates_nr, sizeof(struct candidate), compare_candidates);
+
+	for (i = 0; i < candidates_nr; i = k) {
+		for (k = i + 1; k < candidates_nr; k++) {
+			if (compare_bucket(candidates[i].file, candidates[k].file))
+				break;
+		}
+
+		if (k - i < 2)
+			continue;
+
+		for (size_t n = i; n < k; n++)
+			hash_file(&candidates[n]);
+
+		qsort(candidates + i, k - i, sizeof(struct candidate), compare_candidates);
+
+		for (size_t n = i; n < k;) {
+			size_t m = n + 1;
+
+			while (m < k && candidates[m].hash == candidates[n].hash)
+				m++;
+
+			if (candidates[n].hashed) {
+				struct file *primary = candidates[n].file;
+
+				for (size_t l = n + 1; l < m; l++) {
+					if (!same_content(primary, candidates[l].file))
+						continue;
+
+					candidates[l].file->same = primary;
+
+					saved += (uintmax_t) primary->stat.st_size;
+					linked++;
+
+					if (verbose > 1)
+						warnx("'%s' has the same content as '%s'",
+						      candidates[l].file->src, primary->src);
+				}
+			}
+			n = m;
+		}
+	}
+
+	if (verbose)
+		warnx("%zu duplicate files, %ju bytes saved", linked, saved);
+
+	free(candidates);
+	candidates = NULL;
+	candidates_nr = candidates_size = 0;
+}
@@ -0,0 +1,7 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_DEDUP_H__
+#define __INITRD_PUT_DEDUP_H__
+
+void dedup_files(void);
+
+#endif // __INITRD_PUT_DEDUP_H__
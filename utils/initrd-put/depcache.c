@@ -0,0 +1,587 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <search.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <sysexits.h>
+#include <pthread.h>
+
+#include "config.h"
+
+#include "memory.h"
+#include "hash.h"
+#include "depcache.h"
+
+extern int verbose;
+extern int use_ldd;
+
+/*
+ * The cache file is never modified in place. It is written to a temporary
+ * file and renamed over the old one, so any process that has mapped the
+ * file sees a consistent snapshot and concurrent runs can share the same
+ * file. A run that finishes later may drop the entries added by another
+ * run, which only costs the time to parse those files again.
+ *
+ * Layout (host byte order):
+ *
+ *   struct depcache_header
+ *   struct depcache_entry[entries_nr]   sorted by (dev, ino)
+ *   uint32_t deps[deps_nr]              offsets in the string table
+ *   char strings[strings_size]          NUL-terminated paths
+ */
+#define DEPCACHE_MAGIC   "IPDEPS\0\0"
+#define DEPCACHE_VERSION 2
+
+struct depcache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entries_nr;
+	uint64_t context;
+	uint64_t deps_nr;
+	uint64_t strings_size;
+};
+
+struct depcache_entry {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t mode;
+	uint32_t deps_nr;
+	uint64_t deps;
+};
+
+struct mapping {
+	unsigned char *map;
+	size_t size;
+	const struct depcache_entry *entries;
+	size_t entries_nr;
+	const uint32_t *deps;
+	size_t deps_nr;
+	const char *strings;
+	size_t strings_size;
+};
+
+struct record {
+	struct depcache_entry key;
+	const char **deps;
+	size_t deps_nr;
+	int source;
+	bool owned;
+	bool skip;
+};
+
+struct strent {
+	const char *str;
+	uint32_t off;
+};
+
+const char *const depcache_env[] = {
+	"LD_LIBRARY_PATH",
+	"LD_PRELOAD",
+	"IGNORE_PUT_DLOPEN_FEATURE",
+	"IGNORE_PUT_DLOPEN_PRIORITY",
+	NULL
+};
+
+static char *cache_file = NULL;
+static uint64_t cache_context = 0;
+static struct mapping cache_map;
+
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct record *records = NULL;
+static size_t records_nr = 0;
+static size_t records_size = 0;
+
+static __thread struct record *current = NULL;
+
+static void make_key(struct depcache_entry *key, const struct stat *st) __attribute__((__nonnull__ (1, 2)));
+static int compare_entry(const struct depcache_entry *a, const struct depcache_entry *b) __attribute__((__nonnull__ (1, 2)));
+static int compare_record(const void *a, const void *b) __attribute__((__nonnull__ (1, 2)));
+static int compare_strent(const void *a, const void *b) __attribute__((__nonnull__ (1, 2)));
+static void noop_free(void *ptr);
+static bool map_file(struct mapping *m, const char *filename) __attribute__((__nonnull__ (1, 2)));
+static void unmap_file(struct mapping *m) __attribute__((__nonnull__ (1)));
+static const char *get_dep(const struct mapping *m, const struct depcache_entry *e, size_t i) __attribute__((__nonnull__ (1, 2)));
+static const struct depcache_entry *find_entry(const struct mapping *m, const struct depcache_entry *key) __attribute__((__nonnull__ (1, 2)));
+static struct record *new_record(void);
+static void add_mapped(const struct mapping *m, int source) __attribute__((__nonnull__ (1)));
+static void write_cache(void);
+
+/*
+ * The dependencies of a file do not depend only on the file itself. If
+ * anything else that affects the library search changes, the whole cache
+ * is discarded.
+ */
+uint64_t depcache_context(void)
+{
+	uint64_t hash = HASH_INIT;
+	const char *env;
+	struct stat st;
+	int flags[2] = { use_ldd, 0 };
+
+#ifdef HAVE_LIBJSON_C
+	flags[1] = 1;
+#endif
+	hash = hash_bytes(hash, flags, sizeof(flags));
+
+	/*
+	 * The library search of ld.so and ldd(1) and the filter of the dlopen
+	 * notes are controlled by the environment.
+	 */
+	for (const char *const *name = depcache_env; *name; name++) {
+		if ((env = getenv(*name)) == NULL)
+			continue;
+		hash = hash_bytes(hash, *name, strlen(*name) + 1);
+		hash = hash_bytes(hash, env, strlen(env) + 1);
+	}
+
+	if (!stat("/etc/ld.so.cache", &st)) {
+		hash = hash_bytes(hash, &st.st_ino, sizeof(st.st_ino));
+		hash = hash_bytes(hash, &st.st_size, sizeof(st.st_size));
+		hash = hash_bytes(hash, &st.st_mtim, sizeof(st.st_mtim));
+	}
+
+	return hash;
+}
+
+void make_key(struct depcache_entry *key, const struct stat *st)
+{
+	memset(key, 0, sizeof(*key));
+
+	key->dev        = (uint64_t) st->st_dev;
+	key->ino        = (uint64_t) st->st_ino;
+	key->size       = (uint64_t) st->st_size;
+	key->mtime_sec  = (int64_t) st->st_mtim.tv_sec;
+	key->mtime_nsec = (int64_t) st->st_mtim.tv_nsec;
+	key->mode       = (uint32_t) st->st_mode;
+}
+
+int compare_entry(const struct depcache_entry *a, const struct depcache_entry *b)
+{
+	if (a->dev != b->dev)
+		return a->dev < b->dev ? -1 : 1;
+	if (a->ino != b->ino)
+		return a->ino < b->ino ? -1 : 1;
+	return 0;
+}
+
+int compare_record(const void *a, const void *b)
+{
+	const struct record *x = a;
+	const struct record *y = b;
+	int ret = compare_entry(&x->key, &y->key);
+
+	if (!ret)
+		ret = x->source - y->source;
+	return ret;
+}
+
+int compare_strent(const void *a, const void *b)
+{
+	return strcmp(((const struct strent *) a)->str, ((const struct strent *) b)->str);
+}
+
+void noop_free(void *ptr __attribute__((unused)))
+{
+}
+
+bool map_file(struct mapping *m, const char *filename)
+{
+	const struct depcache_header *hdr;
+	struct stat st;
+	size_t off;
+	int fd;
+
+	memset(m, 0, sizeof(*m));
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT)
+			warn("open: %s", filename);
+		return false;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return false;
+	}
+
+	m->size = (size_t) st.st_size;
+	m->map = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (m->map == MAP_FAILED) {
+		warn("mmap: %s", filename);
+		m->map = NULL;
+		return false;
+	}
+
+	hdr = (const struct depcache_header *) m->map;
+
+	if (memcmp(hdr->magic, DEPCACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != DEPCACHE_VERSION ||
+	    hdr->context != cache_context)
+		goto fail;
+
+	off = sizeof(*hdr);
+
+	if (hdr->entries_nr > (m->size - off) / sizeof(struct depcache_entry))
+		goto fail;
+	m->entries = (const struct depcache_entry *) (m->map + off);
+	m->entries_nr = hdr->entries_nr;
+	off += m->entries_nr * sizeof(struct depcache_entry);
+
+	if (hdr->deps_nr > (m->size - off) / sizeof(uint32_t))
+		goto fail;
+	m->deps = (const uint32_t *) (m->map + off);
+	m->deps_nr = hdr->deps_nr;
+	off += m->deps_nr * sizeof(uint32_t);
+
+	if (hdr->strings_size != m->size - off ||
+	    (hdr->strings_size && m->map[m->size - 1] != '\0'))
+		goto fail;
+	m->strings = (const char *) (m->map + off);
+	m->strings_size = hdr->strings_size;
+
+	return true;
+fail:
+	if (verbose > 1)
+		warnx("%s: the cache is outdated or broken, ignoring", filename);
+	unmap_file(m);
+	return false;
+}
+
+void unmap_file(struct mapping *m)
+{
+	if (m->map)
+		munmap(m->map, m->size);
+	memset(m, 0, sizeof(*m));
+}
+
+const char *get_dep(const struct mapping *m, const struct depcache_entry *e, size_t i)
+{
+	uint32_t off;
+
+	if (e->deps > m->deps_nr || e->deps_nr > m->deps_nr - e->deps)
+		return NULL;
+
+	off = m->deps[e->deps + i];
+
+	if (off >= m->strings_size)
+		return NULL;
+
+	return m->strings + off;
+}
+
+const struct depcache_entry *find_entry(const struct mapping *m, const struct depcache_entry *key)
+{
+	size_t lo = 0, hi = m->entries_nr;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int ret = compare_entry(key, &m->entries[mid]);
+
+		if (!ret)
+			return &m->entries[mid];
+		if (ret < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+void depcache_open(const char *filename)
+{
+	cache_file = xstrdup(filename);
+	cache_context = depcache_context();
+
+	map_file(&cache_map, cache_file);
+}
+
+/*
+ * Calls the handler for every dependency of the file if the cache has
+ * an up-to-date entry for it. A dependency that has disappeared since the
+ * entry was written makes the entry useless.
+ */
+bool depcache_lookup(const struct stat *st, depcache_handler_t handler)
+{
+	const struct depcache_entry *e;
+	struct depcache_entry key;
+
+	if (!cache_map.map)
+		return false;
+
+	make_key(&key, st);
+
+	if (!(e = find_entry(&cache_map, &key)) ||
+	    e->size != key.size ||
+	    e->mtime_sec != key.mtime_sec ||
+	    e->mtime_nsec != key.mtime_nsec ||
+	    e->mode != key.mode)
+		return false;
+
+	for (size_t i = 0; i < e->deps_nr; i++) {
+		const char *dep = get_dep(&cache_map, e, i);
+
+		if (!dep || access(dep, F_OK) < 0)
+			return false;
+	}
+
+	for (size_t i = 0; i < e->deps_nr; i++)
+		handler(get_dep(&cache_map, e, i));
+
+	return true;
+}
+
+void depcache_begin(void)
+{
+	if (!cache_file)
+		return;
+
+	current = xcalloc(1, sizeof(*current));
+}
+
+void depcache_add(const char *path)
+{
+	if (!current)
+		return;
+
+	for (size_t i = 0; i < current->deps_nr; i++) {
+		if (!strcmp(current->deps[i], path))
+			return;
+	}
+
+	current->deps = xrealloc(current->deps, current->deps_nr + 1, sizeof(char *));
+	current->deps[current->deps_nr++] = xstrdup(path);
+}
+
+void depcache_end(const struct stat *st, bool store)
+{
+	struct record *rec = current;
+
+	if (!rec)
+		return;
+
+	current = NULL;
+
+	if (!store) {
+		for (size_t i = 0; i < rec->deps_nr; i++)
+			free((char *) rec->deps[i]);
+		free(rec->deps);
+		free(rec);
+		return;
+	}
+
+	make_key(&rec->key, st);
+	rec->owned = true;
+
+	pthread_mutex_lock(&records_lock);
+
+	*new_record() = *rec;
+
+	pthread_mutex_unlock(&records_lock);
+
+	free(rec);
+}
+
+struct record *new_record(void)
+{
+	if (records_nr == records_size) {
+		records_size = records_size ? records_size * 2 : 1024;
+		records = xrealloc(records, records_size, sizeof(*records));
+	}
+	memset(&records[records_nr], 0, sizeof(*records));
+	return &records[records_nr++];
+}
+
+void add_mapped(const struct mapping *m, int source)
+{
+	for (size_t i = 0; i < m->entries_nr; i++) {
+		const struct depcache_entry *e = &m->entries[i];
+		struct record *rec;
+		bool valid = true;
+
+		for (size_t k = 0; k < e->deps_nr && valid; k++)
+			valid = (get_dep(m, e, k) != NULL);
+
+		if (!valid)
+			continue;
+
+		rec = new_record();
+
+		rec->key     = *e;
+		rec->deps_nr = e->deps_nr;
+		rec->deps    = xcalloc(e->deps_nr ?: 1, sizeof(char *));
+		rec->source  = source;
+
+		for (size_t k = 0; k < e->deps_nr; k++)
+			rec->deps[k] = get_dep(m, e, k);
+	}
+}
+
+void write_cache(void)
+{
+	struct depcache_header hdr;
+	struct mapping latest;
+	struct strent **strings = NULL;
+	size_t strings_nr = 0;
+	void *strtree = NULL;
+	uint64_t deps_nr = 0, strings_size = 0;
+	size_t entries_nr = 0;
+	char *tmpname = NULL;
+	FILE *fp;
+	int fd;
+
+	/*
+	 * Another run could have replaced the file since we mapped it, so its
+	 * entries are merged too. Entries of this run take precedence.
+	 */
+	map_file(&latest, cache_file);
+
+	add_mapped(&latest, 1);
+	add_mapped(&cache_map, 2);
+
+	qsort(records, records_nr, sizeof(*records), compare_record);
+
+	for (size_t i = 0; i < records_nr; i++) {
+		if (i && !compare_entry(&records[i - 1].key, &records[i].key)) {
+			records[i].skip = true;
+			continue;
+		}
+
+		entries_nr++;
+		deps_nr += records[i].deps_nr;
+
+		for (size_t k = 0; k < records[i].deps_nr; k++) {
+			struct strent key = { .str = records[i].deps[k] };
+			struct strent *new;
+
+			if (tfind(&key, &strtree, compare_strent))
+				continue;
+
+			new = xcalloc(1, sizeof(*new));
+			new->str = records[i].deps[k];
+			new->off = (uint32_t) strings_size;
+
+			strings = xrealloc(strings, strings_nr + 1, sizeof(*strings));
+			strings[strings_nr++] = new;
+
+			if (!tsearch(new, &strtree, compare_strent))
+				err(EX_OSERR, "tsearch");
+
+			strings_size += strlen(new->str) + 1;
+			if (strings_size > UINT32_MAX)
+				goto end;
+		}
+	}
+
+	if (asprintf(&tmpname, "%s.XXXXXX", cache_file) < 0)
+		err(EX_OSERR, "asprintf");
+
+	if ((fd = mkstemp(tmpname)) < 0) {
+		warn("mkstemp: %s", tmpname);
+		goto end;
+	}
+
+	fchmod(fd, 0644);
+
+	if ((fp = fdopen(fd, "w")) == NULL)
+		err(EX_OSERR, "fdopen: %s", tmpname);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DEPCACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version      = DEPCACHE_VERSION;
+	hdr.entries_nr   = (uint32_t) entries_nr;
+	hdr.context      = cache_context;
+	hdr.deps_nr      = deps_nr;
+	hdr.strings_size = strings_size;
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	deps_nr = 0;
+	for (size_t i = 0; i < records_nr; i++) {
+		struct depcache_entry e;
+
+		if (records[i].skip)
+			continue;
+
+		e = records[i].key;
+		e.deps = deps_nr;
+		e.deps_nr = (uint32_t) records[i].deps_nr;
+		deps_nr += records[i].deps_nr;
+
+		fwrite(&e, sizeof(e), 1, fp);
+	}
+
+	for (size_t i = 0; i < records_nr; i++) {
+		if (records[i].skip)
+			continue;
+
+		for (size_t k = 0; k < records[i].deps_nr; k++) {
+			struct strent key = { .str = records[i].deps[k] };
+			struct strent **node = tfind(&key, &strtree, compare_strent);
+
+			fwrite(&(*node)->off, sizeof(uint32_t), 1, fp);
+		}
+	}
+
+	for (size_t i = 0; i < strings_nr; i++)
+		fwrite(strings[i]->str, strlen(strings[i]->str) + 1, 1, fp);
+
+	if (fflush(fp) || ferror(fp)) {
+		warn("write: %s", tmpname);
+		fclose(fp);
+		unlink(tmpname);
+	} else if (fclose(fp) || rename(tmpname, cache_file) < 0) {
+		warn("rename: %s", tmpname);
+		unlink(tmpname);
+	}
+end:
+#ifdef HAVE_TDESTROY
+	tdestroy(strtree, noop_free);
+#endif
+	unmap_file(&latest);
+	for (size_t i = 0; i < strings_nr; i++)
+		free(strings[i]);
+	free(strings);
+	free(tmpname);
+}
+
+void depcache_close(void)
+{
+	if (!cache_file)
+		return;
+
+	/* Nothing new has been learned. */
+	if (records_nr)
+		write_cache();
+
+	for (size_t i = 0; i < records_nr; i++) {
+		if (records[i].owned) {
+			for (size_t k = 0; k < records[i].deps_nr; k++)
+				free((char *) records[i].deps[k]);
+		}
+		free(records[i].deps);
+	}
+
+	free(records);
+	unmap_file(&cache_map);
+	free(cache_file);
+
+	records = NULL;
+	records_nr = records_size = 0;
+	cache_file = NULL;
+}
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_DEPCACHE_H__
+#define __INITRD_PUT_DEPCACHE_H__
+
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef void (*depcache_handler_t)(const char *path);
+
+/* The environment variables that affect the dependencies of files. */
+extern const char *const depcache_env[];
+
+uint64_t depcache_context(void);
+
+void depcache_open(const char *filename) __attribute__((__nonnull__ (1)));
+void depcache_close(void);
+
+bool depcache_lookup(const struct stat *st, depcache_handler_t handler) __attribute__((__nonnull__ (1, 2)));
+
+void depcache_begin(void);
+void depcache_add(const char *path) __attribute__((__nonnull__ (1)));
+void depcache_end(const struct stat *st, bool store) __attribute__((__nonnull__ (1)));
+
+#endif // __INITRD_PUT_DEPCACHE_H__
@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "memory.h"
+#include "hash.h"
+#include "dircache.h"
+
+/*
+ * Open descriptors of the recently used destination directories. A missing
+ * directory is opened relative to its parent, so the kernel only has to
+ * look up one component. Each thread has its own cache, so a descriptor
+ * can't be closed by someone else while it is in use.
+ */
+#define DIRCACHE_SIZE 64
+
+struct dircache_entry {
+	char *path;
+	size_t len;
+	size_t hash;
+	int fd;
+	unsigned long stamp;
+	bool pinned;
+};
+
+static const char *root = NULL;
+
+static __thread struct dircache_entry entries[DIRCACHE_SIZE];
+static __thread size_t entries_nr = 0;
+static __thread unsigned long clock_stamp = 0;
+
+static int lookup(const char *path, size_t len, size_t hash) __attribute__((__nonnull__ (1)));
+static void insert(const char *path, size_t len, size_t hash, int fd) __attribute__((__nonnull__ (1)));
+static int open_dir(const char *path, size_t len) __attribute__((__nonnull__ (1)));
+
+int lookup(const char *path, size_t len, size_t hash)
+{
+	for (size_t i = 0; i < entries_nr; i++) {
+		if (entries[i].hash == hash && entries[i].len == len &&
+		    !memcmp(entries[i].path, path, len)) {
+			entries[i].stamp = ++clock_stamp;
+			return entries[i].fd;
+		}
+	}
+	return -1;
+}
+
+void insert(const char *path, size_t len, size_t hash, int fd)
+{
+	struct dircache_entry *e;
+
+	if (entries_nr < DIRCACHE_SIZE) {
+		e = &entries[entries_nr++];
+	} else {
+		e = NULL;
+
+		for (size_t i = 0; i < entries_nr; i++) {
+			if (!entries[i].pinned && (!e || entries[i].stamp < e->stamp))
+				e = &entries[i];
+		}
+
+		close(e->fd);
+		free(e->path);
+	}
+
+	e->path  = xstrndup(path, len);
+	e->len   = len;
+	e->hash  = hash;
+	e->fd     = fd;
+	e->stamp  = ++clock_stamp;
+	e->pinned = false;
+}
+
+/*
+ * The returned descriptor stays valid until the next call because the
+ * entry that has just been used is never the one to be evicted.
+ */
+int open_dir(const char *path, size_t len)
+{
+	size_t hash = hash_path(path, len);
+	char name[NAME_MAX + 1];
+	const char *slash;
+	int parent, fd;
+
+	if ((fd = lookup(path, len, hash)) >= 0)
+		return fd;
+
+	if (!len) {
+		fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	} else {
+		slash = memrchr(path, '/', len);
+		if (!slash) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		if ((parent = open_dir(path, (size_t)(slash - path))) < 0)
+			return -1;
+
+		size_t name_len = len - (size_t)(slash - path) - 1;
+
+		if (!name_len)
+			return parent;
+
+		if (name_len >= sizeof(name)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		memcpy(name, slash + 1, name_len);
+		name[name_len] = '\0';
+
+		fd = openat(parent, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	}
+
+	if (fd < 0)
+		return -1;
+
+	insert(path, len, hash, fd);
+	return fd;
+}
+
+void dircache_init(const char *destdir)
+{
+	root = destdir;
+}
+
+/*
+ * Returns the descriptor of the directory in which the destination path is
+ * located and the last component of the path. The destination directory
+ * itself is "." in its own descriptor.
+ */
+int dircache_resolve(const char *path, const char **name)
+{
+	const char *slash = strrchr(path, '/');
+
+	if (!slash) {
+		*name = ".";
+		return open_dir(path, 0);
+	}
+
+	*name = slash + 1;
+	return open_dir(path, (size_t)(slash - path));
+}
+
+/*
+ * A pinned descriptor is not evicted until dircache_unpin(), so it can be
+ * used after other paths have been resolved. Less than DIRCACHE_SIZE
+ * descriptors may be pinned at once.
+ */
+void dircache_pin(int fd)
+{
+	for (size_t i = 0; i < entries_nr; i++) {
+		if (entries[i].fd == fd) {
+			entries[i].pinned = true;
+			break;
+		}
+	}
+}
+
+void dircache_unpin(void)
+{
+	for (size_t i = 0; i < entries_nr; i++)
+		entries[i].pinned = false;
+}
+
+void dircache_flush(void)
+{
+	for (size_t i = 0; i < entries_nr; i++) {
+		close(entries[i].fd);
+		free(entries[i].path);
+	}
+	entries_nr = 0;
+}
@@ -0,0 +1,11 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_DIRCACHE_H__
+#define __INITRD_PUT_DIRCACHE_H__
+
+void dircache_init(const char *destdir) __attribute__((__nonnull__ (1)));
+int dircache_resolve(const char *path, const char **name) __attribute__((__nonnull__ (1, 2)));
+void dircache_pin(int fd);
+void dircache_unpin(void);
+void dircache_flush(void);
+
+#endif // __INITRD_PUT_DIRCACHE_H__
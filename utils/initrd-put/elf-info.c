@@ -0,0 +1,373 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <elf.h>
+#include <err.h>
+
+#include "memory.h"
+#include "elf-info.h"
+
+#define _FDO_ELF_METADATA 0x407c0c0a
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define ELFDATA_NATIVE ELFDATA2LSB
+#else
+#define ELFDATA_NATIVE ELFDATA2MSB
+#endif
+
+static bool in_bounds(const struct elf_info *info, uint64_t off, uint64_t len) __attribute__((__nonnull__ (1)));
+static bool get_phdr(const struct elf_info *info, const Elf64_Ehdr *ehdr, size_t i, Elf64_Phdr *phdr) __attribute__((__nonnull__ (1, 2, 4)));
+static bool get_shdr(const struct elf_info *info, const Elf64_Ehdr *ehdr, size_t i, Elf64_Shdr *shdr) __attribute__((__nonnull__ (1, 2, 4)));
+static bool get_dyn(const struct elf_info *info, uint64_t off, Elf64_Dyn *dyn) __attribute__((__nonnull__ (1, 3)));
+static bool vaddr_to_offset(const struct elf_info *info, const Elf64_Ehdr *ehdr, uint64_t vaddr, uint64_t *off) __attribute__((__nonnull__ (1, 2, 4)));
+static const char *get_string(const struct elf_info *info, uint64_t off) __attribute__((__nonnull__ (1)));
+static void scan_notes(struct elf_info *info, uint64_t off, uint64_t size, uint64_t align) __attribute__((__nonnull__ (1)));
+
+bool in_bounds(const struct elf_info *info, uint64_t off, uint64_t len)
+{
+	return off <= info->size && len <= info->size - off;
+}
+
+bool get_phdr(const struct elf_info *info, const Elf64_Ehdr *ehdr, size_t i, Elf64_Phdr *phdr)
+{
+	uint64_t off = ehdr->e_phoff + i * ehdr->e_phentsize;
+
+	if (info->class == ELFCLASS64) {
+		if (!in_bounds(info, off, sizeof(Elf64_Phdr)))
+			return false;
+		memcpy(phdr, info->map + off, sizeof(Elf64_Phdr));
+	} else {
+		Elf32_Phdr p;
+
+		if (!in_bounds(info, off, sizeof(p)))
+			return false;
+		memcpy(&p, info->map + off, sizeof(p));
+
+		phdr->p_type   = p.p_type;
+		phdr->p_flags  = p.p_flags;
+		phdr->p_offset = p.p_offset;
+		phdr->p_vaddr  = p.p_vaddr;
+		phdr->p_paddr  = p.p_paddr;
+		phdr->p_filesz = p.p_filesz;
+		phdr->p_memsz  = p.p_memsz;
+		phdr->p_align  = p.p_align;
+	}
+	return true;
+}
+
+bool get_shdr(const struct elf_info *info, const Elf64_Ehdr *ehdr, size_t i, Elf64_Shdr *shdr)
+{
+	uint64_t off = ehdr->e_shoff + i * ehdr->e_shentsize;
+
+	if (info->class == ELFCLASS64) {
+		if (!in_bounds(info, off, sizeof(Elf64_Shdr)))
+			return false;
+		memcpy(shdr, info->map + off, sizeof(Elf64_Shdr));
+	} else {
+		Elf32_Shdr s;
+
+		if (!in_bounds(info, off, sizeof(s)))
+			return false;
+		memcpy(&s, info->map + off, sizeof(s));
+
+		shdr->sh_name      = s.sh_name;
+		shdr->sh_type      = s.sh_type;
+		shdr->sh_flags     = s.sh_flags;
+		shdr->sh_addr      = s.sh_addr;
+		shdr->sh_offset    = s.sh_offset;
+		shdr->sh_size      = s.sh_size;
+		shdr->sh_link      = s.sh_link;
+		shdr->sh_info      = s.sh_info;
+		shdr->sh_addralign = s.sh_addralign;
+		shdr->sh_entsize   = s.sh_entsize;
+	}
+	return true;
+}
+
+bool get_dyn(const struct elf_info *info, uint64_t off, Elf64_Dyn *dyn)
+{
+	if (info->class == ELFCLASS64) {
+		if (!in_bounds(info, off, sizeof(Elf64_Dyn)))
+			return false;
+		memcpy(dyn, info->map + off, sizeof(Elf64_Dyn));
+	} else {
+		Elf32_Dyn d;
+
+		if (!in_bounds(info, off, sizeof(d)))
+			return false;
+		memcpy(&d, info->map + off, sizeof(d));
+
+		dyn->d_tag = d.d_tag;
+		dyn->d_un.d_val = d.d_un.d_val;
+	}
+	return true;
+}
+
+bool vaddr_to_offset(const struct elf_info *info, const Elf64_Ehdr *ehdr, uint64_t vaddr, uint64_t *off)
+{
+	Elf64_Phdr phdr;
+
+	for (size_t i = 0; i < ehdr->e_phnum; i++) {
+		if (!get_phdr(info, ehdr, i, &phdr))
+			return false;
+
+		if (phdr.p_type != PT_LOAD)
+			continue;
+
+		if (vaddr >= phdr.p_vaddr && vaddr - phdr.p_vaddr < phdr.p_filesz) {
+			*off = phdr.p_offset + (vaddr - phdr.p_vaddr);
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *get_string(const struct elf_info *info, uint64_t off)
+{
+	if (off >= info->size || !memchr(info->map + off, '\0', info->size - off))
+		return NULL;
+	return (const char *) info->map + off;
+}
+
+/*
+ * The note header is the same for both classes. The payload is used in place,
+ * so only the notes with a NUL-terminated descriptor are taken.
+ */
+void scan_notes(struct elf_info *info, uint64_t off, uint64_t size, uint64_t align)
+{
+	Elf64_Nhdr nhdr;
+	uint64_t end;
+
+	if (!in_bounds(info, off, size))
+		return;
+
+	align = (align == 8) ? 8 : 4;
+	end = off + size;
+
+	while (end - off >= sizeof(nhdr)) {
+		uint64_t name, desc;
+
+		memcpy(&nhdr, info->map + off, sizeof(nhdr));
+
+		name = off + sizeof(nhdr);
+		desc = name + ((nhdr.n_namesz + align - 1) & ~(align - 1));
+
+		if (desc > end || nhdr.n_descsz > end - desc)
+			return;
+
+		if (nhdr.n_type == _FDO_ELF_METADATA &&
+		    nhdr.n_namesz == sizeof(ELF_NOTE_FDO) &&
+		    !memcmp(info->map + name, ELF_NOTE_FDO, sizeof(ELF_NOTE_FDO)) &&
+		    memchr(info->map + desc, '\0', nhdr.n_descsz)) {
+			info->dlopen = xrealloc(info->dlopen, info->dlopen_nr + 1, sizeof(char *));
+			info->dlopen[info->dlopen_nr++] = (const char *) info->map + desc;
+		}
+
+		off = desc + ((nhdr.n_descsz + align - 1) & ~(align - 1));
+		if (off >= end)
+			return;
+	}
+}
+
+int elf_info_read(struct elf_info *info, const char *filename, int fd)
+{
+	struct stat sb;
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr phdr;
+	Elf64_Shdr shdr;
+	size_t shnum;
+	uint64_t dyn_off = 0, dyn_size = 0;
+	uint64_t strtab = 0, strsz = 0;
+	bool has_strtab = false;
+
+	memset(info, 0, sizeof(*info));
+
+	if (fstat(fd, &sb) < 0) {
+		warn("fstat: %s", filename);
+		return -1;
+	}
+
+	if ((size_t) sb.st_size < EI_NIDENT)
+		return -1;
+
+	info->size = (size_t) sb.st_size;
+	info->map = mmap(NULL, info->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (info->map == MAP_FAILED) {
+		warn("mmap: %s", filename);
+		info->map = NULL;
+		return -1;
+	}
+
+	if (memcmp(info->map, ELFMAG, SELFMAG) ||
+	    info->map[EI_DATA] != ELFDATA_NATIVE ||
+	    (info->map[EI_CLASS] != ELFCLASS32 && info->map[EI_CLASS] != ELFCLASS64))
+		goto fail;
+
+	info->class = info->map[EI_CLASS];
+
+	if (info->class == ELFCLASS64) {
+		if (!in_bounds(info, 0, sizeof(Elf64_Ehdr)))
+			goto fail;
+		memcpy(&ehdr, info->map, sizeof(ehdr));
+	} else {
+		Elf32_Ehdr e;
+
+		if (!in_bounds(info, 0, sizeof(e)))
+			goto fail;
+		memcpy(&e, info->map, sizeof(e));
+
+		ehdr.e_type      = e.e_type;
+		ehdr.e_machine   = e.e_machine;
+		ehdr.e_phoff     = e.e_phoff;
+		ehdr.e_phentsize = e.e_phentsize;
+		ehdr.e_phnum     = e.e_phnum;
+		ehdr.e_shoff     = e.e_shoff;
+		ehdr.e_shentsize = e.e_shentsize;
+		ehdr.e_shnum     = e.e_shnum;
+	}
+
+	info->type    = ehdr.e_type;
+	info->machine = ehdr.e_machine;
+
+	/*
+	 * With more than SHN_LORESERVE sections the real number is kept in the
+	 * first section header.
+	 */
+	shnum = ehdr.e_shnum;
+
+	if (!ehdr.e_shoff) {
+		shnum = 0;
+	} else if (!shnum) {
+		shnum = get_shdr(info, &ehdr, 0, &shdr) ? (size_t) shdr.sh_size : 0;
+	}
+
+	for (size_t i = 0; i < ehdr.e_phnum; i++) {
+		if (!get_phdr(info, &ehdr, i, &phdr))
+			goto fail;
+
+		switch (phdr.p_type) {
+			case PT_INTERP:
+				if (!in_bounds(info, phdr.p_offset, phdr.p_filesz))
+					goto fail;
+				info->interp = get_string(info, phdr.p_offset);
+				break;
+			case PT_DYNAMIC:
+				dyn_off  = phdr.p_offset;
+				dyn_size = phdr.p_filesz;
+				info->dynamic = true;
+				break;
+			case PT_NOTE:
+				/*
+				 * Without section headers the notes are still
+				 * reachable through the segments.
+				 */
+				if (!shnum)
+					scan_notes(info, phdr.p_offset, phdr.p_filesz, phdr.p_align);
+				break;
+		}
+	}
+
+	/*
+	 * Not all notes have to be loaded, so the sections are preferred if
+	 * they are present.
+	 */
+	for (size_t i = 0; i < shnum; i++) {
+		if (!get_shdr(info, &ehdr, i, &shdr))
+			break;
+
+		if (shdr.sh_type == SHT_NOTE)
+			scan_notes(info, shdr.sh_offset, shdr.sh_size, shdr.sh_addralign);
+	}
+
+	if (!info->dynamic)
+		return 0;
+
+	if (!in_bounds(info, dyn_off, dyn_size))
+		goto fail;
+
+	size_t dynent = (info->class == ELFCLASS64) ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+	Elf64_Dyn dyn;
+
+	/*
+	 * The dynamic string table is referenced by its address, so it has to
+	 * be found before any string can be resolved.
+	 */
+	for (uint64_t off = dyn_off; off + dynent <= dyn_off + dyn_size; off += dynent) {
+		if (!get_dyn(info, off, &dyn) || dyn.d_tag == DT_NULL)
+			break;
+
+		if (dyn.d_tag == DT_STRTAB) {
+			has_strtab = vaddr_to_offset(info, &ehdr, dyn.d_un.d_ptr, &strtab);
+		} else if (dyn.d_tag == DT_STRSZ) {
+			strsz = dyn.d_un.d_val;
+		}
+	}
+
+	if (!has_strtab || !in_bounds(info, strtab, strsz))
+		goto fail;
+
+	for (uint64_t off = dyn_off; off + dynent <= dyn_off + dyn_size; off += dynent) {
+		const char *str;
+
+		if (!get_dyn(info, off, &dyn) || dyn.d_tag == DT_NULL)
+			break;
+
+		switch (dyn.d_tag) {
+			case DT_NEEDED:
+			case DT_SONAME:
+			case DT_RPATH:
+			case DT_RUNPATH:
+				if (dyn.d_un.d_val >= strsz)
+					goto fail;
+				break;
+			default:
+				continue;
+		}
+
+		str = get_string(info, strtab + dyn.d_un.d_val);
+		if (!str)
+			goto fail;
+
+		switch (dyn.d_tag) {
+			case DT_NEEDED:
+				info->needed = xrealloc(info->needed, info->needed_nr + 1, sizeof(char *));
+				info->needed[info->needed_nr++] = str;
+				break;
+			case DT_SONAME:
+				info->soname = str;
+				break;
+			case DT_RPATH:
+				info->rpath = str;
+				break;
+			case DT_RUNPATH:
+				info->runpath = str;
+				break;
+		}
+	}
+
+	return 0;
+fail:
+	elf_info_free(info);
+	return -1;
+}
+
+void elf_info_free(struct elf_info *info)
+{
+	if (info->map)
+		munmap(info->map, info->size);
+	free(info->needed);
+	free(info->dlopen);
+	memset(info, 0, sizeof(*info));
+}
+
+bool elf_info_compatible(const struct elf_info *a, const struct elf_info *b)
+{
+	return a->class == b->class && a->machine == b->machine;
+}
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_ELF_INFO_H__
+#define __INITRD_PUT_ELF_INFO_H__
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct elf_info {
+	unsigned char *map;
+	size_t size;
+
+	unsigned char class;
+	uint16_t type;
+	uint16_t machine;
+
+	bool dynamic;
+
+	const char *interp;
+	const char *soname;
+	const char *rpath;
+	const char *runpath;
+
+	const char **needed;
+	size_t needed_nr;
+
+	/* JSON payloads of the FDO dlopen notes (.note.dlopen). */
+	const char **dlopen;
+	size_t dlopen_nr;
+};
+
+int elf_info_read(struct elf_info *info, const char *filename, int fd) __attribute__((__nonnull__ (1, 2)));
+void elf_info_free(struct elf_info *info) __attribute__((__nonnull__ (1)));
+bool elf_info_compatible(const struct elf_info *a, const struct elf_info *b) __attribute__((__nonnull__ (1, 2)));
+
+#endif // __INITRD_PUT_ELF_INFO_H__
@@ -3,10 +3,13 @@
 #ifndef __ELF_DLOPEN_H__
 #define __ELF_DLOPEN_H__
 
+#include "ldso.h"
+
+/* The handler is called for each library of the metadata that is found. */
 #ifdef HAVE_LIBJSON_C
-int process_json_metadata(const char *filename, const char *json, char *buf);
+int process_json_metadata(const char *filename, const char *json, ldso_handler_t handler);
 #else
-inline int process_json_metadata(const char *, const char *, char *)
+inline int process_json_metadata(const char *, const char *, ldso_handler_t)
 {
 	return 0;
 }
@@ -9,51 +9,47 @@
 #include <ctype.h>
 #include <err.h>
 
+#include <libelf.h>
 #include <gelf.h>
 
 #include "queue.h"
 #include "tree.h"
 #include "enqueue.h"
 #include "elf_dlopen.h"
-
-#define _FDO_ELF_METADATA 0x407c0c0a
+#include "elf-info.h"
+#include "ldso.h"
+#include "stats.h"
 
 extern int verbose;
+extern int use_ldd;
 
 static bool is_dynamic_elf_file(const char *filename, int fd) __attribute__((__nonnull__ (1)));
-static int enqueue_elf_dlopen(const char *filename, int fd) __attribute__((__nonnull__ (1)));
+static void enqueue_elf_dlopen(const char *filename, const struct elf_info *info) __attribute__((__nonnull__ (1, 2)));
+static void enqueue_dlopen_library(const char *filename, const char *library) __attribute__((__nonnull__ (1, 2)));
 static int enqueue_shared_libraries(const char *filename) __attribute__((__nonnull__ (1)));
+static void enqueue_shared_library(const char *filename, const char *library) __attribute__((__nonnull__ (1, 2)));
 
 
+/*
+ * libelf understands any byte order and class, so it is asked whether a file
+ * that the builtin parser has rejected is worth passing to ldd(1).
+ */
 bool is_dynamic_elf_file(const char *filename, int fd)
 {
 	bool is_dynamic = false;
 	Elf *e;
 	Elf_Scn *scn;
-	size_t shstrndx;
 
 	if ((e = elf_begin(fd, ELF_C_READ, NULL)) == NULL) {
 		warnx("%s: elf_begin: %s", filename, elf_errmsg(-1));
-		goto err;
-	}
-
-	switch (elf_kind(e)) {
-		case  ELF_K_NONE:
-		case  ELF_K_AR:
-		case ELF_K_COFF:
-		case  ELF_K_ELF:
-			break;
-		default:
-			goto end;
+		return false;
 	}
 
-	if (elf_getshdrstrndx(e, &shstrndx) != 0) {
-		warnx("%s: elf_getshdrstrndx: %s", filename, elf_errmsg(-1));
+	if (elf_kind(e) != ELF_K_ELF)
 		goto end;
-	}
 
 	for (scn = NULL; (scn = elf_nextscn(e, scn)) != NULL;) {
-		GElf_Shdr  shdr;
+		GElf_Shdr shdr;
 
 		if (gelf_getshdr(scn, &shdr) != &shdr) {
 			warnx("%s: gelf_getshdr: %s", filename, elf_errmsg(-1));
@@ -67,69 +63,22 @@ bool is_dynamic_elf_file(const char *filename, int fd)
 	}
 end:
 	elf_end(e);
-err:
 	return is_dynamic;
 }
 
-int enqueue_elf_dlopen(const char *filename, int fd)
+/*
+ * A note may list several libraries, each of them found is passed to
+ * enqueue_dlopen_library().
+ */
+void enqueue_elf_dlopen(const char *filename, const struct elf_info *info)
 {
-	int ret = 0;
-	char library[PATH_MAX + 1];
-	Elf *e;
-	Elf_Scn *scn;
-
-	if ((e = elf_begin(fd, ELF_C_READ, NULL)) == NULL) {
-		warnx("%s: elf_begin: %s", filename, elf_errmsg(-1));
-		goto err;
-	}
-
-	switch (elf_kind(e)) {
-		case  ELF_K_NONE:
-		case  ELF_K_AR:
-		case ELF_K_COFF:
-		case  ELF_K_ELF:
-			break;
-		default:
-			goto end;
-	}
-
-	for (scn = NULL; (scn = elf_nextscn(e, scn)) != NULL;) {
-		GElf_Shdr  shdr;
-		GElf_Nhdr nhdr;
-		size_t off, next, n_off, d_off;
-		Elf_Data *data;
-
-		if (gelf_getshdr(scn, &shdr) != &shdr) {
-			warnx("%s: gelf_getshdr: %s", filename, elf_errmsg(-1));
-			goto end;
-		}
-
-		if (shdr.sh_type != SHT_NOTE)
-			continue;
-
-		data = elf_getdata(scn, NULL);
-		if (data == NULL) {
-			warnx("%s: elf_getdata: %s", filename, elf_errmsg(-1));
-			goto end;
-		}
-
-		off = 0;
-		while ((next = gelf_getnote(data, off, &nhdr, &n_off, &d_off)) > 0) {
-			if (nhdr.n_type == _FDO_ELF_METADATA && nhdr.n_namesz == sizeof(ELF_NOTE_FDO) && !strcmp(data->d_buf + n_off, ELF_NOTE_FDO)) {
-				library[0] = '\0';
-
-				process_json_metadata(filename, (char *)data->d_buf + d_off, library);
+	for (size_t i = 0; i < info->dlopen_nr; i++)
+		process_json_metadata(filename, info->dlopen[i], enqueue_dlopen_library);
+}
 
-				if (library[0] == '/' && !is_path_added(library))
-					enqueue_item(library, -1);
-			}
-			off = next;
-		}
-	}
-end:
-	elf_end(e);
-err:
-	return ret;
+void enqueue_dlopen_library(const char *filename __attribute__((unused)), const char *library)
+{
+	enqueue_dependency(library);
 }
 
 int enqueue_shared_libraries(const char *filename)
@@ -174,13 +123,7 @@ int enqueue_shared_libraries(const char *filename)
 		if (*p != '/')
 			continue;
 
-		if (verbose > 1)
-			warnx("shared object '%s' depends on '%s'", filename, p);
-
-		if (is_path_added(p))
-			continue;
-
-		enqueue_item(p, -1);
+		enqueue_shared_library(filename, p);
 	}
 
 	free(line);
@@ -189,6 +132,14 @@ int enqueue_shared_libraries(const char *filename)
 	return 0;
 }
 
+void enqueue_shared_library(const char *filename, const char *library)
+{
+	if (verbose > 1)
+		warnx("shared object '%s' depends on '%s'", filename, library);
+
+	enqueue_dependency(library);
+}
+
 void init_elf_library(void)
 {
 	if (elf_version(EV_CURRENT) == EV_NONE)
@@ -203,14 +154,56 @@ bool is_elf_file(char buf[LINE_MAX])
 	        buf[3] == ELFMAG[3]);
 }
 
+/*
+ * The file is mapped and parsed once: the same info gives the needed
+ * libraries and the dlopen notes. The files that the builtin parser does
+ * not understand are left to ldd(1).
+ */
 int enqueue_libraries(const char *filename, int fd)
 {
+	struct stats_timer timer;
+	struct elf_info info;
 	int ret = 0;
 
-	if (is_dynamic_elf_file(filename, fd)) {
+	stats_start(&timer);
+
+	if (elf_info_read(&info, filename, fd) < 0) {
+		bool is_dynamic = is_dynamic_elf_file(filename, fd);
+
+		stats_stop(&timer, STATS_ELF);
+
+		if (!is_dynamic)
+			return 0;
+
+		if (verbose > 1)
+			warnx("%s: unable to parse ELF file, using ldd", filename);
+
+		stats_start(&timer);
 		ret = enqueue_shared_libraries(filename);
-		if (!ret)
-			ret = enqueue_elf_dlopen(filename, fd);
+		stats_stop(&timer, STATS_RESOLVE);
+
+		return ret;
 	}
+
+	stats_stop(&timer, STATS_ELF);
+
+	if (!info.dynamic)
+		goto end;
+
+	stats_start(&timer);
+
+	if (use_ldd)
+		ret = enqueue_shared_libraries(filename);
+	else
+		ret = ldso_dependencies(filename, fd, &info, enqueue_shared_library);
+
+	if (ret >= 0) {
+		enqueue_elf_dlopen(filename, &info);
+		ret = 0;
+	}
+
+	stats_stop(&timer, STATS_RESOLVE);
+end:
+	elf_info_free(&info);
 	return ret;
 }
@@ -29,8 +29,7 @@ int enqueue_shebang(const char *filename, char buf[LINE_MAX])
 	if (verbose > 1)
 		warnx("shell script '%s' uses the '%s' interpreter", filename, p);
 
-	if (!is_path_added(p))
-		enqueue_item(p, -1);
+	enqueue_dependency(p);
 
 	return 0;
 }
@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <limits.h>
 
+void enqueue_dependency(const char *path) __attribute__((__nonnull__ (1)));
+
 bool is_shebang(char buf[LINE_MAX]);
 int enqueue_shebang(const char *filename, char buf[LINE_MAX]);
 
@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <err.h>
+#include <regex.h>
+
+#include "memory.h"
+#include "exclude.h"
+
+#define REGEX_FLAGS (REG_NOSUB | REG_NEWLINE | REG_EXTENDED)
+
+/*
+ * Most of the patterns are plain strings anchored at one or both ends. They
+ * are compared directly. All the other patterns are joined into one
+ * regular expression so that a path is matched against them in one call.
+ */
+enum pattern_kind {
+	PATTERN_REGEX = 0,
+	PATTERN_PREFIX,
+	PATTERN_SUFFIX,
+	PATTERN_EXACT,
+	PATTERN_SUBSTRING,
+};
+
+struct pattern {
+	char *source;
+	enum pattern_kind kind;
+	char *literal;
+	size_t literal_len;
+	bool combined;
+	regex_t re;
+	size_t rejected;
+};
+
+extern int verbose;
+
+static struct pattern *patterns = NULL;
+static size_t patterns_nr = 0;
+
+static regex_t combined;
+static bool has_combined = false;
+
+static bool parse_literal(struct pattern *p) __attribute__((__nonnull__ (1)));
+static bool has_backref(const char *pattern) __attribute__((__nonnull__ (1)));
+static bool pattern_match(const struct pattern *p, const char *path, size_t len) __attribute__((__nonnull__ (1, 2)));
+
+/*
+ * Recognizes an extended regular expression without any special
+ * characters except the anchors at the ends.
+ */
+bool parse_literal(struct pattern *p)
+{
+	static const char special[] = ".[]()*+?{}|^$\\";
+	const char *s = p->source;
+	size_t len = strlen(s);
+	bool head = false, tail = false;
+	char *out;
+
+	if (len > 0 && s[0] == '^') {
+		head = true;
+		s++;
+		len--;
+	}
+
+	if (len > 0 && s[len - 1] == '$' && (len == 1 || s[len - 2] != '\\')) {
+		tail = true;
+		len--;
+	}
+
+	out = p->literal = xcalloc(len + 1, sizeof(char));
+
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == '\\') {
+			if (i + 1 == len || !strchr(special, s[i + 1]))
+				goto fail;
+			*out++ = s[++i];
+		} else if (strchr(special, s[i])) {
+			goto fail;
+		} else {
+			*out++ = s[i];
+		}
+	}
+
+	p->literal_len = (size_t)(out - p->literal);
+
+	if (head && tail)
+		p->kind = PATTERN_EXACT;
+	else if (head)
+		p->kind = PATTERN_PREFIX;
+	else if (tail)
+		p->kind = PATTERN_SUFFIX;
+	else
+		p->kind = PATTERN_SUBSTRING;
+
+	return true;
+fail:
+	free(p->literal);
+	p->literal = NULL;
+	return false;
+}
+
+/*
+ * The group numbers change when the patterns are joined, so patterns with
+ * back-references are matched on their own.
+ */
+bool has_backref(const char *pattern)
+{
+	for (const char *s = pattern; *s; s++) {
+		if (*s != '\\')
+			continue;
+		if (s[1] >= '1' && s[1] <= '9')
+			return true;
+		if (s[1])
+			s++;
+	}
+	return false;
+}
+
+void exclude_add(const char *pattern)
+{
+	struct pattern *p;
+
+	patterns = xrealloc(patterns, patterns_nr + 1, sizeof(struct pattern));
+
+	p = &patterns[patterns_nr];
+	memset(p, 0, sizeof(*p));
+
+	/*
+	 * The pattern is always compiled: this checks the syntax and gives the
+	 * exact answer when the fast paths can not be used.
+	 */
+	if (regcomp(&p->re, pattern, REGEX_FLAGS))
+		errx(EX_USAGE, "bad regexp");
+
+	p->source = xstrdup(pattern);
+
+	if (!parse_literal(p))
+		p->kind = PATTERN_REGEX;
+
+	patterns_nr++;
+}
+
+void exclude_compile(void)
+{
+	char *buf = NULL;
+	size_t len = 0, nr = 0;
+
+	for (size_t i = 0; i < patterns_nr; i++) {
+		if (patterns[i].kind != PATTERN_REGEX || has_backref(patterns[i].source))
+			continue;
+
+		size_t n = strlen(patterns[i].source);
+
+		buf = xrealloc(buf, len + n + 4, sizeof(char));
+
+		if (len > 0)
+			buf[len++] = '|';
+
+		buf[len++] = '(';
+		memcpy(buf + len, patterns[i].source, n);
+		len += n;
+		buf[len++] = ')';
+		buf[len] = '\0';
+
+		nr++;
+	}
+
+	/* There is nothing to gain from a single pattern. */
+	if (nr > 1 && !regcomp(&combined, buf, REGEX_FLAGS)) {
+		has_combined = true;
+
+		for (size_t i = 0; i < patterns_nr; i++) {
+			if (patterns[i].kind == PATTERN_REGEX && !has_backref(patterns[i].source))
+				patterns[i].combined = true;
+		}
+	}
+
+	free(buf);
+}
+
+bool pattern_match(const struct pattern *p, const char *path, size_t len)
+{
+	switch (p->kind) {
+		case PATTERN_PREFIX:
+			return len >= p->literal_len && !memcmp(path, p->literal, p->literal_len);
+		case PATTERN_SUFFIX:
+			return len >= p->literal_len && !memcmp(path + len - p->literal_len, p->literal, p->literal_len);
+		case PATTERN_EXACT:
+			return len == p->literal_len && !memcmp(path, p->literal, len);
+		case PATTERN_SUBSTRING:
+			return memmem(path, len, p->literal, p->literal_len) != NULL;
+		case PATTERN_REGEX:
+			break;
+	}
+	return !regexec(&p->re, path, 0, NULL, 0);
+}
+
+/*
+ * Returns true if the path matches any of the patterns. The rejection is
+ * accounted to the first pattern given on the command line that matches.
+ */
+bool exclude_path(const char *path)
+{
+	size_t len;
+	bool match = false;
+
+	if (!patterns_nr)
+		return false;
+
+	len = strlen(path);
+
+	/*
+	 * With REG_NEWLINE the anchors also match at the line breaks, so the
+	 * literal comparison can't be used.
+	 */
+	if (memchr(path, '\n', len)) {
+		for (size_t i = 0; i < patterns_nr; i++) {
+			if (!regexec(&patterns[i].re, path, 0, NULL, 0)) {
+				__atomic_add_fetch(&patterns[i].rejected, 1, __ATOMIC_RELAXED);
+				match = true;
+				break;
+			}
+		}
+		goto end;
+	}
+
+	for (size_t i = 0; i < patterns_nr && !match; i++) {
+		if (patterns[i].kind != PATTERN_REGEX)
+			match = pattern_match(&patterns[i], path, len);
+	}
+
+	if (!match && has_combined)
+		match = !regexec(&combined, path, 0, NULL, 0);
+
+	for (size_t i = 0; i < patterns_nr && !match; i++) {
+		if (patterns[i].kind == PATTERN_REGEX && !patterns[i].combined)
+			match = pattern_match(&patterns[i], path, len);
+	}
+
+	if (!match)
+		return false;
+
+	for (size_t i = 0; i < patterns_nr; i++) {
+		if (pattern_match(&patterns[i], path, len)) {
+			__atomic_add_fetch(&patterns[i].rejected, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+end:
+	if (match && verbose > 1)
+		warnx("exclude path: %s", path);
+	return match;
+}
+
+void exclude_report(void)
+{
+	for (size_t i = 0; i < patterns_nr; i++)
+		warnx("exclude pattern '%s' rejected %zu paths", patterns[i].source, patterns[i].rejected);
+}
+
+void exclude_free(void)
+{
+	for (size_t i = 0; i < patterns_nr; i++) {
+		regfree(&patterns[i].re);
+		free(patterns[i].literal);
+		free(patterns[i].source);
+	}
+	free(patterns);
+
+	if (has_combined)
+		regfree(&combined);
+
+	patterns = NULL;
+	patterns_nr = 0;
+	has_combined = false;
+}
@@ -0,0 +1,13 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_EXCLUDE_H__
+#define __INITRD_PUT_EXCLUDE_H__
+
+#include <stdbool.h>
+
+void exclude_add(const char *pattern) __attribute__((__nonnull__ (1)));
+void exclude_compile(void);
+bool exclude_path(const char *path) __attribute__((__nonnull__ (1)));
+void exclude_report(void);
+void exclude_free(void);
+
+#endif // __INITRD_PUT_EXCLUDE_H__
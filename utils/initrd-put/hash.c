@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "hash.h"
+
+static struct hashtab_entry *find_slot(const struct hashtab *tab, const char *key, size_t len, size_t hash) __attribute__((__nonnull__ (1, 2)));
+static void grow_table(struct hashtab *tab) __attribute__((__nonnull__ (1)));
+
+/*
+ * FNV-1a. The hash can be continued with more data by passing the previous
+ * result; the first call gets HASH_INIT.
+ */
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+size_t hash_path(const char *path, size_t len)
+{
+	return (size_t) hash_bytes(HASH_INIT, path, len);
+}
+
+struct hashtab_entry *find_slot(const struct hashtab *tab, const char *key, size_t len, size_t hash)
+{
+	size_t mask = tab->size - 1;
+	size_t i = hash & mask;
+	struct hashtab_entry *e;
+
+	while ((e = hashtab_at(tab, i))->key) {
+		if (e->hash == hash && !strncmp(e->key, key, len) && e->key[len] == '\0')
+			break;
+		i = (i + 1) & mask;
+	}
+	return e;
+}
+
+void grow_table(struct hashtab *tab)
+{
+	struct hashtab old = *tab;
+
+	tab->size = tab->size ? tab->size * 2 : tab->min_size;
+	tab->slots = xcalloc(tab->size, tab->entry_size);
+
+	for (size_t i = 0; i < old.size; i++) {
+		struct hashtab_entry *e = hashtab_at(&old, i);
+
+		if (!e->key)
+			continue;
+
+		size_t k = e->hash & (tab->size - 1);
+
+		while (((struct hashtab_entry *) hashtab_at(tab, k))->key)
+			k = (k + 1) & (tab->size - 1);
+		memcpy(hashtab_at(tab, k), e, tab->entry_size);
+	}
+
+	free(old.slots);
+}
+
+/*
+ * Returns the entry with the key or NULL.
+ */
+void *hashtab_find(const struct hashtab *tab, const char *key, size_t len, size_t hash)
+{
+	struct hashtab_entry *e;
+
+	if (!tab->size)
+		return NULL;
+
+	e = find_slot(tab, key, len, hash);
+
+	return e->key ? e : NULL;
+}
+
+/*
+ * Returns the entry with the key. A new entry is zeroed except the hash and
+ * the caller has to set the key before the table is used again.
+ */
+void *hashtab_add(struct hashtab *tab, const char *key, size_t len, size_t hash)
+{
+	struct hashtab_entry *e;
+
+	if ((tab->used + 1) * 4 >= tab->size * 3)
+		grow_table(tab);
+
+	e = find_slot(tab, key, len, hash);
+
+	if (!e->key) {
+		e->hash = hash;
+		tab->used++;
+	}
+
+	return e;
+}
+
+void hashtab_free(struct hashtab *tab)
+{
+	free(tab->slots);
+
+	tab->slots = NULL;
+	tab->size = tab->used = 0;
+}
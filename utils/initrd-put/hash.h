@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_HASH_H__
+#define __INITRD_PUT_HASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+size_t hash_path(const char *path, size_t len) __attribute__((__nonnull__ (1)));
+
+/*
+ * An open addressing hash table (linear probing) keyed by strings. The
+ * entries are structures of the same size that start with struct hashtab_entry.
+ * The table does not own the keys and is not thread-safe.
+ */
+struct hashtab_entry {
+	const char *key;
+	size_t hash;
+};
+
+struct hashtab {
+	void *slots;
+	size_t size;
+	size_t used;
+	size_t entry_size;
+	size_t min_size;
+};
+
+#define HASHTAB_INIT(type, min) { NULL, 0, 0, sizeof(type), (min) }
+
+void *hashtab_find(const struct hashtab *tab, const char *key, size_t len, size_t hash) __attribute__((__nonnull__ (1, 2)));
+void *hashtab_add(struct hashtab *tab, const char *key, size_t len, size_t hash) __attribute__((__nonnull__ (1, 2)));
+void hashtab_free(struct hashtab *tab) __attribute__((__nonnull__ (1)));
+
+static inline void *hashtab_at(const struct hashtab *tab, size_t i)
+{
+	return (char *) tab->slots + i * tab->entry_size;
+}
+
+#endif // __INITRD_PUT_HASH_H__
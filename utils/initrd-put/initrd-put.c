@@ -6,6 +6,10 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/sendfile.h>
+#include <sys/sysinfo.h>
+#include <sys/ioctl.h>
+
+#include <linux/fs.h>
 
 #include <unistd.h>
 #include <stdlib.h>
@@ -16,31 +20,87 @@
 #include <errno.h>
 #include <err.h>
 #include <sysexits.h>
-#include <fts.h>
 #include <fcntl.h>
 #include <ctype.h>
-#include <regex.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "memory.h"
 #include "queue.h"
 #include "tree.h"
 #include "enqueue.h"
+#include "ldso.h"
+#include "uring.h"
+#include "depcache.h"
+#include "exclude.h"
+#include "dircache.h"
+#include "cpio.h"
+#include "dedup.h"
+#include "batch.h"
+#include "manifest.h"
+#include "linkcache.h"
+#include "walk.h"
+#include "stats.h"
+#include "strip.h"
 
 static const char *progname = NULL;
 
 static char *destdir = NULL;
-static size_t destdir_len = 0;
 char *prefix = NULL;
 static size_t prefix_len = 0;
 static char *logfile = NULL;
+static char *cachefile = NULL;
+static char *cpiofile = NULL;
 int verbose = 0;
 static int dry_run = 0;
+static int dump_plan = 0;
 static int force = 0;
+static int dedup = 0;
+static enum stats_mode stats = STATS_NONE;
+static enum strip_mode strip = STRIP_NONE;
+int use_ldd = 0;
+static long jobs = 1;
+
+static int batch_mode = 0;
+static const char *batch_socket = NULL;
+static const char *server_socket = NULL;
+static int batch_argc = 0;
+static char **batch_argv = NULL;
+static uint64_t batch_context = 0;
+
+static char **excludes = NULL;
+static size_t excludes_nr = 0;
+static size_t excludes_size = 0;
+static char **compiled = NULL;
+static size_t compiled_nr = 0;
+
+static char *tree_destdir = NULL;
+static char *tree_prefix = NULL;
+
+/* The long options without a short one. */
+enum {
+	OPT_STRIP = 256,
+	OPT_COPY_BACKEND,
+};
+
+enum link_mode {
+	LINK_COPY = 0,
+	LINK_REFLINK,
+	LINK_HARDLINK,
+	LINK_AUTO,
+};
+
+enum copy_backend {
+	COPY_BACKEND_AUTO = 0,
+	COPY_BACKEND_URING,
+	COPY_BACKEND_CLASSIC,
+};
+
+static enum link_mode link_mode = LINK_COPY;
+static enum copy_backend copy_backend = COPY_BACKEND_AUTO;
+static dev_t destdir_dev = 0;
 static size_t installed = 0;
 
-regex_t *exclude_match = NULL;
-size_t exclude_match_nr = 0;
 
 static void show_version(void) __attribute__((__noreturn__));
 static void show_help(int rc) __attribute__((__noreturn__));
@@ -54,11 +114,37 @@ static bool suffix_requires_dir_check(char const *end) __attribute__((__nonnull_
 static bool dir_check(const char *dir, char *dirend) __attribute__((__nonnull__ (1, 2)));
 static void enqueue_canonicalized_path(const char *name, bool add_recursively);
 
-static int enqueue_regular_file(const char *filename) __attribute__((__nonnull__ (1)));
+static int enqueue_regular_file(const char *filename, const struct stat *st) __attribute__((__nonnull__ (1, 2)));
 static void enqueue_path(struct file *p) __attribute__((__nonnull__ (1)));
+static void process_item(struct file *p) __attribute__((__nonnull__ (1)));
+static void *discovery_worker(void *arg);
+static void run_threads(void *(*worker)(void *), long nr) __attribute__((__nonnull__ (1)));
 static void print_file(struct file *p) __attribute__((__nonnull__ (1)));
+static void mark_installed(struct file *p, const char *op, const char *ftype, const char *path) __attribute__((__nonnull__ (1, 2, 3, 4)));
+static bool can_hardlink(const char *filename) __attribute__((__nonnull__ (1)));
+static void install_one(struct file *p) __attribute__((__nonnull__ (1)));
+static void install_timed(struct file *p) __attribute__((__nonnull__ (1)));
+static void install_link(struct file *p) __attribute__((__nonnull__ (1)));
 static void install_file(struct file *p) __attribute__((__nonnull__ (1)));
+static void install_batch(struct uring *ring, struct file **files, size_t nr) __attribute__((__nonnull__ (1, 2)));
+static void *install_worker(void *arg);
+static void install_pending(void);
+static void install_linked(void);
 static void apply_permissions(struct file *p) __attribute__((__nonnull__ (1)));
+static int plan_rank(const struct file *p) __attribute__((__nonnull__ (1)));
+static size_t path_depth(const char *path) __attribute__((__nonnull__ (1)));
+static int compare_plan(const void *a, const void *b) __attribute__((__nonnull__ (1, 2)));
+static void add_to_plan(struct file *p) __attribute__((__nonnull__ (1)));
+static void build_plan(void);
+static void install_plan(void);
+static void reset_options(void);
+static void parse_options(int argc, char **argv) __attribute__((__nonnull__ (2)));
+static void update_excludes(void);
+static bool in_image_root(const char *dir) __attribute__((__nonnull__ (1)));
+static void reuse_tree(void);
+static void forget_tree(void);
+static int put_files(int argc, char **argv) __attribute__((__nonnull__ (2)));
+static int batch_request(int argc, char **argv) __attribute__((__nonnull__ (2)));
 
 void fill_stat(struct file *p, struct stat *sb)
 {
@@ -74,40 +160,27 @@ void enqueue_parent_directory(char *path)
 	if (!p || p == path)
 		return;
 
-	enqueue_item(path, p - path);
+	enqueue_parent(path, p - path);
 }
 
-void enqueue_directory(char *path)
+void enqueue_dependency(const char *path)
 {
-	FTS *t = NULL;
-	char *argv[2] = { path, NULL };
+	depcache_add(path);
 
-	if (verbose)
-		warnx("processing: %s", argv[0]);
-
-	if ((t = fts_open(argv, FTS_PHYSICAL, NULL)) == NULL)
-		err(EXIT_FAILURE, "fts_open");
-
-	FTSENT *p;
-	while ((p = fts_read(t))) {
-		switch (p->fts_info) {
-			case FTS_DNR:
-			case FTS_ERR:
-			case FTS_NS:
-				errno = p->fts_errno;
-				warn("fts_read: %s", p->fts_path);
-				continue;
-		}
+	if (!is_path_added(path))
+		enqueue_item(path, -1);
+}
 
-		if (is_path_added(p->fts_path))
-			continue;
+void enqueue_directory(char *path)
+{
+	struct stats_timer timer;
 
-		struct file *f = enqueue_item(p->fts_path, -1);
-		if (f)
-			fill_stat(f, p->fts_statp);
-	}
+	if (verbose)
+		warnx("processing: %s", path);
 
-	fts_close(t);
+	stats_start(&timer);
+	walk_directory(path);
+	stats_stop(&timer, STATS_WALK);
 }
 
 int mksock(const char *path)
@@ -257,10 +330,21 @@ void enqueue_canonicalized_path(const char *name, bool add_recursively)
 			*dest = '\0';
 
 			char *buf = link_buffer;
+			const char *rest = end;
 			ssize_t n;
 
+			while (IS_DIR_SEPARATOR(*rest))
+				rest++;
+
+			/*
+			 * The directories are shared by many paths, so whether
+			 * they are symlinks is only asked once.
+			 */
 			errno = 0;
-			n = readlink(rname, buf, sizeof(link_buffer) - 1);
+			if (*rest)
+				n = linkcache_readlink(rname, buf, sizeof(link_buffer) - 1);
+			else
+				n = readlink(rname, buf, sizeof(link_buffer) - 1);
 
 			if (0 <= n) {
 				if (++num_links > MAXSYMLINKS) {
@@ -326,18 +410,21 @@ error:
 	if (verbose > 0)
 		warnx("symlink '%s' points to '%s'", name, rname);
 
-	struct file *f;
-
-	f = enqueue_item(rname, dest - rname);
-	if (f)
-		f->recursive = add_recursively;
+	enqueue_file(rname, dest - rname, NULL, add_recursively);
 }
 
-int enqueue_regular_file(const char *filename)
+int enqueue_regular_file(const char *filename, const struct stat *st)
 {
-	static char buf[LINE_MAX];
+	char buf[LINE_MAX];
 	int fd, ret = -1;
 
+	if (depcache_lookup(st, enqueue_dependency)) {
+		stats_count(STATS_CACHE_HITS);
+		if (verbose > 1)
+			warnx("'%s' dependencies are cached", filename);
+		return 0;
+	}
+
 	errno = 0;
 	fd = open(filename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
 	if (fd < 0) {
@@ -353,6 +440,8 @@ int enqueue_regular_file(const char *filename)
 		goto end;
 	}
 
+	depcache_begin();
+
 	buf[LINE_MAX - 1] = 0;
 
 	if (!access(filename, X_OK) && is_shebang(buf)) {
@@ -369,6 +458,7 @@ int enqueue_regular_file(const char *filename)
 
 	ret = 0;
 end:
+	depcache_end(st, !ret);
 	close(fd);
 	return ret;
 }
@@ -381,8 +471,8 @@ void enqueue_path(struct file *p)
 	if (!p->stat.st_ino) {
 		struct stat sb;
 
-		if (lstat(p->src, &sb) < 0)
-			err(EXIT_FAILURE, "lstat: %s", p->src);
+		if (walk_stat(p->src, &sb) < 0)
+			err(EXIT_FAILURE, "statx: %s", p->src);
 
 		fill_stat(p, &sb);
 	}
@@ -390,7 +480,7 @@ void enqueue_path(struct file *p)
 	enqueue_parent_directory(p->src);
 
 	if (S_IFDIR == (p->stat.st_mode & S_IFMT)) {
-		if (p->recursive)
+		if (__atomic_load_n(&p->recursive, __ATOMIC_ACQUIRE))
 			enqueue_directory(p->src);
 		return;
 	}
@@ -406,17 +496,104 @@ void enqueue_path(struct file *p)
 			warn("readlink: %s", p->src);
 		}
 
+		struct stats_timer timer;
+
+		stats_start(&timer);
 		enqueue_canonicalized_path(p->src, false);
+		stats_stop(&timer, STATS_CANONICALIZE);
 		return;
 	}
 
 	if (S_IFREG == (p->stat.st_mode & S_IFMT)) {
-		if (enqueue_regular_file(p->src) < 0)
+		if (enqueue_regular_file(p->src, &p->stat) < 0)
 			err(EXIT_FAILURE, "failed to read regular file: %s", p->src);
 		return;
 	}
 }
 
+void process_item(struct file *p)
+{
+	struct stats_timer timer;
+
+	stats_start(&timer);
+
+	p->dst = p->src;
+
+	if (prefix) {
+		size_t dst_len = strlen(p->dst);
+		if (dst_len >= prefix_len && p->dst[prefix_len] == '/' &&
+		    !strncmp(p->dst, prefix, prefix_len - 1))
+			p->dst += prefix_len;
+		else if (!strcmp(p->dst, prefix))
+			p->dst = (char *) "";
+	}
+
+	/* An archive does not contain what is already in the destdir. */
+	if (!force && !cpiofile) {
+		int type = manifest_lookup(p->dst);
+
+		if (type >= 0 && type != DT_DIR) {
+			if (verbose > 1)
+				warnx("'%s' is already in the destdir", p->src);
+			stats_count(STATS_EXISTING);
+			free_file(p);
+			return;
+		}
+	}
+
+	if (tree_add_file(p)) {
+		enqueue_path(p);
+		p->elapsed += stats_elapsed(&timer);
+		return;
+	}
+
+	if (verbose > 1)
+		warnx("'%s' has already been processed so skip it", p->src);
+
+	if (p->recursive && tree_set_recursive(p->src)) {
+		struct stat st;
+
+		if (!lstat(p->src, &st) && S_ISDIR(st.st_mode))
+			enqueue_directory(p->src);
+	}
+
+	free_file(p);
+}
+
+void *discovery_worker(void *arg __attribute__((unused)))
+{
+	struct file *p;
+
+	while ((p = dequeue_item()) != NULL) {
+		process_item(p);
+		dequeue_done();
+	}
+
+	return NULL;
+}
+
+void run_threads(void *(*worker)(void *), long nr)
+{
+	pthread_t *threads;
+
+	if (nr <= 1) {
+		worker(NULL);
+		return;
+	}
+
+	threads = xcalloc((size_t) nr, sizeof(pthread_t));
+
+	for (long i = 0; i < nr; i++) {
+		if ((errno = pthread_create(&threads[i], NULL, worker, NULL)) != 0)
+			err(EX_OSERR, "pthread_create");
+	}
+
+	for (long i = 0; i < nr; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+}
+
 static FILE *logout;
 
 void print_file(struct file *p)
@@ -457,17 +634,65 @@ void print_file(struct file *p)
 	        (p->symlink ? p->symlink : ""));
 }
 
-static char install_path[PATH_MAX + 1];
 static int use_copy_file_range = 1;
 static int use_sendfile = 1;
+static int use_io_uring = 0;
 
-void install_file(struct file *p)
+/* The number of files copied with one io_uring submission. */
+#define URING_BATCH 32
+
+static struct file **pending = NULL;
+static size_t pending_nr = 0;
+static size_t pending_size = 0;
+static size_t pending_next = 0;
+
+static struct file **linked = NULL;
+static size_t linked_nr = 0;
+static size_t linked_size = 0;
+
+void mark_installed(struct file *p, const char *op, const char *ftype, const char *path)
 {
+	/* warnx() writes the line in parts, the workers must not mix them. */
+	if (verbose) {
+		flockfile(stderr);
+		warnx("%s (%s): %s", op, ftype, path);
+		funlockfile(stderr);
+	}
+	if (!strcmp(op, "skip"))
+		stats_count(STATS_EXISTING);
+	p->installed = true;
+	__atomic_add_fetch(&installed, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * A hard link shares the content with the original file, so an ELF file is
+ * copied if it has to be stripped.
+ */
+bool can_hardlink(const char *filename)
+{
+	char buf[LINE_MAX] = { 0 };
+	ssize_t n;
+	int fd;
+
+	if (strip == STRIP_NONE)
+		return true;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+		return true;
+
+	n = pread(fd, buf, 4, 0);
+	close(fd);
+
+	return n < 4 || !is_elf_file(buf);
+}
+
+void install_one(struct file *p)
+{
+	char install_path[PATH_MAX + 1];
 	const char *ftype;
 	const char *op = "install";
-
-	if (p->installed)
-		return;
+	const char *name;
+	int dirfd;
 
 	switch (p->stat.st_mode & S_IFMT) {
 		case S_IFBLK:
@@ -496,18 +721,25 @@ void install_file(struct file *p)
 			break;
 	}
 
-	strncpy(install_path + destdir_len, p->dst, sizeof(install_path) - destdir_len - 1);
+	snprintf(install_path, sizeof(install_path), "%s%s", destdir, p->dst);
+
+	if ((dirfd = dircache_resolve(p->dst, &name)) < 0) {
+		/* The parent directory will be created later. */
+		if (errno == ENOENT)
+			return;
+		err(EX_CANTCREAT, "open: %s", install_path);
+	}
 
 	errno = 0;
 	if (force && (S_IFDIR != (p->stat.st_mode & S_IFMT)) &&
-	    remove(install_path) < 0 && errno != ENOENT)
+	    unlinkat(dirfd, name, 0) < 0 && errno != ENOENT)
 		err(EXIT_FAILURE, "remove: %s", install_path);
 
 	if (S_IFDIR == (p->stat.st_mode & S_IFMT)) {
 		if (verbose > 2)
 			warnx("create a directory: %s", install_path);
 		errno = 0;
-		if (mkdir(install_path, 0755) < 0) {
+		if (mkdirat(dirfd, name, 0755) < 0) {
 			if (errno == EEXIST) {
 				op = "skip";
 				goto end;
@@ -524,7 +756,7 @@ void install_file(struct file *p)
 		if (verbose > 2)
 			warnx("make a special file: %s", install_path);
 		errno = 0;
-		if (mknod(install_path, p->stat.st_mode, p->stat.st_dev) < 0) {
+		if (mknodat(dirfd, name, p->stat.st_mode, p->stat.st_dev) < 0) {
 			if (errno == EEXIST) {
 				op = "skip";
 				goto end;
@@ -540,7 +772,7 @@ void install_file(struct file *p)
 		if (verbose > 2)
 			warnx("create a symlink file: %s", install_path);
 		errno = 0;
-		if (symlink(p->symlink, install_path) < 0) {
+		if (symlinkat(p->symlink, dirfd, name) < 0) {
 			if (errno == EEXIST) {
 				op = "skip";
 				goto end;
@@ -556,7 +788,7 @@ void install_file(struct file *p)
 		if (verbose > 2)
 			warnx("create a fifo file: %s", install_path);
 		errno = 0;
-		if (mkfifo(install_path, p->stat.st_mode) < 0) {
+		if (mkfifoat(dirfd, name, p->stat.st_mode) < 0) {
 			if (errno == EEXIST) {
 				op = "skip";
 				goto end;
@@ -587,11 +819,22 @@ void install_file(struct file *p)
 	if (S_IFREG != (p->stat.st_mode & S_IFMT))
 		errx(EXIT_FAILURE, "not implemented (mode=%o): %s", p->stat.st_mode, p->dst);
 
-	if (!access(install_path, X_OK)) {
+	if (!faccessat(dirfd, name, X_OK, 0)) {
 		op = "skip";
 		goto end;
 	}
 
+	if (link_mode == LINK_HARDLINK && can_hardlink(p->src)) {
+		if (verbose > 2)
+			warnx("create a hard link: %s", install_path);
+		if (!linkat(AT_FDCWD, p->src, dirfd, name, 0)) {
+			op = "link";
+			goto end;
+		}
+		if (verbose > 2)
+			warn("link: %s -> %s", p->src, install_path);
+	}
+
 	if (verbose > 2)
 		warnx("create a regular file: %s", install_path);
 
@@ -601,7 +844,7 @@ void install_file(struct file *p)
 	if ((sfd = open(p->src, O_RDONLY)) < 0)
 		err(EX_NOINPUT, "open: %s", p->src);
 
-	if ((dfd = creat(install_path, p->stat.st_mode)) < 0) {
+	if ((dfd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, p->stat.st_mode)) < 0) {
 		if (errno == ENOENT) {
 			close(sfd);
 			return;
@@ -609,20 +852,40 @@ void install_file(struct file *p)
 		err(EX_CANTCREAT, "creat: %s", install_path);
 	}
 
+	if (strip_file(p->src, sfd, dfd, strip)) {
+		op = "strip";
+		goto finish;
+	}
+
+	/*
+	 * A clone shares the data blocks with the source and costs nothing
+	 * regardless of the file size. It is only possible within the same
+	 * filesystem.
+	 */
+	if (link_mode == LINK_REFLINK ||
+	    (link_mode == LINK_AUTO && p->stat.st_dev == destdir_dev)) {
+		if (!ioctl(dfd, FICLONE, sfd)) {
+			op = "clone";
+			goto finish;
+		}
+		if (verbose > 2)
+			warn("clone: %s -> %s", p->src, install_path);
+	}
+
 	posix_fadvise(sfd, 0, p->stat.st_size, POSIX_FADV_SEQUENTIAL);
 	posix_fallocate(dfd, 0, p->stat.st_size);
 
 	off_t ret;
 	off_t len = p->stat.st_size;
 
-	if (!use_copy_file_range)
+	if (!__atomic_load_n(&use_copy_file_range, __ATOMIC_RELAXED))
 		goto fallback_sendfile;
 	do {
 		errno = 0;
 		ret = copy_file_range(sfd, NULL, dfd, NULL, (size_t) len, 0);
 		if (ret < 0) {
 			if (errno == EXDEV || errno == ENOSYS) {
-				use_copy_file_range = 0;
+				__atomic_store_n(&use_copy_file_range, 0, __ATOMIC_RELAXED);
 				if (verbose > 2)
 					warnx("copy_file_range not supported");
 				goto fallback_sendfile;
@@ -635,14 +898,11 @@ finish:
 	close(sfd);
 	close(dfd);
 end:
-	if (verbose)
-		warnx("%s (%s): %s", op, ftype, install_path);
-	p->installed = true;
-	installed++;
+	mark_installed(p, op, ftype, install_path);
 	return;
 
 fallback_sendfile:
-	if (!use_sendfile)
+	if (!__atomic_load_n(&use_sendfile, __ATOMIC_RELAXED))
 		goto fallback_readwrite;
 
 	lseek(sfd, 0, SEEK_SET);
@@ -654,7 +914,7 @@ fallback_sendfile:
 		ret = sendfile(dfd, sfd, NULL, (size_t) len);
 		if (ret < 0) {
 			if (errno == EINVAL || errno == ENOSYS) {
-				use_sendfile = 0;
+				__atomic_store_n(&use_sendfile, 0, __ATOMIC_RELAXED);
 				if (verbose > 2)
 					warnx("sendfile not supported");
 				goto fallback_readwrite;
@@ -687,12 +947,351 @@ fallback_readwrite:
 	goto finish;
 }
 
+/*
+ * A duplicate is linked to the file with the same content which is already
+ * installed. If that is not possible, the file is copied as usual.
+ */
+void install_link(struct file *p)
+{
+	char install_path[PATH_MAX + 1];
+	char target[PATH_MAX + 1];
+	const char *name;
+	int dirfd;
+
+	if (!p->same->installed) {
+		install_one(p);
+		return;
+	}
+
+	snprintf(install_path, sizeof(install_path), "%s%s", destdir, p->dst);
+	snprintf(target, sizeof(target), "%s%s", destdir, p->same->dst);
+
+	if ((dirfd = dircache_resolve(p->dst, &name)) < 0) {
+		/* The parent directory will be created later. */
+		if (errno == ENOENT)
+			return;
+		err(EX_CANTCREAT, "open: %s", install_path);
+	}
+
+	errno = 0;
+	if (force && unlinkat(dirfd, name, 0) < 0 && errno != ENOENT)
+		err(EXIT_FAILURE, "remove: %s", install_path);
+
+	if (!faccessat(dirfd, name, X_OK, 0)) {
+		mark_installed(p, "skip", "regular file", install_path);
+		return;
+	}
+
+	if (verbose > 2)
+		warnx("create a hard link: %s", install_path);
+
+	errno = 0;
+	if (!linkat(AT_FDCWD, target, dirfd, name, 0)) {
+		mark_installed(p, "link", "regular file", install_path);
+		return;
+	}
+
+	if (errno == ENOENT)
+		return;
+
+	if (verbose > 2)
+		warn("link: %s -> %s", target, install_path);
+
+	install_one(p);
+}
+
+/*
+ * Regular files are the only ones whose content has to be copied. Nothing else
+ * depends on them, so they are postponed until the end of the pass and copied
+ * in parallel and/or in batches.
+ */
+void install_file(struct file *p)
+{
+	if (p->installed)
+		return;
+
+	if (p->same) {
+		if (linked_nr == linked_size) {
+			linked_size += 1024;
+			linked = xrealloc(linked, linked_size, sizeof(struct file *));
+		}
+		linked[linked_nr++] = p;
+		return;
+	}
+
+	if ((jobs > 1 || __atomic_load_n(&use_io_uring, __ATOMIC_RELAXED)) && S_IFREG == (p->stat.st_mode & S_IFMT)) {
+		if (pending_nr == pending_size) {
+			pending_size += 1024;
+			pending = xrealloc(pending, pending_size, sizeof(struct file *));
+		}
+		pending[pending_nr++] = p;
+		return;
+	}
+
+	install_timed(p);
+}
+
+void install_timed(struct file *p)
+{
+	struct stats_timer timer;
+
+	stats_start(&timer);
+	install_one(p);
+	p->elapsed += stats_elapsed(&timer);
+}
+
+/*
+ * Copies regular files with io_uring. Anything unusual is left to
+ * install_one() which knows how to report errors and tries the other ways
+ * to copy a file.
+ */
+void install_batch(struct uring *ring, struct file **files, size_t nr)
+{
+	struct uring_copy reqs[URING_BATCH];
+	char paths[URING_BATCH][PATH_MAX + 1];
+	struct file *batch[URING_BATCH];
+	const char *name;
+	size_t n = 0;
+	int dirfd;
+
+	for (size_t i = 0; i < nr; i++) {
+		struct file *p = files[i];
+
+		snprintf(paths[n], sizeof(paths[n]), "%s%s", destdir, p->dst);
+
+		if ((dirfd = dircache_resolve(p->dst, &name)) < 0) {
+			/* The parent directory will be created later. */
+			if (errno == ENOENT)
+				continue;
+			err(EX_CANTCREAT, "open: %s", paths[n]);
+		}
+
+		/* The descriptor is used after the rest of the batch is resolved. */
+		dircache_pin(dirfd);
+
+		errno = 0;
+		if (force && unlinkat(dirfd, name, 0) < 0 && errno != ENOENT)
+			err(EXIT_FAILURE, "remove: %s", paths[n]);
+
+		if (!faccessat(dirfd, name, X_OK, 0)) {
+			mark_installed(p, "skip", "regular file", paths[n]);
+			continue;
+		}
+
+		if (verbose > 2)
+			warnx("create a regular file: %s", paths[n]);
+
+		reqs[n].src       = p->src;
+		reqs[n].dst_dirfd = dirfd;
+		reqs[n].dst       = name;
+		reqs[n].mode      = p->stat.st_mode;
+		reqs[n].size      = p->stat.st_size;
+		batch[n++]        = p;
+	}
+
+	if (n)
+		uring_copy_files(ring, reqs, n);
+
+	for (size_t i = 0; i < n; i++) {
+		switch (reqs[i].stage) {
+			case URING_COPY_DONE:
+				mark_installed(batch[i], "install", "regular file", paths[i]);
+				break;
+			case URING_COPY_OPEN_DST:
+				/* The directory will be created in the next pass. */
+				if (reqs[i].error == ENOENT)
+					break;
+				install_one(batch[i]);
+				break;
+			case URING_COPY_DATA:
+				if (verbose > 2) {
+					errno = reqs[i].error;
+					warn("io_uring: %s -> %s", batch[i]->src, paths[i]);
+				}
+				/* The incomplete copy must not be taken as an existing file. */
+				unlinkat(reqs[i].dst_dirfd, reqs[i].dst, 0);
+				install_one(batch[i]);
+				break;
+			default:
+				install_one(batch[i]);
+				break;
+		}
+	}
+
+	dircache_unpin();
+}
+
+void *install_worker(void *arg __attribute__((unused)))
+{
+	struct uring *ring = NULL;
+	size_t i;
+
+	if (__atomic_load_n(&use_io_uring, __ATOMIC_RELAXED) && !(ring = uring_open())) {
+		__atomic_store_n(&use_io_uring, 0, __ATOMIC_RELAXED);
+		if (verbose > 2)
+			warnx("io_uring not supported");
+	}
+
+	if (ring) {
+		while ((i = __atomic_fetch_add(&pending_next, URING_BATCH, __ATOMIC_RELAXED)) < pending_nr)
+			install_batch(ring, pending + i, MIN(URING_BATCH, pending_nr - i));
+		uring_close(ring);
+		dircache_flush();
+		return NULL;
+	}
+
+	while ((i = __atomic_fetch_add(&pending_next, 1, __ATOMIC_RELAXED)) < pending_nr)
+		install_timed(pending[i]);
+
+	dircache_flush();
+	return NULL;
+}
+
+void install_pending(void)
+{
+	if (!pending_nr)
+		return;
+
+	pending_next = 0;
+	run_threads(install_worker, MIN(jobs, (long) pending_nr));
+	pending_nr = 0;
+}
+
+/*
+ * Duplicates are linked after all the other files are copied, so the file
+ * they are linked to is complete.
+ */
+void install_linked(void)
+{
+	for (size_t i = 0; i < linked_nr; i++)
+		install_link(linked[i]);
+	linked_nr = 0;
+}
+
+/*
+ * Everything is installed in one pass in the order of the plan: directories
+ * from the top down, then symlinks and then the rest. A parent directory is
+ * always created before its content.
+ */
+static struct file **plan = NULL;
+static size_t plan_nr = 0;
+static size_t plan_size = 0;
+
+int plan_rank(const struct file *p)
+{
+	switch (p->stat.st_mode & S_IFMT) {
+		case S_IFDIR:
+			return 0;
+		case S_IFLNK:
+			return 1;
+	}
+	return 2;
+}
+
+size_t path_depth(const char *path)
+{
+	size_t depth = 0;
+
+	while ((path = strchr(path, '/')) != NULL) {
+		depth++;
+		path++;
+	}
+	return depth;
+}
+
+int compare_plan(const void *a, const void *b)
+{
+	const struct file *x = *(struct file * const *) a;
+	const struct file *y = *(struct file * const *) b;
+	int rx = plan_rank(x);
+	int ry = plan_rank(y);
+
+	if (rx != ry)
+		return rx - ry;
+
+	if (rx == 0) {
+		size_t dx = path_depth(x->dst);
+		size_t dy = path_depth(y->dst);
+
+		if (dx != dy)
+			return (dx < dy) ? -1 : 1;
+	}
+
+	return strcmp(x->dst, y->dst);
+}
+
+void add_to_plan(struct file *p)
+{
+	if (plan_nr == plan_size) {
+		plan_size += 1024;
+		plan = xrealloc(plan, plan_size, sizeof(struct file *));
+	}
+	plan[plan_nr++] = p;
+}
+
+void build_plan(void)
+{
+	plan_nr = 0;
+	tree_walk(add_to_plan);
+
+	qsort(plan, plan_nr, sizeof(struct file *), compare_plan);
+
+	if (dump_plan) {
+		logout = stderr;
+		for (size_t i = 0; i < plan_nr; i++)
+			print_file(plan[i]);
+	}
+}
+
+/*
+ * A path may go through a symlink that is installed later than the path
+ * itself. Such files fail with ENOENT and stay in the plan, so only they
+ * are tried again once the rest is done.
+ */
+void install_plan(void)
+{
+	build_plan();
+
+	while (plan_nr > 0) {
+		size_t prev_installed = installed;
+		size_t n = 0;
+
+		for (size_t i = 0; i < plan_nr; i++)
+			install_file(plan[i]);
+		install_pending();
+		install_linked();
+
+		for (size_t i = 0; i < plan_nr; i++) {
+			if (!plan[i]->installed)
+				plan[n++] = plan[i];
+		}
+		plan_nr = n;
+
+		if (prev_installed == installed)
+			break;
+
+		if (verbose > 2 && plan_nr > 0)
+			warnx("%zu paths are deferred until their parents exist", plan_nr);
+	}
+
+	free(plan);
+	plan = NULL;
+	plan_nr = plan_size = 0;
+}
+
 void apply_permissions(struct file *p)
 {
-	strncpy(install_path + destdir_len, p->dst, sizeof(install_path) - destdir_len - 1);
+	char install_path[PATH_MAX + 1];
+	const char *name;
+	int dirfd;
+
+	snprintf(install_path, sizeof(install_path), "%s%s", destdir, p->dst);
+
+	if ((dirfd = dircache_resolve(p->dst, &name)) < 0)
+		err(EXIT_FAILURE, "open: %s", install_path);
 
 	errno = 0;
-	if (lchown(install_path, p->stat.st_uid, p->stat.st_gid) < 0) {
+	if (fchownat(dirfd, name, p->stat.st_uid, p->stat.st_gid, AT_SYMLINK_NOFOLLOW) < 0) {
 		if (errno != EPERM || verbose > 2)
 			warn("unable to change owner and group to uid=%d and gid=%d of `%s'", p->stat.st_uid, p->stat.st_gid, install_path);
 		if (errno != EPERM)
@@ -701,7 +1300,7 @@ void apply_permissions(struct file *p)
 
 	if (S_IFLNK != (p->stat.st_mode & S_IFMT)) {
 		errno = 0;
-		if (chmod(install_path, p->stat.st_mode) < 0)
+		if (fchmodat(dirfd, name, p->stat.st_mode, 0) < 0)
 			err(EXIT_FAILURE, "change file mode of `%s' to %jo", install_path, (uintmax_t) p->stat.st_mode);
 	}
 }
@@ -711,6 +1310,7 @@ void show_help(int rc)
 	fprintf(stdout,
 	        "Usage: %1$s [<options>] <destdir> directory [directory ...]\n"
 	        "   or: %1$s [<options>] <destdir> file [file ...]\n"
+	        "   or: %1$s [<options>] --batch[=SOCKET]\n"
 	        "\n"
 	        "Utility allows to copy files and directories along with their dependencies\n"
 	        "into a specified destination directory.\n"
@@ -720,10 +1320,31 @@ void show_help(int rc)
 	        "\n"
 	        "Options:\n"
 	        "   -n, --dry-run              don't do nothing.\n"
+	        "   -b, --batch[=SOCKET]       read requests from stdin or from SOCKET\n"
+	        "                              and keep the state between them.\n"
 	        "   -e, --exclude=REGEXP       exclude files matching REGEXP.\n"
+	        "   -c, --cache=FILE           keep dependencies of files in FILE.\n"
+	        "       --copy-backend=MODE    how to copy regular files: uring, classic\n"
+	        "                              or auto (default: auto).\n"
+	        "   -C, --cpio=FILE            write a newc cpio archive to FILE instead\n"
+	        "                              of copying files into destdir. FILE is\n"
+	        "                              overwritten by each call.\n"
+	        "   -D, --dedup                install files with the same content as\n"
+	        "                              hard links to each other.\n"
 	        "   -f, --force                overwrite destination file if exists.\n"
+	        "   -j, --jobs=N               use N threads to find and copy files\n"
+	        "                              (0 means the number of processors).\n"
+	        "   -L, --ldd                  use ldd(1) to find shared libraries.\n"
 	        "   -l, --log=FILE             white log about what was copied.\n"
+	        "   -m, --link-mode=MODE       how to install regular files: copy, reflink,\n"
+	        "                              hardlink or auto (default: copy).\n"
+	        "   -P, --dump-plan            print the order of installation to stderr.\n"
 	        "   -r, --remove-prefix=PATH   ignore prefix in path.\n"
+	        "   -s, --server=SOCKET        pass the request to the batch server.\n"
+	        "   -S, --stats[=json]         print the time spent in each phase and\n"
+	        "                              other statistics to stderr.\n"
+	        "       --strip=MODE           remove sections from ELF files: none,\n"
+	        "                              debug or unneeded (default: none).\n"
 	        "   -v, --verbose              print a message for each action/\n"
 	        "   -V, --version              output version information and exit.\n"
 	        "   -h, --help                 display this help and exit.\n"
@@ -749,54 +1370,169 @@ void show_version(void)
 	exit(EXIT_SUCCESS);
 }
 
-int main(int argc, char **argv)
+/*
+ * The options are parsed again for every request in batch mode, so they
+ * have to be set to the defaults first.
+ */
+void reset_options(void)
 {
-	const char *optstring = "efnl:r:vVh";
+	free(destdir);
+
+	destdir     = NULL;
+	prefix      = NULL;
+	prefix_len  = 0;
+	logfile     = NULL;
+	cachefile   = NULL;
+	cpiofile    = NULL;
+	verbose     = 0;
+	dry_run     = 0;
+	dump_plan   = 0;
+	force       = 0;
+	dedup       = 0;
+	stats       = STATS_NONE;
+	strip       = STRIP_NONE;
+	use_ldd     = 0;
+	jobs        = 1;
+	link_mode   = LINK_COPY;
+	copy_backend = COPY_BACKEND_AUTO;
+	destdir_dev = 0;
+	excludes_nr = 0;
+	installed   = 0;
+
+	/*
+	 * The ways to copy a file are turned off by the filesystems of the
+	 * previous request, so they are tried again.
+	 */
+	use_copy_file_range = 1;
+	use_sendfile        = 1;
+}
+
+void parse_options(int argc, char **argv)
+{
+	const char *optstring = "b::C:c:De:fj:Lnl:m:Pr:S::s:vVh";
 	const struct option longopts[] = {
+		{"batch", optional_argument, 0, 'b' },
+		{"cache", required_argument, 0, 'c' },
+		{"cpio", required_argument, 0, 'C' },
+		{"dedup", no_argument, 0, 'D' },
 		{"exclude", required_argument, 0, 'e' },
 		{"remove-prefix", required_argument, 0, 'r' },
 		{"force", no_argument, 0, 'f' },
+		{"jobs", required_argument, 0, 'j' },
+		{"ldd", no_argument, 0, 'L' },
 		{"dry-run", no_argument, 0, 'n' },
 		{"log", required_argument, 0, 'l' },
+		{"link-mode", required_argument, 0, 'm' },
+		{"dump-plan", no_argument, 0, 'P' },
+		{"server", required_argument, 0, 's' },
+		{"stats", optional_argument, 0, 'S' },
+		{"strip", required_argument, 0, OPT_STRIP },
+		{"copy-backend", required_argument, 0, OPT_COPY_BACKEND },
 		{"verbose", no_argument, 0, 'v' },
 		{"version", no_argument, 0, 'V' },
 		{"help", no_argument, 0, 'h' },
 		{ 0, 0, 0, 0 }
 	};
+	char *endptr;
 	int c;
 
-	progname = strrchr(argv[0], '/');
-	if (progname)
-		progname++;
-	else
-		progname = argv[0];
+	/* The full reset of getopt because argv is different every time. */
+	optind = 0;
 
 	while ((c = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
 		switch (c) {
+			case 'b':
+				batch_mode = 1;
+				batch_socket = optarg;
+				break;
+			case 'c':
+				cachefile = optarg;
+				break;
+			case 'C':
+				cpiofile = optarg;
+				break;
+			case 'D':
+				dedup = 1;
+				break;
 			case 'e':
 				if (strlen(optarg) > 0) {
-					exclude_match = xrealloc(exclude_match, (exclude_match_nr + 1), sizeof(regex_t));
-
-					if (regcomp(&exclude_match[exclude_match_nr], optarg, REG_NOSUB | REG_NEWLINE | REG_EXTENDED))
-						errx(EX_USAGE, "bad regexp");
-
-					exclude_match_nr++;
+					if (excludes_nr == excludes_size) {
+						excludes_size += 16;
+						excludes = xrealloc(excludes, excludes_size, sizeof(char *));
+					}
+					excludes[excludes_nr++] = optarg;
 				}
-
 				break;
 			case 'f':
 				force = 1;
 				break;
+			case 'j':
+				errno = 0;
+				jobs = strtol(optarg, &endptr, 10);
+				if (errno || *endptr || jobs < 0)
+					errx(EX_USAGE, "bad number of jobs: %s", optarg);
+				if (!jobs)
+					jobs = get_nprocs();
+				break;
+			case 'L':
+				use_ldd = 1;
+				break;
+			case 'm':
+				if (!strcmp(optarg, "copy"))
+					link_mode = LINK_COPY;
+				else if (!strcmp(optarg, "reflink"))
+					link_mode = LINK_REFLINK;
+				else if (!strcmp(optarg, "hardlink"))
+					link_mode = LINK_HARDLINK;
+				else if (!strcmp(optarg, "auto"))
+					link_mode = LINK_AUTO;
+				else
+					errx(EX_USAGE, "bad link mode: %s", optarg);
+				break;
 			case 'l':
 				logfile = optarg;
 				break;
 			case 'n':
 				dry_run = 1;
 				break;
+			case 'P':
+				dump_plan = 1;
+				break;
 			case 'r':
 				prefix = optarg;
 				prefix_len = strlen(optarg);
 				break;
+			case 's':
+				server_socket = optarg;
+				break;
+			case 'S':
+				if (!optarg || !strcmp(optarg, "text"))
+					stats = STATS_TEXT;
+				else if (!strcmp(optarg, "json"))
+					stats = STATS_JSON;
+				else
+					errx(EX_USAGE, "bad statistics format: %s", optarg);
+				break;
+			case OPT_STRIP:
+				if (!strcmp(optarg, "none"))
+					strip = STRIP_NONE;
+				else if (!strcmp(optarg, "debug"))
+					strip = STRIP_DEBUG;
+				else if (!strcmp(optarg, "unneeded"))
+					strip = STRIP_UNNEEDED;
+				else
+					errx(EX_USAGE, "bad strip mode: %s", optarg);
+				break;
+			case OPT_COPY_BACKEND:
+				if (!strcmp(optarg, "auto"))
+					copy_backend = COPY_BACKEND_AUTO;
+				else if (!strcmp(optarg, "uring"))
+					copy_backend = COPY_BACKEND_URING;
+				else if (!strcmp(optarg, "classic"))
+					copy_backend = COPY_BACKEND_CLASSIC;
+				else
+					errx(EX_USAGE, "bad copy backend: %s", optarg);
+				break;
 			case 'v':
 				verbose++;
 				break;
@@ -809,84 +1545,188 @@ int main(int argc, char **argv)
 			default:
 				fprintf(stderr, "Try '%s --help' for more information.\n",
 				        progname);
-				return EX_USAGE;
+				exit(EX_USAGE);
 		}
 	}
+}
 
-	if (optind == argc)
-		errx(EX_USAGE, "more arguments required");
+/*
+ * The exclude patterns are compiled again only if they differ from the ones
+ * of the previous request.
+ */
+void update_excludes(void)
+{
+	bool same = (excludes_nr == compiled_nr);
+
+	for (size_t i = 0; same && i < excludes_nr; i++)
+		same = !strcmp(excludes[i], compiled[i]);
+
+	if (same && compiled)
+		return;
+
+	exclude_free();
+
+	for (size_t i = 0; i < compiled_nr; i++)
+		free(compiled[i]);
+
+	compiled = xrealloc(compiled, excludes_nr + 1, sizeof(char *));
+	compiled_nr = excludes_nr;
+
+	for (size_t i = 0; i < excludes_nr; i++) {
+		compiled[i] = xstrdup(excludes[i]);
+		exclude_add(excludes[i]);
+	}
 
-	if ((destdir = realpath(argv[optind], NULL)) == NULL)
-		errx(EX_USAGE, "bad destination directory: %s", argv[optind]);
+	exclude_compile();
+}
 
-	destdir_len = strlen(destdir);
-	optind++;
+/*
+ * The root of the image that make-initrd is creating. Its files are changed
+ * in place, so they must not be hard links to the files of the system.
+ */
+bool in_image_root(const char *dir)
+{
+	const char *env = getenv("ROOTDIR");
+	char *root;
+	size_t len;
+	bool ret;
 
-	if (optind == argc)
+	if (!env || !*env || !(root = realpath(env, NULL)))
+		return false;
+
+	len = strlen(root);
+	ret = !strncmp(dir, root, len) && (dir[len] == '\0' || dir[len] == '/');
+
+	free(root);
+	return ret;
+}
+
+/*
+ * The files of the previous request are kept as long as the destination and
+ * the prefix stay the same. Those that are still in the destination directory
+ * are neither looked at nor copied again.
+ */
+void reuse_tree(void)
+{
+	if (tree_destdir && !strcmp(tree_destdir, destdir) &&
+	    !strcmp(tree_prefix, prefix ? prefix : "")) {
+		tree_new_generation();
+		return;
+	}
+
+	tree_destroy();
+	forget_tree();
+}
+
+void forget_tree(void)
+{
+	free(tree_destdir);
+	free(tree_prefix);
+
+	tree_destdir = tree_prefix = NULL;
+}
+
+int put_files(int argc, char **argv)
+{
+	struct stats_timer timer;
+	int i = 0;
+
+	if (i == argc)
 		errx(EX_USAGE, "more arguments required");
 
-	init_elf_library();
+	/*
+	 * In cpio mode the destdir is only used in the log, so it does not
+	 * have to exist.
+	 */
+	if ((destdir = realpath(argv[i], NULL)) == NULL) {
+		if (!cpiofile)
+			errx(EX_USAGE, "bad destination directory: %s", argv[i]);
+		destdir = xstrdup(argv[i]);
+	}
 
-	for (int i = optind; i < argc; i++) {
-		enqueue_canonicalized_path(argv[i], true);
+	stats_begin(stats);
+
+	/*
+	 * A single thread copies the files one by one as they come unless
+	 * io_uring is asked for.
+	 */
+	use_io_uring = (copy_backend == COPY_BACKEND_URING ||
+	                (copy_backend == COPY_BACKEND_AUTO && jobs > 1));
+
+	if (link_mode == LINK_HARDLINK && !cpiofile && in_image_root(destdir))
+		errx(EX_USAGE, "hard links can't be used in the image root: %s", destdir);
+
+	if (link_mode != LINK_COPY && !cpiofile) {
+		struct stat st;
+
+		if (stat(destdir, &st) < 0)
+			err(EX_OSERR, "stat: %s", destdir);
+
+		destdir_dev = st.st_dev;
+
+		/* There is no way to clone or link files with io_uring. */
+		use_io_uring = 0;
 	}
 
-	strncpy(install_path, destdir, sizeof(install_path) - 1);
-	install_path[destdir_len] = 0;
+	if (strip != STRIP_NONE)
+		use_io_uring = 0;
 
-	for (struct file *queue = get_queue(NULL); queue; queue = get_queue(NULL)) {
-		while (queue != NULL) {
-			struct file *next = queue->next;
+	i++;
 
-			queue->dst = queue->src;
+	if (i == argc)
+		errx(EX_USAGE, "more arguments required");
 
-			if (prefix) {
-				size_t dst_len = strlen(queue->dst);
-				if (dst_len >= prefix_len && queue->dst[prefix_len] == '/' &&
-				    !strncmp(queue->dst, prefix, prefix_len - 1))
-					queue->dst += prefix_len;
-				else if (!strcmp(queue->dst, prefix))
-					queue->dst = (char *) "";
-			}
+	if (batch_mode)
+		reuse_tree();
 
-			if (!force) {
-				struct stat st;
+	/* The destdir may have been changed since the previous request. */
+	if (!cpiofile)
+		manifest_init(destdir);
+	linkcache_free();
 
-				strncpy(install_path + destdir_len, queue->dst, sizeof(install_path) - destdir_len - 1);
+	update_excludes();
 
-				errno = 0;
-				if (lstat(install_path, &st) < 0) {
-					if (errno != ENOENT)
-						err(EX_OSERR, "unable to get access to %s", install_path);
-				} else if (!S_ISDIR(st.st_mode)) {
-					if (verbose > 1)
-						warnx("'%s' is already in the destdir", queue->src);
-					dequeue_item(queue);
-					free_file(queue);
-					queue = next;
-					continue;
-				}
-			}
+	if (cachefile)
+		depcache_open(cachefile);
 
-			if (tree_add_file(queue)) {
-				enqueue_path(queue);
-				dequeue_item(queue);
-			} else {
-				if (verbose > 1)
-					warnx("'%s' has already been processed so skip it", queue->src);
-				dequeue_item(queue);
-				free_file(queue);
-			}
+	stats_start(&timer);
 
-			queue = next;
-		}
+	for (; i < argc; i++) {
+		enqueue_canonicalized_path(argv[i], true);
+	}
+
+	stats_stop(&timer, STATS_CANONICALIZE);
+
+	run_threads(discovery_worker, jobs);
+	depcache_close();
+
+	if (dedup && !dry_run) {
+		if (verbose > 1)
+			warnx("looking for duplicates ...");
+
+		stats_start(&timer);
+		dedup_files();
+		stats_stop(&timer, STATS_DEDUP);
 	}
 
 	if (dry_run) {
 		if (verbose > 1)
 			warnx("dry run only ...");
+		if (dump_plan) {
+			build_plan();
+			free(plan);
+			plan = NULL;
+			plan_nr = plan_size = 0;
+		}
 		logout = stdout;
 		tree_walk(print_file);
+	} else if (cpiofile) {
+		if (verbose > 1)
+			warnx("writing archive ...");
+
+		stats_start(&timer);
+		cpio_write_tree(cpiofile);
+		stats_stop(&timer, STATS_COPY);
 	} else {
 		size_t queue_nr = 0;
 
@@ -894,15 +1734,14 @@ int main(int argc, char **argv)
 			warnx("copying files ...");
 
 		umask(0);
+		dircache_init(destdir);
 
-		while (1) {
-			size_t prev_installed = installed;
+		stats_start(&timer);
+		install_plan();
+		stats_stop(&timer, STATS_COPY);
 
-			tree_walk(install_file);
-
-			if (prev_installed == installed)
-				break;
-		}
+		if (strip != STRIP_NONE)
+			strip_report();
 
 		get_queue(&queue_nr);
 
@@ -912,7 +1751,16 @@ int main(int argc, char **argv)
 			errx(EXIT_FAILURE, "unable to create the files listed above");
 		}
 
+		stats_start(&timer);
 		tree_walk(apply_permissions);
+		dircache_flush();
+		stats_stop(&timer, STATS_PERMISSIONS);
+
+		free(pending);
+		free(linked);
+
+		pending = linked = NULL;
+		pending_size = linked_size = 0;
 	}
 
 	if (logfile) {
@@ -924,11 +1772,99 @@ int main(int argc, char **argv)
 		fclose(logout);
 	}
 
+	stats_report();
+
+	/* Only the installed files can be skipped by the next request. */
+	if (batch_mode && !dry_run && !cpiofile && !tree_destdir) {
+		tree_destdir = xstrdup(destdir);
+		tree_prefix = xstrdup(prefix ? prefix : "");
+	} else if (batch_mode && (dry_run || cpiofile)) {
+		forget_tree();
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int batch_request(int argc, char **argv)
+{
+	reset_options();
+	parse_options(batch_argc, batch_argv);
+	parse_options(argc, argv);
+
+	/* The request can't turn the server into something else. */
+	batch_mode = 1;
+	server_socket = NULL;
+
+	/* The client may have another environment (see batch.c). */
+	if (batch_context != depcache_context()) {
+		ldso_forget_libraries();
+		batch_context = depcache_context();
+	}
+
+	return put_files(argc - optind, argv + optind);
+}
+
+int main(int argc, char **argv)
+{
+	int rc;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	parse_options(argc, argv);
+
+	if (server_socket) {
+		char *dir = NULL;
+
+		/* A request without arguments stops the server. */
+		if (optind == argc)
+			return batch_client(server_socket, depcache_env, 0, argv);
+
+		/* The obvious errors are caught before the server is bothered. */
+		if (argc - optind < 2)
+			errx(EX_USAGE, "more arguments required");
+
+		if (!cpiofile && (dir = realpath(argv[optind], NULL)) == NULL)
+			errx(EX_USAGE, "bad destination directory: %s", argv[optind]);
+		free(dir);
+
+		return batch_client(server_socket, depcache_env, argc - 1, argv + 1);
+	}
+
+	init_elf_library();
+
+	if (batch_mode) {
+		if (optind != argc)
+			errx(EX_USAGE, "files are given in requests in batch mode");
+
+		/* The options of the server are the defaults for each request. */
+		batch_argc = argc;
+		batch_argv = argv;
+
+		batch_server(batch_socket, progname, depcache_env, batch_request);
+		rc = EXIT_SUCCESS;
+	} else {
+		rc = put_files(argc - optind, argv + optind);
+	}
+
 	tree_destroy();
+	manifest_free();
+	linkcache_free();
+	ldso_cache_destroy();
 	free(destdir);
 
-	for (size_t i = 0; i < exclude_match_nr; i++)
-		regfree(&exclude_match[i]);
+	if (verbose)
+		exclude_report();
+	exclude_free();
 
-	return EXIT_SUCCESS;
+	for (size_t i = 0; i < compiled_nr; i++)
+		free(compiled[i]);
+	free(compiled);
+	free(excludes);
+	forget_tree();
+
+	return rc;
 }
@@ -0,0 +1,833 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <search.h>
+#include <sysexits.h>
+#include <elf.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "memory.h"
+#include "elf-info.h"
+#include "ldso.h"
+
+#define LD_SO_CACHE "/etc/ld.so.cache"
+
+#define CACHEMAGIC     "ld.so-1.7.0"
+#define CACHEMAGIC_NEW "glibc-ld.so.cache"
+#define CACHE_VERSION  "1.1"
+
+#define FLAG_TYPE_MASK 0x00ff
+#define FLAG_ELF       0x0001
+#define FLAG_ELF_LIBC6 0x0003
+
+/*
+ * On-disk format of ld.so.cache as written by ldconfig(8). Modern glibc only
+ * writes the new format, older ones prepend it with the libc5 compatible
+ * table.
+ */
+struct cache_file {
+	char magic[sizeof(CACHEMAGIC) - 1];
+	uint32_t nlibs;
+};
+
+struct file_entry {
+	int32_t flags;
+	uint32_t key, value;
+};
+
+struct cache_file_new {
+	char magic[sizeof(CACHEMAGIC_NEW) - 1];
+	char version[sizeof(CACHE_VERSION) - 1];
+	uint32_t nlibs;
+	uint32_t len_strings;
+	uint8_t flags;
+	uint8_t padding_unsed[3];
+	uint32_t extension_offset;
+	uint32_t unused[3];
+};
+
+struct file_entry_new {
+	int32_t flags;
+	uint32_t key, value;
+	uint32_t osversion;
+	uint64_t hwcap;
+};
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Shared libraries have no program interpreter, ldd(1) runs them with the
+ * default one of the system unless they have no dependencies at all. We are
+ * linked against it too, so take ours if the architecture matches.
+ */
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+static struct elf_info self_info;
+static char *self_path = NULL;
+
+static struct {
+	unsigned char *map;
+	size_t size;
+	const struct file_entry_new *libs;
+	uint32_t nlibs;
+	const char *strings;
+	size_t strings_size;
+} cache;
+
+struct object {
+	char *path;
+	const char *name;
+	dev_t dev;
+	ino_t ino;
+	size_t loader;
+	bool referenced;
+	struct elf_info info;
+};
+
+struct resolver {
+	struct object *objs;
+	size_t objs_nr;
+	char slibdir[PATH_MAX];
+	char libdir[PATH_MAX];
+};
+
+#define NO_LOADER ((size_t) -1)
+
+/* The path is NULL if the library was not found. */
+struct memo {
+	char *name;
+	char *path;
+};
+
+static void *memo_root = NULL;
+static pthread_mutex_t memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+extern int verbose;
+
+static void cache_load(void);
+static int cache_libcmp(const char *p1, const char *p2) __attribute__((__nonnull__ (1, 2)));
+static const char *cache_string(uint32_t off);
+static bool cache_lookup(const char *name, uint32_t *first, uint32_t *last) __attribute__((__nonnull__ (1, 2, 3)));
+
+static bool find_loaded(struct resolver *r, const char *name, size_t *idx) __attribute__((__nonnull__ (1, 2, 3)));
+static bool load_object(struct resolver *r, const char *path, const char *name, size_t loader, size_t *idx) __attribute__((__nonnull__ (1, 2, 5)));
+static bool expand_dst(struct resolver *r, size_t obj, const char *dir, size_t len, char *buf, size_t size) __attribute__((__nonnull__ (1, 3, 5)));
+static bool search_dirs(struct resolver *r, const char *list, const char *delim, size_t origin, const char *name, size_t loader, size_t *idx) __attribute__((__nonnull__ (1, 2, 3, 5, 7)));
+static bool search_cache(struct resolver *r, const char *name, size_t loader, size_t *idx) __attribute__((__nonnull__ (1, 2, 4)));
+static bool search_system_dirs(struct resolver *r, const char *name, size_t loader, size_t *idx) __attribute__((__nonnull__ (1, 2, 4)));
+static bool search_library(struct resolver *r, const char *name, size_t loader, size_t *idx) __attribute__((__nonnull__ (1, 2, 4)));
+static void set_system_dirs(struct resolver *r, const char *interp) __attribute__((__nonnull__ (1, 2)));
+static void read_self(void);
+static const char *default_interp(const struct elf_info *info) __attribute__((__nonnull__ (1)));
+static int compare_memo(const void *a, const void *b) __attribute__((__nonnull__ (1, 2)));
+static void free_memo(void *p) __attribute__((__nonnull__ (1)));
+
+void cache_load(void)
+{
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(LD_SO_CACHE, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (verbose > 1)
+			warn("open: %s", LD_SO_CACHE);
+		return;
+	}
+
+	if (fstat(fd, &sb) < 0 || (size_t) sb.st_size < sizeof(struct cache_file_new)) {
+		close(fd);
+		return;
+	}
+
+	cache.size = (size_t) sb.st_size;
+	cache.map = mmap(NULL, cache.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (cache.map == MAP_FAILED) {
+		warn("mmap: %s", LD_SO_CACHE);
+		cache.map = NULL;
+		return;
+	}
+
+	size_t offset = 0;
+
+	if (!memcmp(cache.map, CACHEMAGIC, sizeof(CACHEMAGIC) - 1)) {
+		const struct cache_file *old = (const void *) cache.map;
+
+		offset = sizeof(*old) + old->nlibs * sizeof(struct file_entry);
+		offset = (offset + __alignof__(struct cache_file_new) - 1) & ~(__alignof__(struct cache_file_new) - 1);
+	}
+
+	if (offset > cache.size || cache.size - offset < sizeof(struct cache_file_new))
+		goto bad;
+
+	const struct cache_file_new *hdr = (const void *)(cache.map + offset);
+
+	if (memcmp(hdr->magic, CACHEMAGIC_NEW, sizeof(CACHEMAGIC_NEW) - 1) ||
+	    memcmp(hdr->version, CACHE_VERSION, sizeof(CACHE_VERSION) - 1))
+		goto bad;
+
+	if ((cache.size - offset - sizeof(*hdr)) / sizeof(struct file_entry_new) < hdr->nlibs)
+		goto bad;
+
+	/*
+	 * All string offsets of the new format are relative to its header.
+	 */
+	cache.libs         = (const void *)(cache.map + offset + sizeof(*hdr));
+	cache.nlibs        = hdr->nlibs;
+	cache.strings      = (const char *) hdr;
+	cache.strings_size = cache.size - offset;
+
+	return;
+bad:
+	if (verbose > 1)
+		warnx("%s: unsupported format", LD_SO_CACHE);
+	munmap(cache.map, cache.size);
+	cache.map = NULL;
+}
+
+/*
+ * The libraries found by ldso_find_library() depend on the environment.
+ */
+void ldso_forget_libraries(void)
+{
+	pthread_mutex_lock(&memo_lock);
+#ifdef HAVE_TDESTROY
+	tdestroy(memo_root, free_memo);
+#endif
+	memo_root = NULL;
+	pthread_mutex_unlock(&memo_lock);
+}
+
+void ldso_cache_destroy(void)
+{
+	if (cache.map)
+		munmap(cache.map, cache.size);
+	memset(&cache, 0, sizeof(cache));
+
+#ifdef HAVE_TDESTROY
+	tdestroy(memo_root, free_memo);
+	memo_root = NULL;
+#endif
+	if (self_path) {
+		elf_info_free(&self_info);
+		free(self_path);
+		self_path = NULL;
+	}
+}
+
+/*
+ * The same comparison is used by ldconfig to sort the entries, so it has to
+ * be used for the binary search. Digits are compared numerically.
+ */
+int cache_libcmp(const char *p1, const char *p2)
+{
+	while (*p1 != '\0') {
+		if (*p1 >= '0' && *p1 <= '9') {
+			if (*p2 >= '0' && *p2 <= '9') {
+				int val1 = *p1++ - '0';
+				int val2 = *p2++ - '0';
+
+				while (*p1 >= '0' && *p1 <= '9')
+					val1 = val1 * 10 + *p1++ - '0';
+				while (*p2 >= '0' && *p2 <= '9')
+					val2 = val2 * 10 + *p2++ - '0';
+				if (val1 != val2)
+					return val1 - val2;
+			} else {
+				return 1;
+			}
+		} else if (*p2 >= '0' && *p2 <= '9') {
+			return -1;
+		} else if (*p1 != *p2) {
+			return *p1 - *p2;
+		} else {
+			p1++;
+			p2++;
+		}
+	}
+	return *p1 - *p2;
+}
+
+const char *cache_string(uint32_t off)
+{
+	if (off >= cache.strings_size || !memchr(cache.strings + off, '\0', cache.strings_size - off))
+		return NULL;
+	return cache.strings + off;
+}
+
+bool cache_lookup(const char *name, uint32_t *first, uint32_t *last)
+{
+	uint32_t left, right;
+
+	pthread_once(&cache_once, cache_load);
+
+	if (!cache.map || !cache.nlibs)
+		return false;
+
+	left = 0;
+	right = cache.nlibs;
+
+	/* The entries are sorted in descending order. */
+	while (left < right) {
+		uint32_t middle = left + (right - left) / 2;
+		const char *key = cache_string(cache.libs[middle].key);
+
+		if (!key)
+			return false;
+
+		int cmpres = cache_libcmp(name, key);
+
+		if (cmpres == 0) {
+			const char *k;
+
+			*first = *last = middle;
+
+			while (*first > 0 && (k = cache_string(cache.libs[*first - 1].key)) && !strcmp(name, k))
+				(*first)--;
+			while (*last + 1 < cache.nlibs && (k = cache_string(cache.libs[*last + 1].key)) && !strcmp(name, k))
+				(*last)++;
+
+			return true;
+		}
+
+		if (cmpres < 0)
+			left = middle + 1;
+		else
+			right = middle;
+	}
+
+	return false;
+}
+
+bool find_loaded(struct resolver *r, const char *name, size_t *idx)
+{
+	for (size_t i = 0; i < r->objs_nr; i++) {
+		struct object *o = &r->objs[i];
+
+		if ((o->name && !strcmp(o->name, name)) ||
+		    (o->info.soname && !strcmp(o->info.soname, name)) ||
+		    (strchr(name, '/') && !strcmp(o->path, name))) {
+			o->referenced = true;
+			*idx = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool load_object(struct resolver *r, const char *path, const char *name, size_t loader, size_t *idx)
+{
+	struct stat sb;
+	struct elf_info info;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+		close(fd);
+		return false;
+	}
+
+	for (size_t i = 0; i < r->objs_nr; i++) {
+		if (r->objs[i].dev == sb.st_dev && r->objs[i].ino == sb.st_ino) {
+			r->objs[i].referenced = true;
+			close(fd);
+			*idx = i;
+			return true;
+		}
+	}
+
+	if (elf_info_read(&info, path, fd) < 0) {
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	/*
+	 * The dynamic linker silently skips libraries built for another
+	 * architecture, so we do the same.
+	 */
+	if (r->objs_nr > 0 && !elf_info_compatible(&r->objs[0].info, &info)) {
+		if (verbose > 2)
+			warnx("skip incompatible shared object: %s", path);
+		elf_info_free(&info);
+		return false;
+	}
+
+	r->objs = xrealloc(r->objs, r->objs_nr + 1, sizeof(struct object));
+
+	struct object *o = &r->objs[r->objs_nr];
+
+	o->path   = xstrdup(path);
+	o->name   = name;
+	o->dev    = sb.st_dev;
+	o->ino    = sb.st_ino;
+	o->loader = loader;
+	o->info   = info;
+
+	o->referenced = true;
+
+	*idx = r->objs_nr++;
+	return true;
+}
+
+/*
+ * Expands the dynamic string tokens ($ORIGIN, $LIB, $PLATFORM) in the
+ * directory name. Returns false if the directory must be ignored.
+ */
+bool expand_dst(struct resolver *r, size_t obj, const char *dir, size_t len, char *buf, size_t size)
+{
+	const char *end = dir + len;
+	size_t n = 0;
+
+	while (dir < end) {
+		const char *value = NULL;
+		size_t value_len = 0;
+		char origin[PATH_MAX];
+		struct utsname uts;
+
+		if (*dir == '$') {
+			const char *token = dir + 1;
+			bool braces = (token < end && *token == '{');
+
+			if (braces)
+				token++;
+
+			size_t token_len = 0;
+			while (token + token_len < end && (token[token_len] == '_' ||
+			                                   (token[token_len] >= 'A' && token[token_len] <= 'Z')))
+				token_len++;
+
+			if (token_len == 6 && !strncmp(token, "ORIGIN", 6)) {
+				const char *path = r->objs[obj].path;
+				const char *slash = strrchr(path, '/');
+
+				if (!slash)
+					return false;
+
+				value_len = (slash == path) ? 1 : (size_t)(slash - path);
+				if (value_len >= sizeof(origin))
+					return false;
+
+				memcpy(origin, path, value_len);
+				origin[value_len] = '\0';
+				value = origin;
+
+			} else if (token_len == 3 && !strncmp(token, "LIB", 3)) {
+				/*
+				 * ld.so expands it to the directory it is installed
+				 * in, relative to the root and without /usr.
+				 */
+				if (r->slibdir[0]) {
+					value = r->slibdir;
+					if (!strncmp(value, "/usr/", 5))
+						value += 4;
+					value++;
+				} else {
+					value = (r->objs[0].info.class == ELFCLASS64) ? "lib64" : "lib";
+				}
+				value_len = strlen(value);
+
+			} else if (token_len == 8 && !strncmp(token, "PLATFORM", 8)) {
+				if (uname(&uts) < 0)
+					return false;
+				value = uts.machine;
+				value_len = strlen(value);
+
+			} else {
+				return false;
+			}
+
+			if (braces) {
+				if (token + token_len >= end || token[token_len] != '}')
+					return false;
+				token_len++;
+			}
+
+			dir = token + token_len;
+		} else {
+			value = dir++;
+			value_len = 1;
+		}
+
+		if (n + value_len >= size)
+			return false;
+
+		memcpy(buf + n, value, value_len);
+		n += value_len;
+	}
+
+	buf[n] = '\0';
+	return true;
+}
+
+bool search_dirs(struct resolver *r, const char *list, const char *delim, size_t origin, const char *name, size_t loader, size_t *idx)
+{
+	char dir[PATH_MAX];
+	char path[PATH_MAX];
+
+	while (*list) {
+		size_t len = strcspn(list, delim);
+
+		if (len > 0 && expand_dst(r, origin, list, len, dir, sizeof(dir))) {
+			int n = snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+			if (n > 0 && (size_t) n < sizeof(path) && load_object(r, path, name, loader, idx))
+				return true;
+		}
+
+		list += len;
+		if (*list)
+			list++;
+	}
+	return false;
+}
+
+bool search_cache(struct resolver *r, const char *name, size_t loader, size_t *idx)
+{
+	uint32_t first, last;
+
+	if (!cache_lookup(name, &first, &last))
+		return false;
+
+	for (uint32_t i = first; i <= last; i++) {
+		const struct file_entry_new *e = &cache.libs[i];
+		const char *path;
+
+		switch (e->flags & FLAG_TYPE_MASK) {
+			case FLAG_ELF:
+			case FLAG_ELF_LIBC6:
+				break;
+			default:
+				continue;
+		}
+
+		/*
+		 * Entries from the glibc-hwcaps subdirectories depend on the
+		 * CPU of the build host which has nothing to do with the
+		 * target. Use the baseline libraries.
+		 */
+		if (e->hwcap)
+			continue;
+
+		if ((path = cache_string(e->value)) && load_object(r, path, name, loader, idx))
+			return true;
+	}
+	return false;
+}
+
+bool search_system_dirs(struct resolver *r, const char *name, size_t loader, size_t *idx)
+{
+	static const char *const dirs64[] = { "/lib64", "/usr/lib64", "/lib", "/usr/lib", NULL };
+	static const char *const dirs32[] = { "/lib", "/usr/lib", NULL };
+
+	const char *const *dirs = (r->objs[0].info.class == ELFCLASS64) ? dirs64 : dirs32;
+	char path[PATH_MAX];
+	int n;
+
+	if (r->slibdir[0]) {
+		n = snprintf(path, sizeof(path), "%s/%s", r->slibdir, name);
+		if (n > 0 && (size_t) n < sizeof(path) && load_object(r, path, name, loader, idx))
+			return true;
+	}
+
+	if (r->libdir[0]) {
+		n = snprintf(path, sizeof(path), "%s/%s", r->libdir, name);
+		if (n > 0 && (size_t) n < sizeof(path) && load_object(r, path, name, loader, idx))
+			return true;
+	}
+
+	for (size_t i = 0; dirs[i]; i++) {
+		n = snprintf(path, sizeof(path), "%s/%s", dirs[i], name);
+		if (n > 0 && (size_t) n < sizeof(path) && load_object(r, path, name, loader, idx))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Follows the search order of the dynamic linker: DT_RPATH of the loader
+ * chain (unless the object has DT_RUNPATH), LD_LIBRARY_PATH, DT_RUNPATH,
+ * ld.so.cache and finally the system directories.
+ */
+bool search_library(struct resolver *r, const char *name, size_t loader, size_t *idx)
+{
+	const char *env;
+
+	if (strchr(name, '/')) {
+		char path[PATH_MAX];
+
+		return expand_dst(r, loader, name, strlen(name), path, sizeof(path)) &&
+		       load_object(r, path, name, loader, idx);
+	}
+
+	if (!r->objs[loader].info.runpath) {
+		for (size_t i = loader; i != NO_LOADER; i = r->objs[i].loader) {
+			if (r->objs[i].info.runpath || !r->objs[i].info.rpath)
+				continue;
+			if (search_dirs(r, r->objs[i].info.rpath, ":", i, name, loader, idx))
+				return true;
+		}
+	}
+
+	if ((env = getenv("LD_LIBRARY_PATH")) != NULL &&
+	    search_dirs(r, env, ":;", 0, name, loader, idx))
+		return true;
+
+	if (r->objs[loader].info.runpath &&
+	    search_dirs(r, r->objs[loader].info.runpath, ":", loader, name, loader, idx))
+		return true;
+
+	if (search_cache(r, name, loader, idx))
+		return true;
+
+	return search_system_dirs(r, name, loader, idx);
+}
+
+/*
+ * The system directories of glibc are the ones where the dynamic linker
+ * itself is installed (slibdir) and its counterpart under /usr (libdir).
+ */
+void set_system_dirs(struct resolver *r, const char *interp)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static char *last_interp = NULL;
+	static char slibdir[PATH_MAX];
+	static char libdir[PATH_MAX];
+	static bool found = false;
+
+	pthread_mutex_lock(&lock);
+
+	if (!last_interp || strcmp(last_interp, interp)) {
+		char path[PATH_MAX];
+		char *slash;
+
+		free(last_interp);
+		last_interp = xstrdup(interp);
+		found = false;
+
+		if (realpath(interp, path) && (slash = strrchr(path, '/')) && slash != path) {
+			*slash = '\0';
+			strcpy(slibdir, path);
+
+			if (!strncmp(path, "/usr/", 5))
+				strcpy(libdir, path + 4);
+			else if (strlen(path) + 4 < sizeof(libdir))
+				snprintf(libdir, sizeof(libdir), "/usr%s", path);
+			else
+				libdir[0] = '\0';
+
+			found = true;
+		}
+	}
+
+	if (found) {
+		strcpy(r->slibdir, slibdir);
+		strcpy(r->libdir, libdir);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+void read_self(void)
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	if ((len = readlink("/proc/self/exe", path, sizeof(path) - 1)) < 0)
+		return;
+	path[len] = '\0';
+
+	if ((fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC)) < 0)
+		return;
+
+	if (!elf_info_read(&self_info, path, fd))
+		self_path = xstrdup(path);
+	close(fd);
+}
+
+const char *default_interp(const struct elf_info *info)
+{
+	pthread_once(&self_once, read_self);
+
+	if (!self_path || !self_info.interp || !elf_info_compatible(info, &self_info))
+		return NULL;
+
+	return self_info.interp;
+}
+
+/*
+ * The object itself has already been parsed by the caller. Its info is only
+ * borrowed and stays owned by the caller.
+ */
+int ldso_dependencies(const char *filename, int fd, const struct elf_info *info, ldso_handler_t handler)
+{
+	const char *interp;
+	struct resolver r;
+	struct stat sb;
+	size_t idx;
+	int ret = 0;
+
+	if (fstat(fd, &sb) < 0) {
+		warn("fstat: %s", filename);
+		return -1;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.objs = xcalloc(1, sizeof(struct object));
+
+	r.objs[0].info   = *info;
+	r.objs[0].path   = xstrdup(filename);
+	r.objs[0].dev    = sb.st_dev;
+	r.objs[0].ino    = sb.st_ino;
+	r.objs[0].loader = NO_LOADER;
+	r.objs_nr = 1;
+
+	if (!r.objs[0].info.dynamic)
+		goto end;
+
+	ret = 1;
+
+	interp = r.objs[0].info.interp;
+
+	if (!interp && r.objs[0].info.needed_nr)
+		interp = default_interp(&r.objs[0].info);
+
+	if (interp) {
+		set_system_dirs(&r, interp);
+
+		/*
+		 * The default interpreter is listed by ldd(1) only if some
+		 * object depends on it.
+		 */
+		if (load_object(&r, interp, NULL, 0, &idx))
+			r.objs[idx].referenced = (interp == r.objs[0].info.interp);
+		else
+			warnx("%s: unable to find program interpreter: %s", filename, interp);
+	}
+
+	/*
+	 * Breadth-first walk in the same order as the dynamic linker loads
+	 * the objects. The list grows while we are walking it.
+	 */
+	for (size_t i = 0; i < r.objs_nr; i++) {
+		for (size_t n = 0; n < r.objs[i].info.needed_nr; n++) {
+			const char *name = r.objs[i].info.needed[n];
+
+			if (find_loaded(&r, name, &idx))
+				continue;
+
+			if (!search_library(&r, name, i, &idx) && verbose)
+				warnx("%s: shared object '%s' not found (required by '%s')",
+				      filename, name, r.objs[i].path);
+		}
+	}
+
+	for (size_t i = 1; i < r.objs_nr; i++) {
+		if (r.objs[i].referenced)
+			handler(filename, r.objs[i].path);
+	}
+end:
+	for (size_t i = 0; i < r.objs_nr; i++) {
+		free(r.objs[i].path);
+		if (i > 0)
+			elf_info_free(&r.objs[i].info);
+	}
+	free(r.objs);
+
+	return ret;
+}
+
+int compare_memo(const void *a, const void *b)
+{
+	return strcmp(((const struct memo *) a)->name, ((const struct memo *) b)->name);
+}
+
+void free_memo(void *p)
+{
+	struct memo *m = p;
+
+	free(m->name);
+	free(m->path);
+	free(m);
+}
+
+/*
+ * Finds the library that dlopen(3) called by us would load, but without
+ * loading it and running its constructors. The same names show up in many
+ * objects, so the results are kept for the whole run.
+ */
+bool ldso_find_library(const char *name, char *buf, size_t size)
+{
+	struct memo key = { .name = (char *) name };
+	struct memo *m = NULL;
+	struct resolver r;
+	void **node;
+	size_t idx;
+
+	pthread_mutex_lock(&memo_lock);
+	node = tfind(&key, &memo_root, compare_memo);
+	if (node)
+		m = *node;
+	pthread_mutex_unlock(&memo_lock);
+
+	if (!m) {
+		m = xcalloc(1, sizeof(*m));
+		m->name = xstrdup(name);
+
+		pthread_once(&self_once, read_self);
+
+		if (self_path) {
+			memset(&r, 0, sizeof(r));
+			r.objs = xcalloc(1, sizeof(struct object));
+
+			r.objs[0].path   = self_path;
+			r.objs[0].info   = self_info;
+			r.objs[0].loader = NO_LOADER;
+			r.objs_nr = 1;
+
+			if (self_info.interp)
+				set_system_dirs(&r, self_info.interp);
+
+			if (search_library(&r, name, 0, &idx) && idx > 0)
+				m->path = xstrdup(r.objs[idx].path);
+
+			for (size_t i = 1; i < r.objs_nr; i++) {
+				free(r.objs[i].path);
+				elf_info_free(&r.objs[i].info);
+			}
+			free(r.objs);
+		}
+
+		pthread_mutex_lock(&memo_lock);
+		node = tsearch(m, &memo_root, compare_memo);
+		if (!node)
+			err(EX_OSERR, "tsearch");
+		if (*node != m) {
+			free_memo(m);
+			m = *node;
+		}
+		pthread_mutex_unlock(&memo_lock);
+	}
+
+	if (!m->path || strlen(m->path) >= size)
+		return false;
+
+	strcpy(buf, m->path);
+	return true;
+}
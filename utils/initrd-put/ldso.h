@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_LDSO_H__
+#define __INITRD_PUT_LDSO_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "elf-info.h"
+
+typedef void (*ldso_handler_t)(const char *filename, const char *library);
+
+int ldso_dependencies(const char *filename, int fd, const struct elf_info *info, ldso_handler_t handler) __attribute__((__nonnull__ (1, 3, 4)));
+bool ldso_find_library(const char *name, char *buf, size_t size) __attribute__((__nonnull__ (1, 2)));
+void ldso_forget_libraries(void);
+void ldso_cache_destroy(void);
+
+#endif // __INITRD_PUT_LDSO_H__
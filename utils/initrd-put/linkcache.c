@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "memory.h"
+#include "hash.h"
+#include "linkcache.h"
+
+/*
+ * The results of readlink(2) for the directories that paths go through.
+ * Most paths share a few prefixes like /usr/lib/x86_64-linux-gnu, so each
+ * of them is looked up once. Only two results are kept: the target of a
+ * symlink and EINVAL for anything that is not a symlink. Other errors are
+ * not cached.
+ */
+struct link {
+	struct hashtab_entry entry;
+	char *target;		/* NULL if the path is not a symlink */
+	size_t target_len;
+};
+
+static struct hashtab links = HASHTAB_INIT(struct link, 1024);
+
+static pthread_rwlock_t links_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static ssize_t copy_result(const struct link *l, char *buf, size_t size) __attribute__((__nonnull__ (1, 2)));
+
+ssize_t copy_result(const struct link *l, char *buf, size_t size)
+{
+	size_t len = l->target_len;
+
+	if (!l->target) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (len > size)
+		len = size;
+
+	memcpy(buf, l->target, len);
+	return (ssize_t) len;
+}
+
+/*
+ * Works like readlink(2).
+ */
+ssize_t linkcache_readlink(const char *path, char *buf, size_t size)
+{
+	size_t len = strlen(path);
+	size_t hash = hash_path(path, len);
+	struct link *l;
+	ssize_t n;
+
+	pthread_rwlock_rdlock(&links_lock);
+	if ((l = hashtab_find(&links, path, len, hash)) != NULL) {
+		n = copy_result(l, buf, size);
+		pthread_rwlock_unlock(&links_lock);
+		return n;
+	}
+	pthread_rwlock_unlock(&links_lock);
+
+	errno = 0;
+	n = readlink(path, buf, size);
+
+	if (n < 0 && errno != EINVAL)
+		return n;
+
+	int saved_errno = errno;
+
+	pthread_rwlock_wrlock(&links_lock);
+
+	l = hashtab_add(&links, path, len, hash);
+	if (!l->entry.key) {
+		l->entry.key = xstrndup(path, len);
+		if (n >= 0) {
+			l->target = xstrndup(buf, (size_t) n);
+			l->target_len = (size_t) n;
+		}
+	}
+
+	pthread_rwlock_unlock(&links_lock);
+
+	errno = saved_errno;
+	return n;
+}
+
+void linkcache_free(void)
+{
+	for (size_t i = 0; i < links.size; i++) {
+		struct link *l = hashtab_at(&links, i);
+
+		free((char *) l->entry.key);
+		free(l->target);
+	}
+
+	hashtab_free(&links);
+}
@@ -0,0 +1,10 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_LINKCACHE_H__
+#define __INITRD_PUT_LINKCACHE_H__
+
+#include <sys/types.h>
+
+ssize_t linkcache_readlink(const char *path, char *buf, size_t size) __attribute__((__nonnull__ (1, 2)));
+void linkcache_free(void);
+
+#endif // __INITRD_PUT_LINKCACHE_H__
@@ -0,0 +1,239 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sysexits.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "memory.h"
+#include "hash.h"
+#include "manifest.h"
+
+/*
+ * The content of the destination directory. A directory is read the first
+ * time a path in it is looked up, so the check whether a path is already
+ * installed is a lookup in the hash table instead of lstat(2), and the
+ * directories that are never asked about are not read at all.
+ *
+ * Symlinks are not followed. If a path goes through a symlink in the
+ * destination directory, the answer is left to lstat(2).
+ */
+#define MANIFEST_BUFSIZ (32 * 1024)
+
+/* The directory has to be read before the path can be found. */
+#define NOT_LOADED (-2)
+
+struct entry {
+	struct hashtab_entry entry;
+	unsigned char type;
+	bool loaded;
+};
+
+static const char *root = NULL;
+
+static struct hashtab entries = HASHTAB_INIT(struct entry, 4096);
+
+static pthread_rwlock_t entries_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct entry *find_entry(const char *path, size_t len) __attribute__((__nonnull__ (1)));
+static void add_entry(const char *path, size_t len, unsigned char type) __attribute__((__nonnull__ (1)));
+static void load_dir(const char *path, size_t len) __attribute__((__nonnull__ (1)));
+static int lookup(const char *path, size_t len, size_t *dir_len) __attribute__((__nonnull__ (1, 3)));
+static int lstat_type(const char *path) __attribute__((__nonnull__ (1)));
+
+struct entry *find_entry(const char *path, size_t len)
+{
+	return hashtab_find(&entries, path, len, hash_path(path, len));
+}
+
+void add_entry(const char *path, size_t len, unsigned char type)
+{
+	struct entry *e = hashtab_add(&entries, path, len, hash_path(path, len));
+
+	if (e->entry.key)
+		return;
+
+	e->entry.key = xstrndup(path, len);
+	e->type = type;
+}
+
+/*
+ * Adds the content of the directory to the table. The path of the directory
+ * is relative to the root and has the leading slash or is empty for the root
+ * itself. The caller holds the write lock.
+ */
+void load_dir(const char *path, size_t len)
+{
+	char dirname[PATH_MAX + 1];
+	char name[PATH_MAX];
+	char *buf;
+	ssize_t n;
+	int fd;
+
+	if (find_entry(path, len)->loaded)
+		return;
+
+	snprintf(dirname, sizeof(dirname), "%s%.*s", root, (int) len, path);
+
+	if ((fd = open(dirname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		err(EX_OSERR, "open: %s", dirname);
+
+	buf = xcalloc(1, MANIFEST_BUFSIZ);
+	memcpy(name, path, len);
+
+	while ((n = getdents64(fd, buf, MANIFEST_BUFSIZ)) > 0) {
+		for (ssize_t off = 0; off < n;) {
+			struct dirent64 *d = (struct dirent64 *) (buf + off);
+			unsigned char type = d->d_type;
+			size_t name_len = strlen(d->d_name);
+
+			off += d->d_reclen;
+
+			if (d->d_name[0] == '.' &&
+			    (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+				continue;
+
+			if (len + name_len + 2 > PATH_MAX) {
+				warnx("path is too long: %s/%s", dirname, d->d_name);
+				continue;
+			}
+
+			name[len] = '/';
+			memcpy(name + len + 1, d->d_name, name_len + 1);
+
+			if (type == DT_UNKNOWN) {
+				struct stat st;
+
+				if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+					err(EX_OSERR, "fstatat: %s%s", root, name);
+
+				type = (unsigned char) IFTODT(st.st_mode);
+			}
+
+			add_entry(name, len + name_len + 1, type);
+		}
+	}
+
+	if (n < 0)
+		err(EX_OSERR, "getdents64: %s", dirname);
+
+	close(fd);
+	free(buf);
+
+	find_entry(path, len)->loaded = true;
+}
+
+/*
+ * Walks the path from the root. If a directory on the way has not been read
+ * yet, returns NOT_LOADED and the length of its path.
+ */
+int lookup(const char *path, size_t len, size_t *dir_len)
+{
+	size_t n = 0;
+
+	while (1) {
+		struct entry *e = find_entry(path, n);
+		const char *s;
+		size_t next;
+
+		if (!e->loaded) {
+			*dir_len = n;
+			return NOT_LOADED;
+		}
+
+		s = strchr(path + n + 1, '/');
+		next = s ? (size_t)(s - path) : len;
+
+		e = find_entry(path, next);
+
+		if (!e)
+			return -1;
+
+		if (next == len)
+			return e->type;
+
+		if (e->type == DT_LNK)
+			return lstat_type(path);
+
+		if (e->type != DT_DIR)
+			return -1;
+
+		n = next;
+	}
+}
+
+int lstat_type(const char *path)
+{
+	char buf[PATH_MAX + 1];
+	struct stat st;
+
+	snprintf(buf, sizeof(buf), "%s%s", root, path);
+
+	errno = 0;
+	if (lstat(buf, &st) < 0) {
+		if (errno != ENOENT && errno != ENOTDIR)
+			err(EX_OSERR, "unable to get access to %s", buf);
+		return -1;
+	}
+
+	return IFTODT(st.st_mode);
+}
+
+void manifest_init(const char *destdir)
+{
+	manifest_free();
+	root = destdir;
+
+	add_entry("", 0, DT_DIR);
+}
+
+/*
+ * Returns the type of the file (DT_*) or -1 if there is no such file in the
+ * destination directory.
+ */
+int manifest_lookup(const char *path)
+{
+	size_t len = strlen(path);
+	size_t dir_len = 0;
+	int type;
+
+	if (!len)
+		return DT_DIR;
+
+	pthread_rwlock_rdlock(&entries_lock);
+
+	while ((type = lookup(path, len, &dir_len)) == NOT_LOADED) {
+		pthread_rwlock_unlock(&entries_lock);
+
+		pthread_rwlock_wrlock(&entries_lock);
+		load_dir(path, dir_len);
+		pthread_rwlock_unlock(&entries_lock);
+
+		pthread_rwlock_rdlock(&entries_lock);
+	}
+
+	pthread_rwlock_unlock(&entries_lock);
+
+	return type;
+}
+
+void manifest_free(void)
+{
+	for (size_t i = 0; i < entries.size; i++) {
+		struct entry *e = hashtab_at(&entries, i);
+
+		free((char *) e->entry.key);
+	}
+
+	hashtab_free(&entries);
+}
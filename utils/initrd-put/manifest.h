@@ -0,0 +1,11 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_MANIFEST_H__
+#define __INITRD_PUT_MANIFEST_H__
+
+#include <dirent.h>
+
+void manifest_init(const char *destdir) __attribute__((__nonnull__ (1)));
+int manifest_lookup(const char *path) __attribute__((__nonnull__ (1)));
+void manifest_free(void);
+
+#endif // __INITRD_PUT_MANIFEST_H__
@@ -7,85 +7,183 @@
 #include <limits.h>
 #include <sysexits.h>
 #include <err.h>
-#include <regex.h>
+#include <pthread.h>
 
 #include "memory.h"
 #include "queue.h"
+#include "tree.h"
+#include "exclude.h"
+#include "stats.h"
 
 extern int verbose;
 extern char *prefix;
-extern regex_t *exclude_match;
-extern size_t exclude_match_nr;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
 
 static struct file *inqueue = NULL;
 static size_t queue_nr = 0;
+static size_t queue_busy = 0;
+
+static struct file *alloc_file(char *src, const struct stat *st, bool recursive) __attribute__((__nonnull__ (1)));
 
 struct file *get_queue(size_t *nr)
 {
+	struct file *head;
+
+	pthread_mutex_lock(&queue_lock);
+
 	if (nr)
 		*nr = queue_nr;
+	head = inqueue;
+
+	pthread_mutex_unlock(&queue_lock);
 
-	return inqueue;
+	return head;
 }
 
 struct file *enqueue_item(const char *str, ssize_t len)
 {
-	struct file *new;
+	return enqueue_file(str, len, NULL, false);
+}
 
-	if (exclude_match_nr) {
-		char buf[PATH_MAX + 1];
+/*
+ * The parent directories are needed by the files in them, so they are not
+ * excluded.
+ */
+struct file *enqueue_parent(const char *str, ssize_t len)
+{
+	struct file *new = alloc_file(tree_intern(str, (size_t) len), NULL, false);
 
-		strncpy(buf, str, (len <= 0 ? PATH_MAX : (size_t) len));
-		buf[(len <= 0 ? PATH_MAX : len) + 1]  = 0;
+	enqueue_files(&new, 1);
 
-		for (size_t i = 0; i < exclude_match_nr; i++) {
-			if (!regexec(&exclude_match[i], buf, 0, NULL, 0)) {
-				if (verbose > 1)
-					warnx("exclude path: %s", buf);
-				return NULL;
-			}
-		}
+	return new;
+}
+
+/*
+ * Returns NULL if the path is excluded.
+ */
+struct file *new_file(const char *str, ssize_t len, const struct stat *st, bool recursive)
+{
+	char *src;
+
+	src = tree_intern(str, (len < 0)
+	                  ? strlen(str)
+	                  : strnlen(str, (size_t) len));
+
+	if (exclude_path(src)) {
+		stats_count(STATS_EXCLUDED);
+		return NULL;
 	}
 
+	return alloc_file(src, st, recursive);
+}
+
+struct file *alloc_file(char *src, const struct stat *st, bool recursive)
+{
+	struct file *new;
+
 	new = xcalloc(1, sizeof(*new));
+	new->src = src;
+
+	if (st)
+		memcpy(&new->stat, st, sizeof(new->stat));
 
-	new->src = (len < 0)
-	           ? xstrdup(str)
-	           : xstrndup(str, (size_t) len);
+	new->recursive = recursive;
 
 	if (verbose > 1)
 		warnx("add to list: %s", new->src);
 
-	if (inqueue) {
-		if (inqueue->prev)
-			errx(EX_SOFTWARE, "bad queue head");
-		inqueue->prev = new;
-		new->next = inqueue;
+	return new;
+}
+
+/*
+ * The items become visible to the other threads as soon as they are in the
+ * queue, so everything we know about them must be filled in before.
+ */
+void enqueue_files(struct file **files, size_t nr)
+{
+	pthread_mutex_lock(&queue_lock);
+
+	for (size_t i = 0; i < nr; i++) {
+		struct file *new = files[i];
+
+		if (inqueue) {
+			if (inqueue->prev)
+				errx(EX_SOFTWARE, "bad queue head");
+			inqueue->prev = new;
+			new->next = inqueue;
+		}
+
+		inqueue = new;
+		queue_nr++;
 	}
 
-	inqueue = new;
-	queue_nr++;
+	if (nr > 1)
+		pthread_cond_broadcast(&queue_cond);
+	else
+		pthread_cond_signal(&queue_cond);
+
+	pthread_mutex_unlock(&queue_lock);
+}
+
+struct file *enqueue_file(const char *str, ssize_t len, const struct stat *st, bool recursive)
+{
+	struct file *new = new_file(str, len, st, recursive);
+
+	if (new)
+		enqueue_files(&new, 1);
 
 	return new;
 }
 
-void dequeue_item(struct file *ptr)
+/*
+ * Takes the next item from the queue. If the queue is empty, waits until
+ * the items that are being processed by other threads are done because
+ * they can add new ones. Returns NULL when there is nothing left to do.
+ */
+struct file *dequeue_item(void)
 {
-	if (!ptr)
-		return;
-	if (ptr->prev)
-		ptr->prev->next = ptr->next;
-	if (ptr->next)
-		ptr->next->prev = ptr->prev;
-	if (inqueue == ptr)
-		inqueue = NULL;
-	queue_nr--;
+	struct file *ptr;
+
+	pthread_mutex_lock(&queue_lock);
+
+	while (!inqueue && queue_busy > 0)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+
+	ptr = inqueue;
+
+	if (ptr) {
+		inqueue = ptr->next;
+		if (inqueue)
+			inqueue->prev = NULL;
+		ptr->next = NULL;
+		queue_nr--;
+		queue_busy++;
+	} else {
+		pthread_cond_broadcast(&queue_cond);
+	}
+
+	pthread_mutex_unlock(&queue_lock);
+
+	return ptr;
+}
+
+void dequeue_done(void)
+{
+	pthread_mutex_lock(&queue_lock);
+
+	queue_busy--;
+
+	if (!queue_busy && !inqueue)
+		pthread_cond_broadcast(&queue_cond);
+
+	pthread_mutex_unlock(&queue_lock);
 }
 
 void free_file(void *ptr)
 {
 	struct file *p = ptr;
-	free(p->src);
 	free(p->symlink);
 	free(p);
 }
@@ -4,22 +4,31 @@
 
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 struct file {
 	struct file *prev;
 	struct file *next;
 	struct stat stat;
-	char *src;
+	char *src;		/* interned, see tree_intern() */
 	char *dst;
 	char *symlink;
+	struct file *same;	/* the file with the same content, see dedup.c */
+	unsigned long generation;	/* see tree_new_generation() */
+	uint64_t elapsed;	/* nanoseconds, see stats.c */
 	bool recursive;
 	bool installed;
 };
 
 struct file *get_queue(size_t *nr);
 void free_file(void *ptr) __attribute__((__nonnull__ (1)));
+struct file *new_file(const char *str, ssize_t len, const struct stat *st, bool recursive) __attribute__((__nonnull__ (1)));
+void enqueue_files(struct file **files, size_t nr) __attribute__((__nonnull__ (1)));
+struct file *enqueue_file(const char *str, ssize_t len, const struct stat *st, bool recursive) __attribute__((__nonnull__ (1)));
 struct file *enqueue_item(const char *str, ssize_t len) __attribute__((__nonnull__ (1)));
-void dequeue_item(struct file *ptr);
+struct file *enqueue_parent(const char *str, ssize_t len) __attribute__((__nonnull__ (1)));
+struct file *dequeue_item(void);
+void dequeue_done(void);
 
 #endif // __INITRD_PUT_QUEUE_H__
 
@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "queue.h"
+#include "tree.h"
+#include "stats.h"
+
+/*
+ * The time spent in each phase and a few counters. The phases of the
+ * discovery run in all threads at once, so their time is the sum over the
+ * threads and may be longer than the whole run. Nothing is measured unless
+ * the statistics are requested.
+ */
+#define STATS_SLOWEST 10
+
+struct phase_time {
+	uint64_t wall;
+	uint64_t cpu;
+};
+
+static const char *const phase_names[STATS_PHASES] = {
+	[STATS_CANONICALIZE] = "canonicalize",
+	[STATS_WALK]         = "walk",
+	[STATS_ELF]          = "elf",
+	[STATS_RESOLVE]      = "resolve",
+	[STATS_DEDUP]        = "dedup",
+	[STATS_COPY]         = "copy",
+	[STATS_PERMISSIONS]  = "permissions",
+};
+
+static enum stats_mode stats_mode = STATS_NONE;
+
+static struct phase_time phases[STATS_PHASES];
+static uint64_t counters[STATS_COUNTERS];
+
+static struct timespec start_wall;
+static struct rusage start_usage;
+static int64_t start_syscalls;
+
+static uint64_t files_nr;
+static uint64_t files_bytes;
+static struct file *slowest[STATS_SLOWEST];
+static size_t slowest_nr;
+
+static uint64_t nsec_between(const struct timespec *a, const struct timespec *b) __attribute__((__nonnull__ (1, 2)));
+static uint64_t timeval_nsec(const struct timeval *tv) __attribute__((__nonnull__ (1)));
+static int64_t read_syscalls(void);
+static void collect_file(struct file *p) __attribute__((__nonnull__ (1)));
+static void print_json_string(const char *str) __attribute__((__nonnull__ (1)));
+static void report_text(uint64_t wall, uint64_t cpu, int64_t syscalls);
+static void report_json(uint64_t wall, uint64_t cpu, int64_t syscalls);
+
+uint64_t nsec_between(const struct timespec *a, const struct timespec *b)
+{
+	int64_t nsec = (int64_t)(b->tv_sec - a->tv_sec) * 1000000000 + (b->tv_nsec - a->tv_nsec);
+	return (nsec > 0) ? (uint64_t) nsec : 0;
+}
+
+uint64_t timeval_nsec(const struct timeval *tv)
+{
+	return (uint64_t) tv->tv_sec * 1000000000 + (uint64_t) tv->tv_usec * 1000;
+}
+
+/*
+ * There is no counter of all syscalls, so the read and write calls from
+ * /proc/self/io are used. Returns -1 if the file is not available.
+ */
+int64_t read_syscalls(void)
+{
+	char line[128];
+	int64_t value, ret = -1;
+	FILE *fp;
+
+	if (!(fp = fopen("/proc/self/io", "re")))
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "syscr: %" SCNd64, &value) == 1 ||
+		    sscanf(line, "syscw: %" SCNd64, &value) == 1)
+			ret = (ret < 0 ? 0 : ret) + value;
+	}
+
+	fclose(fp);
+	return ret;
+}
+
+void stats_begin(enum stats_mode mode)
+{
+	stats_mode = mode;
+
+	if (stats_mode == STATS_NONE)
+		return;
+
+	memset(phases, 0, sizeof(phases));
+	memset(counters, 0, sizeof(counters));
+
+	clock_gettime(CLOCK_MONOTONIC, &start_wall);
+	getrusage(RUSAGE_SELF, &start_usage);
+	start_syscalls = read_syscalls();
+}
+
+void stats_start(struct stats_timer *t)
+{
+	if (stats_mode == STATS_NONE)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t->wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t->cpu);
+}
+
+uint64_t stats_elapsed(const struct stats_timer *t)
+{
+	struct timespec now;
+
+	if (stats_mode == STATS_NONE)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return nsec_between(&t->wall, &now);
+}
+
+void stats_stop(struct stats_timer *t, enum stats_phase phase)
+{
+	struct timespec wall, cpu;
+
+	if (stats_mode == STATS_NONE)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+
+	__atomic_add_fetch(&phases[phase].wall, nsec_between(&t->wall, &wall), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&phases[phase].cpu, nsec_between(&t->cpu, &cpu), __ATOMIC_RELAXED);
+}
+
+void stats_count(enum stats_counter counter)
+{
+	stats_add(counter, 1);
+}
+
+void stats_add(enum stats_counter counter, uint64_t value)
+{
+	if (stats_mode == STATS_NONE)
+		return;
+
+	__atomic_add_fetch(&counters[counter], value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Keeps the slowest files sorted from the slowest one.
+ */
+void collect_file(struct file *p)
+{
+	size_t i;
+
+	files_nr++;
+
+	if (S_ISREG(p->stat.st_mode))
+		files_bytes += (uint64_t) p->stat.st_size;
+
+	/* The time of a directory is the time to walk it. */
+	if (S_ISDIR(p->stat.st_mode))
+		return;
+
+	for (i = slowest_nr; i > 0 && slowest[i - 1]->elapsed < p->elapsed; i--) {
+		if (i < STATS_SLOWEST)
+			slowest[i] = slowest[i - 1];
+	}
+
+	if (i < STATS_SLOWEST) {
+		slowest[i] = p;
+		if (slowest_nr < STATS_SLOWEST)
+			slowest_nr++;
+	}
+}
+
+void print_json_string(const char *str)
+{
+	fputc('"', stderr);
+
+	for (const unsigned char *s = (const unsigned char *) str; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(stderr, "\\%c", *s);
+		else if (*s < 0x20)
+			fprintf(stderr, "\\u%04x", *s);
+		else
+			fputc(*s, stderr);
+	}
+
+	fputc('"', stderr);
+}
+
+void report_text(uint64_t wall, uint64_t cpu, int64_t syscalls)
+{
+	fprintf(stderr, "%-14s %12s %12s\n", "phase", "wall", "cpu");
+
+	for (size_t i = 0; i < STATS_PHASES; i++)
+		fprintf(stderr, "%-14s %11.6fs %11.6fs\n", phase_names[i],
+		        (double) phases[i].wall / 1e9, (double) phases[i].cpu / 1e9);
+
+	fprintf(stderr, "%-14s %11.6fs %11.6fs\n", "total",
+	        (double) wall / 1e9, (double) cpu / 1e9);
+
+	fprintf(stderr, "files: %" PRIu64 "\n", files_nr);
+	fprintf(stderr, "bytes: %" PRIu64 "\n", files_bytes);
+	fprintf(stderr, "cache hits: %" PRIu64 "\n", counters[STATS_CACHE_HITS]);
+	fprintf(stderr, "excluded: %" PRIu64 "\n", counters[STATS_EXCLUDED]);
+	fprintf(stderr, "skipped as existing: %" PRIu64 "\n", counters[STATS_EXISTING]);
+	fprintf(stderr, "bytes stripped: %" PRIu64 "\n", counters[STATS_STRIPPED]);
+
+	if (syscalls >= 0)
+		fprintf(stderr, "read/write syscalls: %" PRId64 "\n", syscalls);
+
+	if (slowest_nr > 0)
+		fprintf(stderr, "slowest files:\n");
+
+	for (size_t i = 0; i < slowest_nr; i++)
+		fprintf(stderr, "%11.6fs %s\n", (double) slowest[i]->elapsed / 1e9, slowest[i]->src);
+}
+
+void report_json(uint64_t wall, uint64_t cpu, int64_t syscalls)
+{
+	fprintf(stderr, "{\"phases\":{");
+
+	for (size_t i = 0; i < STATS_PHASES; i++)
+		fprintf(stderr, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", (i ? "," : ""),
+		        phase_names[i], (double) phases[i].wall / 1e9, (double) phases[i].cpu / 1e9);
+
+	fprintf(stderr, "},\"total\":{\"wall\":%.6f,\"cpu\":%.6f},",
+	        (double) wall / 1e9, (double) cpu / 1e9);
+
+	fprintf(stderr, "\"files\":%" PRIu64 ",\"bytes\":%" PRIu64 ","
+	        "\"cache_hits\":%" PRIu64 ",\"excluded\":%" PRIu64 ","
+	        "\"skipped_existing\":%" PRIu64 ",\"stripped\":%" PRIu64 ",",
+	        files_nr, files_bytes, counters[STATS_CACHE_HITS],
+	        counters[STATS_EXCLUDED], counters[STATS_EXISTING],
+	        counters[STATS_STRIPPED]);
+
+	if (syscalls >= 0)
+		fprintf(stderr, "\"syscalls\":%" PRId64 ",", syscalls);
+	else
+		fprintf(stderr, "\"syscalls\":null,");
+
+	fprintf(stderr, "\"slowest\":[");
+
+	for (size_t i = 0; i < slowest_nr; i++) {
+		fprintf(stderr, "%s{\"path\":", (i ? "," : ""));
+		print_json_string(slowest[i]->src);
+		fprintf(stderr, ",\"time\":%.6f}", (double) slowest[i]->elapsed / 1e9);
+	}
+
+	fprintf(stderr, "]}\n");
+}
+
+void stats_report(void)
+{
+	struct timespec now;
+	struct rusage usage;
+	uint64_t wall, cpu;
+	int64_t syscalls = -1;
+
+	if (stats_mode == STATS_NONE)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &usage);
+
+	wall = nsec_between(&start_wall, &now);
+	cpu  = timeval_nsec(&usage.ru_utime) + timeval_nsec(&usage.ru_stime) -
+	       timeval_nsec(&start_usage.ru_utime) - timeval_nsec(&start_usage.ru_stime);
+
+	if (start_syscalls >= 0 && (syscalls = read_syscalls()) >= 0)
+		syscalls -= start_syscalls;
+
+	files_nr = files_bytes = 0;
+	slowest_nr = 0;
+
+	tree_walk(collect_file);
+
+	if (stats_mode == STATS_JSON)
+		report_json(wall, cpu, syscalls);
+	else
+		report_text(wall, cpu, syscalls);
+}
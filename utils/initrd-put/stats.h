@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_STATS_H__
+#define __INITRD_PUT_STATS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+enum stats_mode {
+	STATS_NONE = 0,
+	STATS_TEXT,
+	STATS_JSON,
+};
+
+enum stats_phase {
+	STATS_CANONICALIZE = 0,
+	STATS_WALK,
+	STATS_ELF,
+	STATS_RESOLVE,
+	STATS_DEDUP,
+	STATS_COPY,
+	STATS_PERMISSIONS,
+	STATS_PHASES,
+};
+
+enum stats_counter {
+	STATS_CACHE_HITS = 0,
+	STATS_EXCLUDED,
+	STATS_EXISTING,
+	STATS_STRIPPED,
+	STATS_COUNTERS,
+};
+
+struct stats_timer {
+	struct timespec wall;
+	struct timespec cpu;
+};
+
+void stats_begin(enum stats_mode mode);
+void stats_start(struct stats_timer *t) __attribute__((__nonnull__ (1)));
+uint64_t stats_elapsed(const struct stats_timer *t) __attribute__((__nonnull__ (1)));
+void stats_stop(struct stats_timer *t, enum stats_phase phase) __attribute__((__nonnull__ (1)));
+void stats_count(enum stats_counter counter);
+void stats_add(enum stats_counter counter, uint64_t value);
+void stats_report(void);
+
+#endif // __INITRD_PUT_STATS_H__
@@ -0,0 +1,357 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <err.h>
+
+#include <libelf.h>
+#include <gelf.h>
+
+#include "memory.h"
+#include "stats.h"
+#include "strip.h"
+
+/*
+ * Writes a copy of an executable or a shared library without the sections
+ * that are not needed at runtime. The sections that are loaded into memory
+ * keep their offsets, only the sections that follow them are moved, so the
+ * program headers stay valid. Relocatable files, which includes the kernel
+ * modules, and signed files are never touched because a change would make
+ * them unusable.
+ */
+#define MODULE_SIG_STRING "~Module signature appended~\n"
+
+extern int verbose;
+
+static size_t stripped_nr = 0;
+static uint64_t stripped_bytes = 0;
+
+static bool is_signed(const char *filename, int fd, off_t size) __attribute__((__nonnull__ (1)));
+static bool is_debug_section(const char *name) __attribute__((__nonnull__ (1)));
+static bool is_unneeded_section(const GElf_Shdr *shdr, const char *name) __attribute__((__nonnull__ (1, 2)));
+static uint64_t align_to(uint64_t off, uint64_t align);
+static bool keeps_indexes(Elf *elf, const bool *removed, size_t shnum) __attribute__((__nonnull__ (1, 2)));
+static int write_stripped(Elf *elf, const GElf_Ehdr *ehdr, int dfd, const bool *removed, size_t shnum) __attribute__((__nonnull__ (1, 2, 4)));
+
+bool is_signed(const char *filename, int fd, off_t size)
+{
+	char buf[sizeof(MODULE_SIG_STRING) - 1];
+
+	if (size > (off_t) sizeof(buf) &&
+	    pread(fd, buf, sizeof(buf), size - (off_t) sizeof(buf)) == (ssize_t) sizeof(buf) &&
+	    !memcmp(buf, MODULE_SIG_STRING, sizeof(buf)))
+		return true;
+
+	/* IMA and EVM signatures cover the content of the file. */
+	if (fgetxattr(fd, "security.ima", NULL, 0) >= 0 ||
+	    fgetxattr(fd, "security.evm", NULL, 0) >= 0) {
+		if (verbose > 2)
+			warnx("'%s' has a signature, do not strip it", filename);
+		return true;
+	}
+
+	return false;
+}
+
+bool is_debug_section(const char *name)
+{
+	return (!strncmp(name, ".debug", 6) ||
+	        !strncmp(name, ".zdebug", 7) ||
+	        !strncmp(name, ".gnu.debuglto_", 14) ||
+	        !strncmp(name, ".stab", 5) ||
+	        !strcmp(name, ".gdb_index") ||
+	        !strcmp(name, ".line"));
+}
+
+bool is_unneeded_section(const GElf_Shdr *shdr, const char *name)
+{
+	/* The string tables that are still in use are kept, see below. */
+	return (shdr->sh_type == SHT_SYMTAB ||
+	        shdr->sh_type == SHT_STRTAB ||
+	        !strcmp(name, ".comment"));
+}
+
+uint64_t align_to(uint64_t off, uint64_t align)
+{
+	if (align <= 1)
+		return off;
+	return (off + align - 1) & ~(align - 1);
+}
+
+/*
+ * The symbols refer to the sections by index, so the sections they use must
+ * not be renumbered.
+ */
+bool keeps_indexes(Elf *elf, const bool *removed, size_t shnum)
+{
+	size_t first = 1;
+	GElf_Shdr shdr;
+	GElf_Sym sym;
+
+	while (first < shnum && !removed[first])
+		first++;
+
+	for (size_t i = first; i < shnum; i++) {
+		Elf_Data *data = NULL;
+		Elf_Scn *scn = elf_getscn(elf, i);
+
+		if (removed[i])
+			continue;
+
+		if (!gelf_getshdr(scn, &shdr) || (shdr.sh_flags & SHF_ALLOC))
+			return false;
+
+		if (shdr.sh_type != SHT_SYMTAB || !shdr.sh_entsize)
+			continue;
+
+		while ((data = elf_getdata(scn, data)) != NULL) {
+			for (size_t n = 0; n < data->d_size / shdr.sh_entsize; n++) {
+				if (!gelf_getsym(data, (int) n, &sym))
+					return false;
+				if (sym.st_shndx >= first && sym.st_shndx < SHN_LORESERVE)
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+int write_stripped(Elf *elf, const GElf_Ehdr *ehdr, int dfd, const bool *removed, size_t shnum)
+{
+	size_t *index = xcalloc(shnum, sizeof(size_t));
+	GElf_Ehdr new_ehdr = *ehdr;
+	GElf_Shdr shdr;
+	GElf_Phdr phdr;
+	uint64_t end, off;
+	size_t phnum, n = 1;
+	int ret = -1;
+	Elf *out;
+
+	for (size_t i = 1; i < shnum; i++) {
+		if (!removed[i])
+			index[i] = n++;
+	}
+
+	if (elf_getphdrnum(elf, &phnum) < 0)
+		goto end;
+
+	if (!(out = elf_begin(dfd, ELF_C_WRITE, NULL)))
+		goto end;
+
+	if (!gelf_newehdr(out, gelf_getclass(elf)))
+		goto fail;
+
+	if (phnum > 0 && !gelf_newphdr(out, phnum))
+		goto fail;
+
+	/*
+	 * Everything up to the end of the last loaded section or segment stays
+	 * in place.
+	 */
+	end = ehdr->e_phoff + phnum * ehdr->e_phentsize;
+
+	for (size_t i = 0; i < phnum; i++) {
+		if (!gelf_getphdr(elf, (int) i, &phdr) || !gelf_update_phdr(out, (int) i, &phdr))
+			goto fail;
+		if (end < phdr.p_offset + phdr.p_filesz)
+			end = phdr.p_offset + phdr.p_filesz;
+	}
+
+	for (size_t i = 1; i < shnum; i++) {
+		if (removed[i] || !gelf_getshdr(elf_getscn(elf, i), &shdr))
+			continue;
+		if ((shdr.sh_flags & SHF_ALLOC) && shdr.sh_type != SHT_NOBITS &&
+		    end < shdr.sh_offset + shdr.sh_size)
+			end = shdr.sh_offset + shdr.sh_size;
+	}
+
+	off = end;
+
+	for (size_t i = 1; i < shnum; i++) {
+		Elf_Scn *scn, *new_scn;
+		Elf_Data *data, *new_data;
+
+		if (removed[i])
+			continue;
+
+		scn = elf_getscn(elf, i);
+
+		if (!gelf_getshdr(scn, &shdr) || !(new_scn = elf_newscn(out)))
+			goto fail;
+
+		if (!(shdr.sh_flags & SHF_ALLOC) && shdr.sh_offset >= end) {
+			shdr.sh_offset = align_to(off, shdr.sh_addralign);
+			if (shdr.sh_type != SHT_NOBITS)
+				off = shdr.sh_offset + shdr.sh_size;
+		}
+
+		if (shdr.sh_link > 0 && shdr.sh_link < shnum)
+			shdr.sh_link = (Elf64_Word) index[shdr.sh_link];
+
+		if ((shdr.sh_flags & SHF_INFO_LINK) && shdr.sh_info > 0 && shdr.sh_info < shnum)
+			shdr.sh_info = (Elf64_Word) index[shdr.sh_info];
+
+		if (!gelf_update_shdr(new_scn, &shdr))
+			goto fail;
+
+		for (data = NULL; (data = elf_rawdata(scn, data)) != NULL;) {
+			if (!(new_data = elf_newdata(new_scn)))
+				goto fail;
+			*new_data = *data;
+		}
+	}
+
+	new_ehdr.e_shoff = align_to(off, (gelf_getclass(elf) == ELFCLASS64) ? 8 : 4);
+	new_ehdr.e_shnum = (Elf64_Half) n;
+	new_ehdr.e_shstrndx = (Elf64_Half) index[ehdr->e_shstrndx];
+
+	if (!gelf_update_ehdr(out, &new_ehdr))
+		goto fail;
+
+	elf_flagelf(out, ELF_C_SET, ELF_F_LAYOUT);
+
+	if (elf_update(out, ELF_C_WRITE) < 0)
+		goto fail;
+
+	ret = 0;
+fail:
+	elf_end(out);
+end:
+	free(index);
+	return ret;
+}
+
+/*
+ * Returns false if there is nothing to strip and the file has to be copied
+ * as it is.
+ */
+bool strip_file(const char *filename, int sfd, int dfd, enum strip_mode mode)
+{
+	GElf_Ehdr ehdr;
+	GElf_Shdr shdr;
+	struct stat sb;
+	size_t shnum, shstrndx;
+	uint64_t extent, removed_size = 0;
+	bool *removed = NULL;
+	bool changed, ret = false;
+	Elf *elf;
+
+	if (mode == STRIP_NONE)
+		return false;
+
+	if (fstat(sfd, &sb) < 0)
+		err(EX_NOINPUT, "fstat: %s", filename);
+
+	if (!(elf = elf_begin(sfd, ELF_C_READ_MMAP, NULL)))
+		return false;
+
+	if (elf_kind(elf) != ELF_K_ELF || !gelf_getehdr(elf, &ehdr) ||
+	    (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN) ||
+	    elf_getshdrnum(elf, &shnum) < 0 || elf_getshdrstrndx(elf, &shstrndx) < 0)
+		goto end;
+
+	/* Extended section numbering is not worth the trouble. */
+	if (shnum < 2 || shnum >= SHN_LORESERVE || shstrndx != ehdr.e_shstrndx)
+		goto end;
+
+	if (is_signed(filename, sfd, sb.st_size))
+		goto end;
+
+	removed = xcalloc(shnum, sizeof(bool));
+	extent = ehdr.e_shoff + shnum * ehdr.e_shentsize;
+
+	for (size_t i = 1; i < shnum; i++) {
+		const char *name;
+
+		if (!gelf_getshdr(elf_getscn(elf, i), &shdr) ||
+		    !(name = elf_strptr(elf, shstrndx, shdr.sh_name)))
+			goto end;
+
+		if (shdr.sh_type != SHT_NOBITS && extent < shdr.sh_offset + shdr.sh_size)
+			extent = shdr.sh_offset + shdr.sh_size;
+
+		if ((shdr.sh_flags & SHF_ALLOC) || i == shstrndx)
+			continue;
+
+		removed[i] = is_debug_section(name) ||
+		             (mode == STRIP_UNNEEDED && is_unneeded_section(&shdr, name));
+	}
+
+	/* Something is appended to the file, it is better to leave it alone. */
+	if (extent < (uint64_t) sb.st_size)
+		goto end;
+
+	/*
+	 * A section that is referenced by the one that stays has to stay too,
+	 * and the relocations of a removed section go away with it. A loaded
+	 * section may only refer to the symbol table for the tools, the link is
+	 * dropped in that case like strip(1) does.
+	 */
+	do {
+		changed = false;
+
+		for (size_t i = 1; i < shnum; i++) {
+			if (!gelf_getshdr(elf_getscn(elf, i), &shdr))
+				goto end;
+
+			if (!removed[i] && !(shdr.sh_flags & SHF_ALLOC) &&
+			    shdr.sh_link > 0 && shdr.sh_link < shnum && removed[shdr.sh_link]) {
+				removed[shdr.sh_link] = false;
+				changed = true;
+			}
+
+			if (!removed[i] && !(shdr.sh_flags & SHF_ALLOC) &&
+			    (shdr.sh_type == SHT_REL || shdr.sh_type == SHT_RELA) &&
+			    shdr.sh_info > 0 && shdr.sh_info < shnum && removed[shdr.sh_info]) {
+				removed[i] = true;
+				changed = true;
+			}
+		}
+	} while (changed);
+
+	for (size_t i = 1; i < shnum; i++) {
+		if (removed[i] && gelf_getshdr(elf_getscn(elf, i), &shdr) && shdr.sh_type != SHT_NOBITS)
+			removed_size += shdr.sh_size;
+	}
+
+	if (!removed_size || !keeps_indexes(elf, removed, shnum))
+		goto end;
+
+	if (write_stripped(elf, &ehdr, dfd, removed, shnum) < 0)
+		errx(EX_IOERR, "unable to strip %s: %s", filename, elf_errmsg(-1));
+
+	off_t size = lseek(dfd, 0, SEEK_END);
+
+	if (size > 0 && size < sb.st_size) {
+		__atomic_add_fetch(&stripped_bytes, (uint64_t)(sb.st_size - size), __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stripped_nr, 1, __ATOMIC_RELAXED);
+		stats_add(STATS_STRIPPED, (uint64_t)(sb.st_size - size));
+	}
+
+	if (verbose > 2)
+		warnx("'%s' is stripped from %jd to %jd bytes", filename,
+		      (intmax_t) sb.st_size, (intmax_t) size);
+
+	ret = true;
+end:
+	free(removed);
+	elf_end(elf);
+	return ret;
+}
+
+void strip_report(void)
+{
+	if (verbose)
+		warnx("%zu files stripped, %ju bytes saved", stripped_nr, (uintmax_t) stripped_bytes);
+
+	stripped_nr = 0;
+	stripped_bytes = 0;
+}
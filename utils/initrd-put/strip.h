@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_STRIP_H__
+#define __INITRD_PUT_STRIP_H__
+
+#include <stdbool.h>
+
+enum strip_mode {
+	STRIP_NONE = 0,
+	STRIP_DEBUG,
+	STRIP_UNNEEDED,
+};
+
+bool strip_file(const char *filename, int sfd, int dfd, enum strip_mode mode) __attribute__((__nonnull__ (1)));
+void strip_report(void);
+
+#endif // __INITRD_PUT_STRIP_H__
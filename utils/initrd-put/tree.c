@@ -3,91 +3,230 @@
 
 #include <unistd.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
-#include <search.h>
 #include <sysexits.h>
 #include <err.h>
+#include <pthread.h>
 
-#include "config.h"
+#include "memory.h"
+#include "hash.h"
 #include "queue.h"
 #include "tree.h"
 
-static void *files = NULL;
-
+/*
+ * All paths are interned: each distinct path is stored once in an arena and
+ * the file that has been added for it is kept next to it in an open
+ * addressing hash table (linear probing). The same table answers whether
+ * a path has been added and gives the string for a new queue item.
+ */
+#define ARENA_CHUNK (64 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct slot {
+	struct hashtab_entry entry;
+	struct file *file;
+};
+
+static struct arena_chunk *arena = NULL;
+
+static struct hashtab slots = HASHTAB_INIT(struct slot, 4096);
+
+/*
+ * Files of the current generation sorted by path. It is rebuilt if a file
+ * has been added or a new generation has been started since.
+ */
+static struct file **sorted = NULL;
+static size_t sorted_nr = 0;
+static size_t sorted_files_nr = 0;
+static unsigned long sorted_generation = 0;
+static size_t files_nr = 0;
+
+/*
+ * Batch mode starts a new generation for each request, so a request only
+ * sees the files that it has added itself. A file of a previous generation
+ * may have been removed from the destdir since, so it is not known as added
+ * anymore and a request that finds it again takes its place. The files that
+ * are still in the destdir do not get here (see manifest.c).
+ */
+static unsigned long generation = 0;
+
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *arena_strndup(const char *str, size_t len) __attribute__((__nonnull__ (1)));
+static struct slot *find_slot(const char *path) __attribute__((__nonnull__ (1)));
+static struct slot *intern(const char *path, size_t len) __attribute__((__nonnull__ (1)));
 static int compare(const void *a, const void *b) __attribute__((__nonnull__ (1, 2)));
-static void walk_action(const void *nodep, VISIT which, void *closure) __attribute__((__nonnull__ (1, 3)));;
 
-int compare(const void *a, const void *b)
+char *arena_strndup(const char *str, size_t len)
+{
+	char *ret;
+
+	if (!arena || arena->size - arena->used < len + 1) {
+		size_t size = (len + 1 > ARENA_CHUNK) ? len + 1 : ARENA_CHUNK;
+		struct arena_chunk *chunk = xcalloc(1, sizeof(*chunk) + size);
+
+		chunk->size = size;
+		chunk->next = arena;
+		arena = chunk;
+	}
+
+	ret = arena->data + arena->used;
+	arena->used += len + 1;
+
+	memcpy(ret, str, len);
+	ret[len] = '\0';
+
+	return ret;
+}
+
+struct slot *find_slot(const char *path)
+{
+	size_t len = strlen(path);
+
+	return hashtab_find(&slots, path, len, hash_path(path, len));
+}
+
+struct slot *intern(const char *path, size_t len)
+{
+	struct slot *slot = hashtab_add(&slots, path, len, hash_path(path, len));
+
+	if (!slot->entry.key)
+		slot->entry.key = arena_strndup(path, len);
+
+	return slot;
+}
+
+char *tree_intern(const char *path, size_t len)
 {
-	return strcmp(((struct file *)a)->src, ((struct file *)b)->src);
+	char *ret;
+
+	pthread_mutex_lock(&files_lock);
+	ret = (char *) intern(path, len)->entry.key;
+	pthread_mutex_unlock(&files_lock);
+
+	return ret;
 }
 
 bool is_path_added(const char *path)
 {
-	struct file v = { 0 };
-	v.src = (char *) path;
-	return tfind(&v, &files, compare) != NULL;
+	struct slot *slot;
+	bool ret;
+
+	pthread_mutex_lock(&files_lock);
+	ret = (slot = find_slot(path)) != NULL && slot->file != NULL &&
+	      slot->file->generation == generation;
+	pthread_mutex_unlock(&files_lock);
+
+	return ret;
 }
 
 bool tree_add_file(struct file *file)
 {
-	void *ptr = tsearch(file, &files, compare);
+	struct slot *slot;
+	bool ret = false;
 
-	if (!ptr)
-		err(EX_OSERR, "tsearch");
+	pthread_mutex_lock(&files_lock);
 
-	return ((*(struct file **)ptr) == file);
+	slot = intern(file->src, strlen(file->src));
+
+	if (!slot->file || slot->file->generation != generation) {
+		if (slot->file)
+			free_file(slot->file);
+		else
+			files_nr++;
+
+		file->generation = generation;
+		slot->file = file;
+		ret = true;
+	}
+
+	pthread_mutex_unlock(&files_lock);
+
+	return ret;
 }
 
-void tree_destroy(void)
+/*
+ * The same path can be queued several times with and without the request to
+ * add it recursively. Returns true if the request came too late and the
+ * caller has to take care of the directory content.
+ */
+bool tree_set_recursive(const char *path)
 {
-#ifdef HAVE_TDESTROY
-	tdestroy(files, free_file);
-#endif
+	struct slot *slot;
+	bool ret = false;
+
+	pthread_mutex_lock(&files_lock);
+	if ((slot = find_slot(path)) != NULL && slot->file)
+		ret = !__atomic_exchange_n(&slot->file->recursive, true, __ATOMIC_ACQ_REL);
+	pthread_mutex_unlock(&files_lock);
+
+	return ret;
 }
 
-void walk_action(const void *nodep, VISIT which, void *closure)
+void tree_destroy(void)
 {
-	struct file *p;
-	void (*file_handler)(struct file *p) = closure;
-
-	switch (which) {
-		case preorder:
-			break;
-		case postorder:
-			p = *(struct file **) nodep;
-			file_handler(p);
-			break;
-		case endorder:
-			break;
-		case leaf:
-			p = *(struct file **) nodep;
-			file_handler(p);
-			break;
+	for (size_t i = 0; i < slots.size; i++) {
+		struct slot *slot = hashtab_at(&slots, i);
+
+		if (slot->file)
+			free_file(slot->file);
 	}
-}
 
-#ifndef HAVE_TWALK_R
-static void *twalk_r_closure;
-static void (*twalk_r_action)(const void *nodep, VISIT which, void *closure);
+	while (arena) {
+		struct arena_chunk *next = arena->next;
+		free(arena);
+		arena = next;
+	}
+
+	hashtab_free(&slots);
+	free(sorted);
+
+	sorted = NULL;
+	sorted_nr = sorted_files_nr = files_nr = 0;
+}
 
-static void twalk_handler(const void *nodep, VISIT which,
-                          int depth __attribute__((unused)))
+void tree_new_generation(void)
 {
-	twalk_r_action(nodep, which, twalk_r_closure);
+	pthread_mutex_lock(&files_lock);
+	generation++;
+	pthread_mutex_unlock(&files_lock);
 }
 
-static void twalk_r(const void *root,
-                    void (*action)(const void *nodep, VISIT which, void *closure),
-                    void *closure)
+int compare(const void *a, const void *b)
 {
-	twalk_r_action  = action;
-	twalk_r_closure = closure;
-	twalk(root, twalk_handler);
+	return strcmp((*(struct file * const *) a)->src, (*(struct file * const *) b)->src);
 }
-#endif
 
 void tree_walk(void (*handler)(struct file *))
 {
-	twalk_r(files, walk_action, handler);
+	pthread_mutex_lock(&files_lock);
+
+	if (sorted_files_nr != files_nr || sorted_generation != generation) {
+		sorted = xrealloc(sorted, files_nr + 1, sizeof(struct file *));
+		sorted_nr = 0;
+
+		for (size_t i = 0; i < slots.size; i++) {
+			struct slot *slot = hashtab_at(&slots, i);
+
+			if (slot->file && slot->file->generation == generation)
+				sorted[sorted_nr++] = slot->file;
+		}
+
+		sorted_files_nr = files_nr;
+		sorted_generation = generation;
+
+		qsort(sorted, sorted_nr, sizeof(struct file *), compare);
+	}
+
+	for (size_t i = 0; i < sorted_nr; i++)
+		handler(sorted[i]);
+
+	pthread_mutex_unlock(&files_lock);
 }
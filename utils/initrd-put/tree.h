@@ -4,9 +4,12 @@
 
 #include "queue.h"
 
+char *tree_intern(const char *path, size_t len) __attribute__((__nonnull__ (1)));
 bool is_path_added(const char *path) __attribute__((__nonnull__ (1)));
 bool tree_add_file(struct file *file) __attribute__((__nonnull__ (1)));
+bool tree_set_recursive(const char *path) __attribute__((__nonnull__ (1)));
 void tree_walk(void (*handler)(struct file *)) __attribute__((__nonnull__ (1)));
+void tree_new_generation(void);
 void tree_destroy(void);
 
 #endif // __INITRD_PUT_TREE_H__
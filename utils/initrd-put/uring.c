@@ -0,0 +1,489 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+#include <linux/io_uring.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#include "memory.h"
+#include "uring.h"
+
+/*
+ * The size of the submission queue. It also limits the size of the biggest
+ * file that can be copied in one chain of splices.
+ */
+#define URING_ENTRIES 256
+
+/*
+ * Splice needs a pipe between two files. Chains of splices that run at the
+ * same time must not share a pipe.
+ */
+#define URING_PIPES 8
+
+enum uring_op {
+	OP_OPEN_SRC = 0,
+	OP_OPEN_DST,
+	OP_SPLICE_IN,
+	OP_SPLICE_OUT,
+	OP_CLOSE,
+};
+
+#define URING_DATA(idx, op) (((uint64_t)(idx) << 3) | (op))
+#define URING_DATA_IDX(data) ((size_t)((data) >> 3))
+#define URING_DATA_OP(data) ((enum uring_op)((data) & 7))
+
+struct uring {
+	int fd;
+
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned to_submit;
+	unsigned inflight;
+
+	int pipes[URING_PIPES][2];
+	size_t pipe_size;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) __attribute__((__nonnull__ (2)));
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags);
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args);
+static bool probe_ops(struct uring *ring) __attribute__((__nonnull__ (1)));
+static bool open_pipe(struct uring *ring, size_t i) __attribute__((__nonnull__ (1)));
+static unsigned sq_space(struct uring *ring) __attribute__((__nonnull__ (1)));
+static struct io_uring_sqe *get_sqe(struct uring *ring, uint64_t data) __attribute__((__nonnull__ (1)));
+static void submit_and_reap(struct uring *ring, struct uring_copy *reqs) __attribute__((__nonnull__ (1, 2)));
+static void complete(struct uring_copy *reqs, struct io_uring_cqe *cqe) __attribute__((__nonnull__ (1, 2)));
+static void set_error(struct uring_copy *req, enum uring_copy_stage stage, int error) __attribute__((__nonnull__ (1)));
+static void prep_splice(struct io_uring_sqe *sqe, int fd_in, uint64_t off_in, int fd_out, uint64_t off_out, unsigned len) __attribute__((__nonnull__ (1)));
+static size_t copy_data(struct uring *ring, struct uring_copy *reqs, size_t nr, size_t start) __attribute__((__nonnull__ (1, 2)));
+
+int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool probe_ops(struct uring *ring)
+{
+	static const unsigned char ops[] = { IORING_OP_OPENAT, IORING_OP_SPLICE, IORING_OP_CLOSE };
+	struct io_uring_probe *probe;
+	bool ret = true;
+
+	probe = xcalloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		free(probe);
+		return false;
+	}
+
+	for (size_t i = 0; i < sizeof(ops); i++) {
+		if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			ret = false;
+			break;
+		}
+	}
+
+	free(probe);
+	return ret;
+}
+
+bool open_pipe(struct uring *ring, size_t i)
+{
+	if (pipe2(ring->pipes[i], O_CLOEXEC) < 0)
+		return false;
+
+	int size = fcntl(ring->pipes[i][1], F_SETPIPE_SZ, 1024 * 1024);
+
+	if (size < 0)
+		size = fcntl(ring->pipes[i][1], F_GETPIPE_SZ);
+
+	if (size > 0 && (!ring->pipe_size || (size_t) size < ring->pipe_size))
+		ring->pipe_size = (size_t) size;
+
+	return ring->pipe_size > 0;
+}
+
+/*
+ * Returns NULL if the kernel does not support io_uring or some of the
+ * operations we need. The caller is expected to fall back to the usual
+ * system calls in this case.
+ */
+struct uring *uring_open(void)
+{
+	struct io_uring_params p;
+	struct uring *ring;
+
+	ring = xcalloc(1, sizeof(*ring));
+
+	for (size_t i = 0; i < URING_PIPES; i++)
+		ring->pipes[i][0] = ring->pipes[i][1] = -1;
+
+	memset(&p, 0, sizeof(p));
+
+	if ((ring->fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = 0;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		goto fail;
+	}
+
+	if (ring->cq_size) {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+		                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			goto fail;
+		}
+	} else {
+		ring->cq_ptr = ring->sq_ptr;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	ring->sq_head    = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail    = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask    = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array   = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+
+	ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+
+	if (!probe_ops(ring))
+		goto fail;
+
+	for (size_t i = 0; i < URING_PIPES; i++) {
+		if (!open_pipe(ring, i))
+			goto fail;
+	}
+
+	return ring;
+fail:
+	uring_close(ring);
+	return NULL;
+}
+
+void uring_close(struct uring *ring)
+{
+	for (size_t i = 0; i < URING_PIPES; i++) {
+		if (ring->pipes[i][0] >= 0)
+			close(ring->pipes[i][0]);
+		if (ring->pipes[i][1] >= 0)
+			close(ring->pipes[i][1]);
+	}
+
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+
+	close(ring->fd);
+	free(ring);
+}
+
+unsigned sq_space(struct uring *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail + ring->to_submit;
+
+	return ring->sq_entries - (tail - head);
+}
+
+struct io_uring_sqe *get_sqe(struct uring *ring, uint64_t data)
+{
+	unsigned tail = *ring->sq_tail + ring->to_submit;
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = data;
+
+	ring->sq_array[idx] = idx;
+	ring->to_submit++;
+
+	return sqe;
+}
+
+void set_error(struct uring_copy *req, enum uring_copy_stage stage, int error)
+{
+	if (req->stage != URING_COPY_DONE)
+		return;
+	req->stage = stage;
+	req->error = error;
+}
+
+void complete(struct uring_copy *reqs, struct io_uring_cqe *cqe)
+{
+	struct uring_copy *req = &reqs[URING_DATA_IDX(cqe->user_data)];
+
+	switch (URING_DATA_OP(cqe->user_data)) {
+		case OP_OPEN_SRC:
+			if (cqe->res < 0)
+				set_error(req, URING_COPY_OPEN_SRC, -cqe->res);
+			else
+				req->sfd = cqe->res;
+			break;
+		case OP_OPEN_DST:
+			/* Cancelled because the source could not be opened. */
+			if (cqe->res == -ECANCELED)
+				break;
+			if (cqe->res < 0)
+				set_error(req, URING_COPY_OPEN_DST, -cqe->res);
+			else
+				req->dfd = cqe->res;
+			break;
+		case OP_SPLICE_IN:
+			if (cqe->res < 0)
+				set_error(req, URING_COPY_DATA, -cqe->res);
+			break;
+		case OP_SPLICE_OUT:
+			if (cqe->res < 0)
+				set_error(req, URING_COPY_DATA, -cqe->res);
+			else
+				req->copied += cqe->res;
+			break;
+		case OP_CLOSE:
+			if (cqe->res < 0)
+				set_error(req, URING_COPY_DATA, -cqe->res);
+			break;
+	}
+}
+
+void submit_and_reap(struct uring *ring, struct uring_copy *reqs)
+{
+	while (ring->to_submit || ring->inflight) {
+		unsigned to_submit = ring->to_submit;
+		int ret;
+
+		__atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+
+		ret = sys_io_uring_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+		if (ret < 0) {
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				err(EXIT_FAILURE, "io_uring_enter");
+			ret = 0;
+		}
+
+		/* Everything we did not manage to submit is still in the ring. */
+		__atomic_store_n(ring->sq_tail, *ring->sq_tail - (to_submit - (unsigned) ret), __ATOMIC_RELEASE);
+		ring->to_submit -= (unsigned) ret;
+		ring->inflight  += (unsigned) ret;
+
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			complete(reqs, &ring->cqes[head & *ring->cq_mask]);
+			ring->inflight--;
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+void prep_splice(struct io_uring_sqe *sqe, int fd_in, uint64_t off_in, int fd_out, uint64_t off_out, unsigned len)
+{
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->fd = fd_out;
+	sqe->off = off_out;
+	sqe->splice_fd_in = fd_in;
+	sqe->splice_off_in = off_in;
+	sqe->len = len;
+}
+
+/*
+ * Copies the content of up to URING_PIPES files starting from the start one.
+ * Every file is copied by a chain of splices through its own pipe. Returns
+ * the index of the first file that has not been processed.
+ */
+size_t copy_data(struct uring *ring, struct uring_copy *reqs, size_t nr, size_t start)
+{
+	size_t users[URING_PIPES];
+	size_t npipe = 0;
+	size_t i;
+
+	for (i = start; i < nr && npipe < URING_PIPES; i++) {
+		struct uring_copy *req = &reqs[i];
+
+		if (req->stage != URING_COPY_DONE || req->size <= 0)
+			continue;
+
+		size_t chunks = ((size_t) req->size + ring->pipe_size - 1) / ring->pipe_size;
+
+		if (chunks * 2 > ring->sq_entries) {
+			set_error(req, URING_COPY_DATA, EFBIG);
+			continue;
+		}
+
+		if (chunks * 2 > sq_space(ring))
+			break;
+
+		int *fds = ring->pipes[npipe];
+		off_t off = 0;
+
+		for (size_t n = 0; n < chunks; n++) {
+			unsigned len = (unsigned) ((size_t)(req->size - off) < ring->pipe_size
+			                           ? (size_t)(req->size - off)
+			                           : ring->pipe_size);
+			struct io_uring_sqe *sqe;
+
+			sqe = get_sqe(ring, URING_DATA(i, OP_SPLICE_IN));
+			prep_splice(sqe, req->sfd, (uint64_t) off, fds[1], (uint64_t) -1, len);
+			sqe->flags |= IOSQE_IO_LINK;
+
+			sqe = get_sqe(ring, URING_DATA(i, OP_SPLICE_OUT));
+			prep_splice(sqe, fds[0], (uint64_t) -1, req->dfd, (uint64_t) off, len);
+			if (n + 1 < chunks)
+				sqe->flags |= IOSQE_IO_LINK;
+
+			off += len;
+		}
+
+		users[npipe++] = i;
+	}
+
+	submit_and_reap(ring, reqs);
+
+	for (size_t k = 0; k < npipe; k++) {
+		struct uring_copy *req = &reqs[users[k]];
+
+		if (req->stage == URING_COPY_DONE && req->copied == req->size)
+			continue;
+
+		set_error(req, URING_COPY_DATA, EIO);
+
+		/*
+		 * The chain has broken, so there may be data left in the pipe.
+		 * It is easier to replace the pipe than to drain it.
+		 */
+		close(ring->pipes[k][0]);
+		close(ring->pipes[k][1]);
+
+		if (!open_pipe(ring, k))
+			err(EXIT_FAILURE, "pipe");
+	}
+
+	return i;
+}
+
+/*
+ * Copies the files in three rounds: open all of them, copy the content and
+ * close all descriptors. Each round is a few io_uring_enter calls for the
+ * whole batch. The result of each copy is in its stage and error fields.
+ */
+void uring_copy_files(struct uring *ring, struct uring_copy *reqs, size_t nr)
+{
+	struct io_uring_sqe *sqe;
+
+	for (size_t i = 0; i < nr; i++) {
+		reqs[i].stage = URING_COPY_DONE;
+		reqs[i].error = 0;
+		reqs[i].sfd = reqs[i].dfd = -1;
+		reqs[i].copied = 0;
+
+		if (sq_space(ring) < 2)
+			submit_and_reap(ring, reqs);
+
+		/* There is no need to create the destination if the source is unreadable. */
+		sqe = get_sqe(ring, URING_DATA(i, OP_OPEN_SRC));
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t) (uintptr_t) reqs[i].src;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		sqe->flags |= IOSQE_IO_LINK;
+
+		sqe = get_sqe(ring, URING_DATA(i, OP_OPEN_DST));
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = reqs[i].dst_dirfd;
+		sqe->addr = (uint64_t) (uintptr_t) reqs[i].dst;
+		sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+		sqe->len = reqs[i].mode;
+	}
+
+	submit_and_reap(ring, reqs);
+
+	for (size_t i = 0; i < nr;)
+		i = copy_data(ring, reqs, nr, i);
+
+	for (size_t i = 0; i < nr; i++) {
+		int fds[2] = { reqs[i].sfd, reqs[i].dfd };
+
+		for (size_t k = 0; k < 2; k++) {
+			if (fds[k] < 0)
+				continue;
+
+			if (!sq_space(ring))
+				submit_and_reap(ring, reqs);
+
+			sqe = get_sqe(ring, URING_DATA(i, OP_CLOSE));
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = fds[k];
+		}
+	}
+
+	submit_and_reap(ring, reqs);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
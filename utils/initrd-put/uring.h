@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_URING_H__
+#define __INITRD_PUT_URING_H__
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+enum uring_copy_stage {
+	URING_COPY_DONE = 0,
+	URING_COPY_OPEN_SRC,
+	URING_COPY_OPEN_DST,
+	URING_COPY_DATA,
+};
+
+struct uring_copy {
+	const char *src;
+	int dst_dirfd;
+	const char *dst;	/* relative to dst_dirfd */
+	mode_t mode;
+	off_t size;
+
+	/* The stage at which the copy failed and the errno. */
+	enum uring_copy_stage stage;
+	int error;
+
+	/* Private. */
+	int sfd;
+	int dfd;
+	off_t copied;
+};
+
+struct uring;
+
+#ifdef HAVE_LINUX_IO_URING_H
+struct uring *uring_open(void);
+void uring_close(struct uring *ring) __attribute__((__nonnull__ (1)));
+void uring_copy_files(struct uring *ring, struct uring_copy *reqs, size_t nr) __attribute__((__nonnull__ (1, 2)));
+#else
+static inline struct uring *uring_open(void)
+{
+	return NULL;
+}
+
+static inline void uring_close(struct uring *ring __attribute__((unused)))
+{
+}
+
+static inline void uring_copy_files(struct uring *ring __attribute__((unused)),
+                                    struct uring_copy *reqs __attribute__((unused)),
+                                    size_t nr __attribute__((unused)))
+{
+}
+#endif
+
+#endif // __INITRD_PUT_URING_H__
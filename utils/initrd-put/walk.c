@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <err.h>
+
+#include "memory.h"
+#include "queue.h"
+#include "tree.h"
+#include "walk.h"
+
+/*
+ * Adds the content of a directory to the queue. The directories are read
+ * with getdents64(2) relative to the parent descriptor and the type of an
+ * entry is taken from d_type, so nothing is stat'ed here unless the
+ * filesystem does not report the type. The rest of the file information is
+ * obtained by the discovery threads in parallel.
+ */
+#define WALK_BATCH  64
+#define WALK_BUFSIZ (32 * 1024)
+#define STATX_MASK  (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_INO | STATX_SIZE | STATX_MTIME)
+
+struct walk {
+	char path[PATH_MAX];
+	struct file *batch[WALK_BATCH];
+	size_t nr;
+};
+
+extern int verbose;
+
+static void walk_flush(struct walk *w) __attribute__((__nonnull__ (1)));
+static void walk_add(struct walk *w, size_t len) __attribute__((__nonnull__ (1)));
+static unsigned char entry_type(int dirfd, const struct dirent64 *d, const char *path) __attribute__((__nonnull__ (2, 3)));
+static void walk_dir(struct walk *w, int dirfd, size_t len) __attribute__((__nonnull__ (1)));
+
+void walk_flush(struct walk *w)
+{
+	if (!w->nr)
+		return;
+
+	enqueue_files(w->batch, w->nr);
+	w->nr = 0;
+}
+
+void walk_add(struct walk *w, size_t len)
+{
+	struct file *p;
+
+	if (is_path_added(w->path))
+		return;
+
+	if (!(p = new_file(w->path, (ssize_t) len, NULL, false)))
+		return;
+
+	w->batch[w->nr++] = p;
+
+	if (w->nr == WALK_BATCH)
+		walk_flush(w);
+}
+
+unsigned char entry_type(int dirfd, const struct dirent64 *d, const char *path)
+{
+	struct statx stx;
+
+	if (d->d_type != DT_UNKNOWN)
+		return d->d_type;
+
+	if (statx(dirfd, d->d_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE, &stx) < 0) {
+		warn("statx: %s", path);
+		return DT_UNKNOWN;
+	}
+
+	return (unsigned char) IFTODT(stx.stx_mode);
+}
+
+/*
+ * The path of the directory is in the buffer, len is its length.
+ */
+void walk_dir(struct walk *w, int dirfd, size_t len)
+{
+	char *buf = xcalloc(1, WALK_BUFSIZ);
+	ssize_t n;
+
+	while ((n = getdents64(dirfd, buf, WALK_BUFSIZ)) > 0) {
+		for (ssize_t off = 0; off < n;) {
+			struct dirent64 *d = (struct dirent64 *) (buf + off);
+			size_t name_len = strlen(d->d_name);
+			unsigned char type;
+
+			off += d->d_reclen;
+
+			if (d->d_name[0] == '.' &&
+			    (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+				continue;
+
+			if (len + name_len + 2 > sizeof(w->path)) {
+				w->path[len] = '\0';
+				warnx("path is too long: %s/%s", w->path, d->d_name);
+				continue;
+			}
+
+			w->path[len] = '/';
+			memcpy(w->path + len + 1, d->d_name, name_len + 1);
+
+			if ((type = entry_type(dirfd, d, w->path)) == DT_UNKNOWN)
+				continue;
+
+			walk_add(w, len + name_len + 1);
+
+			if (type == DT_DIR) {
+				int fd = openat(dirfd, d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+				if (fd < 0) {
+					warn("open: %s", w->path);
+					continue;
+				}
+
+				walk_dir(w, fd, len + name_len + 1);
+				close(fd);
+			}
+		}
+	}
+
+	w->path[len] = '\0';
+
+	if (n < 0)
+		warn("getdents64: %s", w->path);
+
+	free(buf);
+}
+
+/*
+ * Same as lstat(2), but only the fields used by the program are requested.
+ * The device numbers are always filled by the kernel.
+ */
+int walk_stat(const char *path, struct stat *sb)
+{
+	struct statx stx;
+
+	if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_MASK, &stx) < 0)
+		return -1;
+
+	memset(sb, 0, sizeof(*sb));
+
+	sb->st_dev          = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	sb->st_rdev         = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	sb->st_ino          = stx.stx_ino;
+	sb->st_mode         = stx.stx_mode;
+	sb->st_uid          = stx.stx_uid;
+	sb->st_gid          = stx.stx_gid;
+	sb->st_size         = (off_t) stx.stx_size;
+	sb->st_mtim.tv_sec  = stx.stx_mtime.tv_sec;
+	sb->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+
+	return 0;
+}
+
+void walk_directory(const char *path)
+{
+	struct walk *w;
+	size_t len = strlen(path);
+	int fd;
+
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+
+	if (len >= PATH_MAX) {
+		warnx("path is too long: %s", path);
+		return;
+	}
+
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		warn("open: %s", path);
+		return;
+	}
+
+	w = xcalloc(1, sizeof(*w));
+
+	memcpy(w->path, path, len);
+	w->path[len] = '\0';
+
+	walk_dir(w, fd, len);
+	walk_flush(w);
+
+	close(fd);
+	free(w);
+}
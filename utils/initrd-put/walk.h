@@ -0,0 +1,10 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef __INITRD_PUT_WALK_H__
+#define __INITRD_PUT_WALK_H__
+
+#include <sys/stat.h>
+
+int walk_stat(const char *path, struct stat *sb) __attribute__((__nonnull__ (1, 2)));
+void walk_directory(const char *path) __attribute__((__nonnull__ (1)));
+
+#endif // __INITRD_PUT_WALK_H__